@@ -0,0 +1,130 @@
+/**
+ * Microbenchmark of the cost of looking up a name in a directory block of fixed size dentries:
+ *   strcmp   - strcmp() against every dentry (the scan without tags)
+ *   scalar   - compare the tags one at a time, strcmp() only the matching dentries
+ *   simd     - compare all the tags at once (dtags_match()), strcmp() only the matching dentries
+ * All three must find the same entries.
+ *
+ * Usage: bench_dirscan [num_blocks] [num_lookups]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../a1fs.h"
+#include "../dtags.h"
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int scan_strcmp(a1fs_dentry *blk, const uint8_t *tags, const char *name, uint8_t tag)
+{
+    (void)tags;
+    (void)tag;
+    for(uint32_t d_ind = 0; d_ind < NUM_DENTRY_PER_BLOCK; d_ind++)
+    {
+        if(0 == strcmp(blk[d_ind].name, name)) return blk[d_ind].ino;
+    }
+    return -1;
+}
+
+static int scan_tags(a1fs_dentry *blk, uint32_t match, const char *name)
+{
+    for(; 0 != match; match &= match - 1)
+    {
+        a1fs_dentry *cur_entry = &blk[__builtin_ctz(match)];
+        if(0 == strcmp(cur_entry->name, name)) return cur_entry->ino;
+    }
+    return -1;
+}
+
+static int scan_scalar(a1fs_dentry *blk, const uint8_t *tags, const char *name, uint8_t tag)
+{
+    return scan_tags(blk, dtags_match_scalar(tags, tag), name);
+}
+
+static int scan_simd(a1fs_dentry *blk, const uint8_t *tags, const char *name, uint8_t tag)
+{
+    return scan_tags(blk, dtags_match(tags, tag), name);
+}
+
+typedef int (*scan_fn)(a1fs_dentry *blk, const uint8_t *tags, const char *name, uint8_t tag);
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_blocks  = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024;
+    uint32_t num_lookups = argc > 2 ? strtoul(argv[2], NULL, 10) : 256;
+
+    // Fill the blocks with typical 10-20 byte names, with a common prefix to make strcmp() work harder
+    a1fs_dentry *blks = calloc(num_blocks * NUM_DENTRY_PER_BLOCK, sizeof(a1fs_dentry));
+    uint8_t *tags = calloc(num_blocks * NUM_DENTRY_PER_BLOCK, 1);
+    if(NULL == blks || NULL == tags) return 1;
+    srand(369);
+    for(uint32_t i = 0; i < num_blocks * NUM_DENTRY_PER_BLOCK; i++)
+    {
+        blks[i].ino = i + 1;
+        snprintf(blks[i].name, A1FS_NAME_MAX, "file_%0*u", 5 + rand() % 10, i);
+        tags[i] = dtag_of(blks[i].name);
+    }
+
+    // Half of the looked up names exist, the other half don't (e.g. the lookup before a create)
+    char (*names)[A1FS_NAME_MAX] = calloc(num_lookups, A1FS_NAME_MAX);
+    uint8_t *name_tags = calloc(num_lookups, 1);
+    if(NULL == names || NULL == name_tags) return 1;
+    for(uint32_t i = 0; i < num_lookups; i++)
+    {
+        if(i % 2) strcpy(names[i], blks[rand() % (num_blocks * NUM_DENTRY_PER_BLOCK)].name);
+        else snprintf(names[i], A1FS_NAME_MAX, "missing_%u", i);
+        name_tags[i] = dtag_of(names[i]);
+    }
+
+    const char *labels[] = { "strcmp", "scalar", "simd" };
+    scan_fn scans[] = { scan_strcmp, scan_scalar, scan_simd };
+    long checksums[3];
+    for(int s = 0; s < 3; s++)
+    {
+        // Each lookup scans every block, like a linear directory scan for a missing name
+        long checksum = 0;
+        double start = now_ns();
+        for(uint32_t l = 0; l < num_lookups; l++)
+        {
+            for(uint32_t b = 0; b < num_blocks; b++)
+            {
+                checksum += scans[s](&blks[b * NUM_DENTRY_PER_BLOCK], &tags[b * NUM_DENTRY_PER_BLOCK],
+                                     names[l], name_tags[l]);
+            }
+        }
+        double elapsed = now_ns() - start;
+        checksums[s] = checksum;
+        printf("%-8s %8.2f ns/block\n", labels[s], elapsed / ((double)num_lookups * num_blocks));
+    }
+
+    // The scans must agree with each other
+    if(checksums[0] != checksums[1] || checksums[0] != checksums[2])
+    {
+        fprintf(stderr, "Mismatched results: %ld %ld %ld\n", checksums[0], checksums[1], checksums[2]);
+        return 1;
+    }
+    for(uint32_t i = 0; i < num_blocks * NUM_DENTRY_PER_BLOCK; i += NUM_DENTRY_PER_BLOCK)
+    {
+        for(int tag = 0; tag < 256; tag++)
+        {
+            if(dtags_match(&tags[i], tag) != dtags_match_scalar(&tags[i], tag))
+            {
+                fprintf(stderr, "dtags_match() differs from dtags_match_scalar()\n");
+                return 1;
+            }
+        }
+    }
+    free(blks);
+    free(tags);
+    free(names);
+    free(name_tags);
+    return 0;
+}
@@ -0,0 +1,150 @@
+/**
+ * Benchmark of the cost of freeing the data blocks of a large file (on unlink or truncate):
+ *   block    - free_block_range() on every block (the loops unlink and truncate used to have)
+ *   extent   - free_blocks_from(), one range per extent, plus the extent tree nodes
+ * The file is split into many extents (so its extent tree has several levels) by interleaving its allocations
+ * with those of another file. Both must leave the same number of free blocks, and unlinking the files
+ * must return every block they used.
+ *
+ * Usage: bench_unlink [image_mb] [num_extents] [image_path]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../a1fs.h"
+#include "../bitmap.h"
+#include "../etree.h"
+#include "../fs_ctx.h"
+#include "../fs_utils.h"
+#include "../map.h"
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * Allocate num_extents extents of the same size to /big, with a block of /spacer between them
+*/
+static a1fs_inode *make_big_file(uint32_t num_extents, uint32_t extent_blocks, fs_ctx *fs)
+{
+    a1fs_inode *big = &fs->inode_table[path_lookup("/big", fs)];
+    a1fs_inode *spacer = &fs->inode_table[path_lookup("/spacer", fs)];
+    for(uint32_t i = 0; i < num_extents; i++)
+    {
+        if(0 != allocate_data_blocks(big, (uint64_t)extent_blocks * A1FS_BLOCK_SIZE, fs)) return NULL;
+        big->size += (uint64_t)extent_blocks * A1FS_BLOCK_SIZE;
+        if(0 != allocate_data_blocks(spacer, A1FS_BLOCK_SIZE, fs)) return NULL;
+        spacer->size += A1FS_BLOCK_SIZE;
+    }
+    return big;
+}
+
+/**
+ * Free the blocks of a file one at a time
+*/
+static void free_per_block(a1fs_inode *inode, fs_ctx *fs)
+{
+    etree_cursor cursor;
+    for(a1fs_extent *extent = etree_seek(&cursor, inode, 0, fs); NULL != extent; extent = etree_next(&cursor, fs))
+    {
+        for(a1fs_blk_t b = extent->start; b < extent->start + extent->count; b++) free_block_range(b, 1, fs);
+        inode->num_blocks -= extent->count;
+        extent->count = 0;
+    }
+    // The empty extents are left, for the tree nodes to be freed along with them
+    free_blocks_from(inode, 0, fs);
+}
+
+static void free_per_extent(a1fs_inode *inode, fs_ctx *fs)
+{
+    free_blocks_from(inode, 0, fs);
+}
+
+typedef void (*free_fn)(a1fs_inode *inode, fs_ctx *fs);
+
+int main(int argc, char *argv[])
+{
+    uint32_t image_mb    = argc > 1 ? strtoul(argv[1], NULL, 10) : 1024;
+    uint32_t num_extents = argc > 2 ? strtoul(argv[2], NULL, 10) : 500;
+    const char *path     = argc > 3 ? argv[3] : "/tmp/bench_unlink.img";
+    // Use about half of the image for the file
+    uint32_t extent_blocks = (uint32_t)((uint64_t)image_mb * (1 << 20) / A1FS_BLOCK_SIZE / 2 / num_extents);
+    if(0 == extent_blocks)
+    {
+        fprintf(stderr, "The image is too small for %u extents\n", num_extents);
+        return 1;
+    }
+
+    // The debug output of the file system (see VERBOSE) would swamp the results
+    FILE *out = fdopen(dup(STDOUT_FILENO), "w");
+    if(NULL == out || NULL == freopen("/dev/null", "w", stdout)) return 1;
+
+    const char *labels[] = { "block", "extent" };
+    free_fn frees[] = { free_per_block, free_per_extent };
+    uint32_t free_after[2];
+    for(int f = 0; f < 2; f++)
+    {
+        // Format a new image for each run
+        char cmd[4096];
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0 || ftruncate(fd, (off_t)image_mb << 20) < 0) return 1;
+        close(fd);
+        snprintf(cmd, sizeof(cmd), "./mkfs.a1fs -i 64 %s > /dev/null", path);
+        if(0 != system(cmd)) return 1;
+
+        size_t size;
+        void *image = map_file(path, A1FS_BLOCK_SIZE, &size);
+        fs_ctx fs = {0};
+        if(NULL == image || !fs_ctx_init(&fs, image, size)) return 1;
+        if(0 != add_dir_entry("/big", S_IFREG | 0644, 1, &fs)) return 1;
+        if(0 != add_dir_entry("/spacer", S_IFREG | 0644, 1, &fs)) return 1;
+        // The root directory's block stays allocated after the files are unlinked
+        uint32_t num_free = pcounter_sum(&fs.free_dblocks);
+        a1fs_inode *big = make_big_file(num_extents, extent_blocks, &fs);
+        if(NULL == big || 0 == big->etree_root.depth)
+        {
+            fprintf(stderr, "Couldn't allocate %u extents of %u blocks\n", num_extents, extent_blocks);
+            return 1;
+        }
+
+        uint32_t num_blocks = allocated_blocks(big, &fs);
+        double start = now_ns();
+        frees[f](big, &fs);
+        double elapsed = now_ns() - start;
+        free_after[f] = pcounter_sum(&fs.free_dblocks);
+        fprintf(out, "%-8s %10.3f ms %8.2f ns/block (%u blocks in %u extents)\n", labels[f], elapsed / 1e6,
+                elapsed / num_blocks, num_blocks, num_extents);
+
+        // Unlinking both files must give back all of their blocks
+        remove_dir_entry("/big", &fs);
+        remove_dir_entry("/spacer", &fs);
+        uint32_t n = fs.superblock->num_tot_dblocks;
+        uint32_t num_free_now = pcounter_sum(&fs.free_dblocks);
+        if(num_free_now != num_free || n - bitmap_count_set(fs.d_bitmap, 0, n) != num_free_now)
+        {
+            fprintf(stderr, "%s: %u free blocks after unlink, %u before\n", labels[f], num_free_now, num_free);
+            return 1;
+        }
+        fs_ctx_sync(&fs);
+        munmap(image, size);
+        fs_ctx_destroy(&fs);
+    }
+    unlink(path);
+    fclose(out);
+
+    // The frees must agree with each other
+    if(free_after[0] != free_after[1])
+    {
+        fprintf(stderr, "Mismatched free counts: %u %u\n", free_after[0], free_after[1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+/**
+ * Checks the word at a time bitmap functions against the one bit at a time reference implementations,
+ * on random bitmaps of various sizes (including ones which don't end on a word or byte boundary) and
+ * densities. The bitmaps are allocated with exactly as many bytes as they need.
+ *
+ * Usage: test_bitmap [seed]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../bitmap.h"
+
+static int failures = 0;
+
+#define EXPECT_EQ(a, b, what, nbits, start, count) do { \
+    if((a) != (b)) { \
+        printf("FAIL %s: nbits %u start %u count %u: got %u expected %u\n", what, nbits, start, count, \
+               (unsigned)(a), (unsigned)(b)); \
+        failures++; \
+    } } while(0)
+
+/** Fill a bitmap with random runs of set and clear bits, about density percent of them set */
+static void fill_random(char *bm, uint32_t nbits, int density)
+{
+    memset(bm, 0, (nbits + 7) / 8);
+    for(uint32_t b = 0; b < nbits;)
+    {
+        uint32_t run = 1 + rand() % (rand() % 4 ? 8 : 300);
+        if(b + run > nbits) run = nbits - b;
+        if(rand() % 100 < density) bitmap_set_range_scalar(bm, b, run);
+        b += run;
+    }
+}
+
+/** Brute force bitmap_find_zero_run() */
+static uint32_t find_zero_run_ref(const char *bm, uint32_t nbits, uint32_t needed, uint32_t *len)
+{
+    uint32_t max_s = nbits, max_len = 0;
+    for(uint32_t s = 0; s < nbits; s++)
+    {
+        if(bitmap_test(bm, s)) continue;
+        uint32_t l = 0;
+        while(s + l < nbits && !bitmap_test(bm, s + l)) l++;
+        if(l >= needed)
+        {
+            *len = l;
+            return s;
+        }
+        if(l > max_len)
+        {
+            max_len = l;
+            max_s = s;
+        }
+        s += l;
+    }
+    *len = max_len;
+    return max_s;
+}
+
+static void test_size(uint32_t nbits)
+{
+    uint32_t nbytes = (nbits + 7) / 8;
+    char *bm = malloc(nbytes), *ref = malloc(nbytes);
+    for(int density = 0; density <= 100; density += 25)
+    {
+        fill_random(bm, nbits, density);
+        for(int i = 0; i < 200; i++)
+        {
+            uint32_t start = rand() % (nbits + 1);
+            uint32_t count = rand() % (nbits - start + 1);
+
+            EXPECT_EQ(bitmap_find_next_zero(bm, nbits, start), bitmap_find_next_zero_scalar(bm, nbits, start),
+                      "find_next_zero", nbits, start, 0);
+            EXPECT_EQ(bitmap_find_next_set(bm, nbits, start), bitmap_find_next_set_scalar(bm, nbits, start),
+                      "find_next_set", nbits, start, 0);
+            EXPECT_EQ(bitmap_count_set(bm, start, count), bitmap_count_set_scalar(bm, start, count),
+                      "count_set", nbits, start, count);
+
+            uint32_t needed = 1 + rand() % 400, len, ref_len;
+            uint32_t run = bitmap_find_zero_run(bm, nbits, needed, &len);
+            EXPECT_EQ(run, find_zero_run_ref(bm, nbits, needed, &ref_len), "find_zero_run", nbits, 0, needed);
+            EXPECT_EQ(len, ref_len, "find_zero_run length", nbits, 0, needed);
+
+            memcpy(ref, bm, nbytes);
+            if(rand() % 2)
+            {
+                bitmap_set_range(bm, start, count);
+                bitmap_set_range_scalar(ref, start, count);
+            }else
+            {
+                bitmap_clear_range(bm, start, count);
+                bitmap_clear_range_scalar(ref, start, count);
+            }
+            EXPECT_EQ(memcmp(bm, ref, nbytes), 0, "set/clear_range", nbits, start, count);
+        }
+    }
+    free(bm);
+    free(ref);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned seed = argc > 1 ? strtoul(argv[1], NULL, 10) : 369;
+    srand(seed);
+
+    uint32_t sizes[] = {1, 7, 8, 9, 63, 64, 65, 127, 128, 255, 256, 257, 1000, 4096, 32768, 100003};
+    for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) test_size(sizes[i]);
+
+    if(0 != failures)
+    {
+        printf("bitmap: %d failures (seed %u)\n", failures, seed);
+        return 1;
+    }
+    printf("bitmap: all tests passed\n");
+    return 0;
+}
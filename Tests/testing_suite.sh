@@ -30,13 +30,30 @@ ls -aR
 echo "1.6 - Make sure the number of allocated inodes and data blocks is correct"
 stat -f . | head -3
 stat -f . | tail -2
-echo "1.7 - Use an indirect block"
+echo "1.7 - Fill root with enough entries for several blocks"
 for ext_num in {1..10}
 do
     for i in {1..15}; do mkdir "dir$ext_num-$i"; done && truncate -s 1 "file$ext_num"
 done
-mkdir indirect
+mkdir last
 ls
+echo "1.8 - Interleave appends to two files, so their extents no longer fit in the inode"
+stat -f -c %f .
+COPY=$(mktemp -d)
+for i in {1..8}
+do
+    head -c 4K /dev/urandom | tee -a $COPY/a >> a
+    head -c 4K /dev/urandom | tee -a $COPY/b >> b
+done
+cmp a $COPY/a && cmp b $COPY/b
+stat -f -c %f . # 16 data blocks, and a node block for each file's extents
+truncate -s 4K a
+stat -f -c %f . # The extents that are left fit in the inode again, the node block is freed
+rm b
+stat -f -c %f .
+rm a
+stat -f -c %f .
+rm -r $COPY
 ) > Tests/test-directories
 diff --color=always -y --suppress-common-lines Tests/test-directories Tests/correct-directories
 
@@ -78,7 +95,7 @@ fusermount -u $MOUNT_POINT
 ./mkfs.a1fs -z -i 256 Images/256KB_256I_image && ./a1fs Images/256KB_256I_image $MOUNT_POINT
 
 # Reading and writing files
-echo "Testing Reading and Writing"
+readwrite_tests() {
 (cd $MOUNT_POINT && echo "Testing Reading and Writing" &&
 echo "3.0 - Writing to an empty file and then reading its content"
 touch file
@@ -101,8 +118,167 @@ echo "3.6 - Writing and leaving a hole in the middle"
 echo "HelloWorld" > file2
 echo -n 'AfterHole' > temp; dd oflag=seek_bytes seek=15  conv=notrunc if=temp of=file2 status=none; rm temp
 xxd file2
+echo "3.7 - Writing past the end of a file"
+echo -n 'Past' | dd oflag=seek_bytes seek=8192 conv=notrunc of=file2 status=none
+stat -c %s file2
+xxd -a file2
+stat -f -c %f .
+echo "3.8 - Syncing a file while it is open"
+exec 3> file3
+head -c 8K /dev/zero | tr '\0' 'x' >&3
+stat -f -c %f . # With delayed allocation the blocks are only reserved, the count is the same
+sync file3
+stat -c %b file3 # Its blocks are allocated by now
+stat -f -c %f .
+exec 3>&-
+od -A d -c file3
+stat -f -c %f .
 ) > Tests/test-readwrite
  diff --color=always -y --suppress-common-lines Tests/test-readwrite Tests/correct-readwrite
+}
+echo "Testing Reading and Writing"
+readwrite_tests
+
+# Unmount and remake an empty file system, mounted with delayed allocation
+fusermount -u $MOUNT_POINT
+./mkfs.a1fs -z -i 256 Images/256KB_256I_image && ./a1fs Images/256KB_256I_image $MOUNT_POINT -o delalloc
+
+# Reading and writing files again, the results are the same
+echo "Testing Reading and Writing with delayed allocation"
+readwrite_tests
+
+# Unmount and remake an empty file system
+fusermount -u $MOUNT_POINT
+./mkfs.a1fs -z -i 256 Images/256KB_256I_image && ./a1fs Images/256KB_256I_image $MOUNT_POINT
+
+# Allocating, zeroing and punching holes with fallocate
+echo "Testing fallocate"
+(cd $MOUNT_POINT && echo "Testing fallocate" &&
+stat -f -c %f .
+echo "4.0 - Allocating a new file"
+fallocate -l 16K file
+stat -c %s file
+stat -c %b file # 4 blocks of 8 sectors
+xxd -a file # The blocks are unwritten, they read as zeros
+stat -f -c %f . # 4 blocks, and 1 for the entry in root
+echo "4.1 - Allocating past the end, keeping the size"
+fallocate -n -o 16K -l 16K file
+stat -c %s file
+stat -c %b file
+stat -f -c %f .
+echo "4.2 - Zeroing a range of the data"
+head -c 16K /dev/zero | tr '\0' 'a' | dd conv=notrunc of=file status=none
+fallocate -z -o 1K -l 2K file
+stat -c %s file
+od -A d -c file
+stat -f -c %f . # Zeroed in place, nothing is allocated or freed
+echo "4.3 - Punching a hole in the middle"
+fallocate -p -o 5K -l 8K file
+stat -c %s file
+stat -c %b file # The one block the hole covers whole is freed, the rest is zeroed
+od -A d -c file
+stat -f -c %f .
+echo "4.4 - Punching out the blocks past the end"
+fallocate -p -o 16K -l 16K file
+stat -c %s file
+stat -c %b file
+stat -f -c %f .
+) > Tests/test-fallocate
+diff --color=always -y --suppress-common-lines Tests/test-fallocate Tests/correct-fallocate
+
+# Unmount and remake an empty file system
+fusermount -u $MOUNT_POINT
+./mkfs.a1fs -z -i 256 Images/256KB_256I_image && ./a1fs Images/256KB_256I_image $MOUNT_POINT
+
+# Sparse files and unwritten extents
+echo "Testing Sparse Files"
+(cd $MOUNT_POINT && echo "Testing Sparse Files" &&
+stat -f -c %f .
+echo "5.0 - Extending a file far past the size of the disk"
+truncate -s 1G sparse
+stat -c %s sparse
+du sparse # The whole file is a hole, no blocks are allocated or zeroed
+stat -f -c %f . # Only the entry in root needs a block
+echo "5.1 - Reading a hole"
+echo -n 'Hello' | dd oflag=seek_bytes seek=8192 conv=notrunc of=hole status=none
+stat -c %s hole
+du hole # Only the block written to is allocated
+xxd -a hole
+stat -f -c %f .
+echo "5.2 - Writing into the middle of an allocated range"
+fallocate -l 32K prealloc
+stat -f -c %f .
+echo -n 'Middle' | dd oflag=seek_bytes seek=12388 conv=notrunc of=prealloc status=none
+stat -c %s prealloc
+du prealloc
+xxd -a prealloc # The unwritten extent is split around the written block, the rest still reads as zeros
+stat -f -c %f . # Nothing new is allocated
+echo "5.3 - Removing the files"
+rm sparse hole prealloc
+stat -f -c %f .
+) > Tests/test-sparse
+diff --color=always -y --suppress-common-lines Tests/test-sparse Tests/correct-sparse
+
+# Unmount and remake an empty file system
+fusermount -u $MOUNT_POINT
+./mkfs.a1fs -z -i 256 Images/256KB_256I_image && ./a1fs Images/256KB_256I_image $MOUNT_POINT
+
+# Defragmenting files while mounted
+echo "Testing Defragmentation"
+DEFRAG=$PWD/defrag.a1fs
+(cd $MOUNT_POINT && echo "Testing Defragmentation" &&
+echo "6.0 - Defragmenting a file"
+COPY=$(mktemp -d)
+for i in {1..8}
+do
+    head -c 4K /dev/urandom | tee -a $COPY/a >> a
+    head -c 4K /dev/urandom | tee -a $COPY/b >> b
+done
+stat -f -c %f .
+$DEFRAG a # The 8 blocks of a are moved into a single extent
+cmp a $COPY/a
+stat -f -c %f . # The node block of its extents is freed
+echo "6.1 - Defragmenting all the files, waiting for the pass to finish"
+$DEFRAG -w . | tail -1 # root, a and b
+cmp a $COPY/a && cmp b $COPY/b
+stat -f -c %f .
+echo "6.2 - Printing the stats of the last pass"
+$DEFRAG -s .
+rm -r $COPY
+) > Tests/test-defrag
+diff --color=always -y --suppress-common-lines Tests/test-defrag Tests/correct-defrag
+
+# Unmount and remake an empty file system
+fusermount -u $MOUNT_POINT
+./mkfs.a1fs -z -i 256 Images/256KB_256I_image && ./a1fs Images/256KB_256I_image $MOUNT_POINT
+
+# Freeing the blocks of removed files in the background
+echo "Testing Reclaiming"
+(cd $MOUNT_POINT && echo "Testing Reclaiming" &&
+echo "7.0 - Removing a large file"
+head -c 128K /dev/urandom > big
+stat -f -c %f .
+stat -f -c %a .
+rm big
+stat -f -c %f . # Its blocks count as free right away
+sleep 1
+stat -f -c %a . # And are available once the reclaimer has freed them
+echo "7.1 - Killing the file system right after removing a file"
+head -c 128K /dev/urandom > big
+rm big
+) > Tests/test-reclaim
+# The file may still be on the orphan list in the image, it is freed when mounted again
+pkill -9 -f "a1fs Images/256KB_256I_image"
+while pgrep -f "a1fs Images/256KB_256I_image" > /dev/null; do sleep 0.1; done
+fusermount -u -z $MOUNT_POINT
+./a1fs Images/256KB_256I_image $MOUNT_POINT
+(cd $MOUNT_POINT &&
+stat -f -c %f .
+sleep 1
+stat -f -c %a .
+stat -f -c %d .
+) >> Tests/test-reclaim
+diff --color=always -y --suppress-common-lines Tests/test-reclaim Tests/correct-reclaim
 
 # Unmount and exit
 fusermount -u $MOUNT_POINT
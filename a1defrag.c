@@ -0,0 +1,75 @@
+/**
+ * CSC369 Assignment 1 - a1fs online defragmentation tool.
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "a1fs.h"
+
+static const char *help_str = "\
+Usage: %s [options] path\n\
+\n\
+Defragment a file of a mounted a1fs file system. If path is a directory,\n\
+all the files of the file system are defragmented in the background.\n\
+\n\
+Options:\n\
+    -r num  the most blocks to move per second (default: the file system's)\n\
+    -s      only print the progress of the defragmenter\n\
+    -w      wait for the background pass to finish, printing its progress\n\
+    -h      print help and exit\n\
+";
+
+static void print_stats(const a1fs_defrag_stats *stats)
+{
+	printf("%s: %u/%u inodes, %lu files defragmented, %lu extents merged, %lu blocks moved\n",
+	       stats->running ? "running" : "idle", stats->inodes_done, stats->inodes_total,
+	       stats->files_defragged, stats->extents_merged, stats->blocks_moved);
+}
+
+int main(int argc, char *argv[])
+{
+	a1fs_defrag_args args = {0};
+	bool stats_only = false, wait = false;
+	int o;
+	while ((o = getopt(argc, argv, "r:swh")) != -1) {
+		switch (o) {
+			case 'r': args.rate = strtoul(optarg, NULL, 10); break;
+			case 's': stats_only = true; break;
+			case 'w': wait = true; break;
+			case 'h': printf(help_str, argv[0]); return 0;
+			default : fprintf(stderr, help_str, argv[0]); return 1;
+		}
+	}
+	if (optind >= argc) {
+		fprintf(stderr, "Missing path\n");
+		return 1;
+	}
+
+	int fd = open(argv[optind], O_RDONLY);
+	if (fd < 0) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (!stats_only && ioctl(fd, A1FS_IOC_DEFRAG, &args) < 0) {
+		perror("A1FS_IOC_DEFRAG");
+		close(fd);
+		return 1;
+	}
+
+	a1fs_defrag_stats stats;
+	do {
+		if (ioctl(fd, A1FS_IOC_DEFRAG_STATS, &stats) < 0) {
+			perror("A1FS_IOC_DEFRAG_STATS");
+			close(fd);
+			return 1;
+		}
+		print_stats(&stats);
+	} while (wait && stats.running && 0 == sleep(1));
+	close(fd);
+	return 0;
+}
@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <linux/falloc.h>
 
 // Using 2.9.x FUSE API
 #define FUSE_USE_VERSION 29
@@ -31,6 +32,9 @@
 #include "options.h"
 #include "map.h"
 #include "fs_utils.h"
+#include "defrag.h"
+#include "dir.h"
+#include "util.h"
 
 //NOTE: All path arguments are absolute paths within the a1fs file system and
 // start with a '/' that corresponds to the a1fs root directory.
@@ -64,7 +68,9 @@ static bool a1fs_init(fs_ctx *fs, a1fs_opts *opts)
 	void *image = map_file(opts->img_path, A1FS_BLOCK_SIZE, &size);
 	if (!image) return false;
 
-	return fs_ctx_init(fs, image, size);
+	if (!fs_ctx_init(fs, image, size)) return false;
+	fs->delalloc.enabled = opts->delalloc;
+	return true;
 }
 
 /**
@@ -77,6 +83,10 @@ static void a1fs_destroy(void *ctx)
 {
 	fs_ctx *fs = (fs_ctx*)ctx;
 	if (fs->image) {
+		stop_defrag(fs);
+		flush_all_inodes(fs);
+		stop_reclaimer(fs);
+		fs_ctx_sync(fs);
 		munmap(fs->image, fs->size);
 		fs_ctx_destroy(fs);
 	}
@@ -88,6 +98,106 @@ static fs_ctx *get_fs(void)
 	return (fs_ctx*)fuse_get_context()->private_data;
 }
 
+/**
+ * Start the background work of the file system, once FUSE is running.
+ *
+ * Called when the file system is mounted, after FUSE has forked into the
+ * background (so the threads started in a1fs_init() would be lost).
+ *
+ * @param conn  the capabilities of the FUSE connection (unused).
+ * @return      the file system context, as the private data of the operations.
+ */
+static void *a1fs_start(struct fuse_conn_info *conn)
+{
+	(void)conn;// unused
+	fs_ctx *fs = get_fs();
+	// Without the reclaimer unlinked files are freed right away, so the file system still works
+	if (0 != start_reclaimer(fs)) fprintf(stderr, "Failed to start the reclaimer\n");
+	return fs;
+}
+
+/** State of an open file or directory, stored in fuse_file_info->fh. */
+typedef struct a1fs_fh {
+	/** The inode number, so the path doesn't need to be looked up again. */
+	a1fs_ino_t ino;
+	/** The generation of the inode when it was opened, which changes if the file is removed. */
+	uint32_t generation;
+	/** The extent of the last block accessed through the handle. */
+	a1fs_extent_hint hint;
+} a1fs_fh;
+
+/** Get the handle of an open file; NULL if there is none (e.g. truncate() by path). */
+static a1fs_fh *get_fh(struct fuse_file_info *fi)
+{
+	return NULL == fi ? NULL : (a1fs_fh *)(uintptr_t)fi->fh;
+}
+
+/**
+ * Create a handle for a file or directory, and store it in fi->fh.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path  path to the file or directory.
+ * @param fi    the file info which receives the handle.
+ * @return      0 on success; -errno on error.
+ */
+static int fh_open(const char *path, struct fuse_file_info *fi)
+{
+	fs_ctx *fs = get_fs();
+	int ino = path_lookup(path, fs);
+	if(ino < 0) return ino;
+
+	a1fs_fh *fh = malloc(sizeof(a1fs_fh));
+	if(NULL == fh) return -ENOMEM;
+	fh->ino = ino;
+	fh->generation = fs->inode_table[ino].generation;
+	fh->hint.index = 0;
+	fi->fh = (uintptr_t)fh;
+	return 0;
+}
+
+/**
+ * Lock the inode of a file for an operation. With a handle the inode number is known; otherwise the
+ * path is looked up, and the namespace stays locked so the file isn't removed during the operation.
+ *
+ * @param fs     the file system context.
+ * @param path   path to the file, used if there is no handle.
+ * @param fh     the handle of the file; may be NULL.
+ * @param write  true to lock the inode for writing; false for reading.
+ * @return       the inode number on success (it must be unlocked with unlock_file());
+ *               -errno on error (nothing is locked).
+ */
+static int lock_file(fs_ctx *fs, const char *path, a1fs_fh *fh, bool write)
+{
+	int ino;
+	if (NULL != fh) {
+		ino = fh->ino;
+	} else {
+		pthread_rwlock_rdlock(&fs->ns_lock);
+		if ((ino = path_lookup(path, fs)) < 0) {
+			pthread_rwlock_unlock(&fs->ns_lock);
+			return ino;
+		}
+	}
+	fs_lock_inode(fs, ino, write);
+	return ino;
+}
+
+/** Unlock a file locked by lock_file(). */
+static void unlock_file(fs_ctx *fs, a1fs_ino_t ino, a1fs_fh *fh)
+{
+	fs_unlock_inode(fs, ino);
+	if (NULL == fh) pthread_rwlock_unlock(&fs->ns_lock);
+}
+
+/** Free the handle of a file or directory. */
+static void fh_release(struct fuse_file_info *fi)
+{
+	free(get_fh(fi));
+	fi->fh = 0;
+}
+
 
 /**
  * Get file system statistics.
@@ -116,18 +226,51 @@ static int a1fs_statfs(const char *path, struct statvfs *st)
 	
 	// The total number of blocks and the number of free blocks (all of which are data blocks)
 	st->f_blocks  = fs->superblock->size / A1FS_BLOCK_SIZE;
-	st->f_bfree   = fs->superblock->num_free_dblocks;
-	st->f_bavail  = st->f_bfree;
+	// Preallocated blocks are given up when the space is needed, so they count as free. The reserved
+	// blocks include claims of allocations in progress, which may briefly be more than the free blocks
+	// The free count is summed with its per-CPU deltas, so it is exact
+	uint64_t free_blocks = (uint64_t)pcounter_sum(&fs->free_dblocks) + AtomicLoad(&fs->prealloc_blocks);
+	uint64_t reserved = AtomicLoad(&fs->delalloc.reserved_blocks);
+	st->f_bavail  = free_blocks > reserved ? free_blocks - reserved : 0;
+	// The blocks of unlinked files which the reclaimer is yet to free are no longer used, but they are
+	// only available once freed. So they are reported as the difference of the free and available blocks
+	st->f_bfree   = st->f_bavail + AtomicLoad(&fs->pending_free_blocks);
 	
 	// The total number of inodes and the number of free inodes 
 	st->f_files  = fs->superblock->num_inodes;
-	st->f_ffree  = fs->superblock->num_free_inodes;
-	st->f_favail = st->f_ffree;
+	st->f_favail = AtomicLoad(&fs->superblock->num_free_inodes);
+	// Like their blocks, the inodes of the orphans are reported as free but not available
+	st->f_ffree  = st->f_favail + AtomicLoad(&fs->num_orphans);
 
 	st->f_namemax = A1FS_NAME_MAX;
 	return 0;
 }
 
+/**
+ * Fill in the attributes of a file from its inode. Fields a1fs doesn't support are left unchanged.
+ * The inode must be locked.
+ *
+ * @param fs     the file system context.
+ * @param ino    the inode number.
+ * @param inode  a pointer to the inode.
+ * @param st     pointer to the struct stat that receives the result.
+ */
+static void inode_to_stat(fs_ctx *fs, a1fs_ino_t ino, a1fs_inode *inode, struct stat *st)
+{
+	st->st_ino = ino;
+	st->st_mode = inode->mode;
+	st->st_nlink = inode->links;
+	st->st_size = inode->size;
+	pthread_mutex_lock(&fs->delalloc_lock);
+	da_buf *pending = delalloc_get(&fs->delalloc, ino);
+	if(NULL != pending) st->st_size += pending->len; // Written, but not allocated yet
+	pthread_mutex_unlock(&fs->delalloc_lock);
+	// The data blocks, so holes don't count (and inline data takes no blocks)
+	st->st_blocks = (blkcnt_t)inode->num_blocks * (A1FS_BLOCK_SIZE / 512);
+	if(inode->flags & A1FS_INODE_INLINE) st->st_blocks = 0;
+	st->st_mtim = inode->mtime;
+}
+
 /**
  * Get file or directory attributes.
  *
@@ -158,71 +301,116 @@ static int a1fs_getattr(const char *path, struct stat *st)
 	memset(st, 0, sizeof(*st));
 
 	int i;
-	if((i = path_lookup(path, fs))  < 0) return i;
+	if((i = lock_file(fs, path, NULL, false))  < 0) return i;
 	if(VERBOSE) printf("getaddr(%s) <inum=%d>\n", path, i);
-	a1fs_ino_t i_num = i;
-	a1fs_inode *inode = &fs->inode_table[i_num];
-	st->st_mode = inode->mode;
-	st->st_nlink = inode->links;
-	st->st_size = inode->size;
-	st->st_blocks = inode->size / 512; // Since it is inode->size/BLK_SIZE * BLK_SIZE/512
-	st->st_mtim = inode->mtime;
+	inode_to_stat(fs, i, &fs->inode_table[i], st);
+	unlock_file(fs, i, NULL);
 	return 0;
 }
 
+/** The arguments of a1fs_readdir() passed through dir_iterate() to readdir_cb(). */
+typedef struct readdir_ctx {
+	void *buf;
+	fuse_fill_dir_t filler;
+	fs_ctx *fs;
+	a1fs_ino_t dir_ino;
+	char path[A1FS_PATH_MAX]; // The path of the directory, followed by a '/' (except for the root)
+	size_t path_len;
+	bool cache_paths;         // Whether the path leads to the directory, so full paths can be cached
+} readdir_ctx;
+
+/** The offsets following "." and "..", the offsets following the entries are offset by READDIR_OFF_ENTRIES. */
+#define READDIR_OFF_DOT      1
+#define READDIR_OFF_DOTDOT   2
+#define READDIR_OFF_ENTRIES  2
+
+static int readdir_cb(const char *name, a1fs_ino_t ino, uint64_t next_pos, void *arg)
+{
+	readdir_ctx *ctx = (readdir_ctx *)arg;
+	fs_ctx *fs = ctx->fs;
+
+	// Listings are usually followed by a getattr() of each entry (e.g. ls -l), so the entry is added
+	// to the dcache, and its full path (if it fits) so the lookup doesn't walk from the root
+	pthread_mutex_lock(&fs->cache_lock);
+	dcache_insert(&fs->dcache, ctx->dir_ino, name, ino);
+	size_t name_len = strlen(name);
+	if(ctx->cache_paths && ctx->path_len + name_len < A1FS_PATH_MAX)
+	{
+		memcpy(ctx->path + ctx->path_len, name, name_len + 1);
+		dcache_insert(&fs->dcache, DCACHE_PATH_PARENT, ctx->path, ino);
+	}
+	pthread_mutex_unlock(&fs->cache_lock);
+
+	// Pass the attributes along, which gives the kernel the type of the entry
+	struct stat st;
+	memset(&st, 0, sizeof(st));
+	fs_lock_inode(fs, ino, false);
+	inode_to_stat(fs, ino, &fs->inode_table[ino], &st);
+	fs_unlock_inode(fs, ino);
+
+	// A full buffer stops the listing, which resumes from the offset of the last entry added
+	return ctx->filler(ctx->buf, name, &st, next_pos + READDIR_OFF_ENTRIES);
+}
+
 /**
  * Read a directory.
  *
  * Implements the readdir() system call. Should call filler(buf, name, NULL, 0)
  * for each directory entry. See fuse.h in libfuse source code for details.
+ * The attributes of each entry are passed to filler() as well.
+ *
+ * Uses the offset mode of filler(): each entry is passed with the offset that
+ * resumes the listing right after it (see dir_iterate()), so large directories
+ * are listed in as many calls as it takes to fill the buffers.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a directory.
  *
  * Errors:
- *   ENOMEM  not enough memory (e.g. a filler() call failed).
+ *   ENOENT  there is no handle, and "path" no longer exists.
  *
  * @param path    path to the directory.
  * @param buf     buffer that receives the result.
  * @param filler  function that needs to be called for each directory entry.
- *                Pass 0 as offset (4th argument). 3rd argument can be NULL.
- * @param offset  unused.
- * @param fi      unused.
+ * @param offset  the offset to resume the listing from, 0 for the start.
+ * @param fi      the handle from opendir().
  * @return        0 on success; -errno on error.
  */
 static int a1fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                         off_t offset, struct fuse_file_info *fi)
 {
-	if(VERBOSE) printf("readdir(%s)\n", path);
-	(void)offset;// unused
-	(void)fi;// unused
+	if(VERBOSE) printf("readdir(%s, %ld)\n", path, offset);
 	fs_ctx *fs = get_fs();
 
 	// The current and parent directories
-	filler(buf, "." , NULL, 0);
-	filler(buf, "..", NULL, 0);
+	if(offset < READDIR_OFF_DOT && 0 != filler(buf, "." , NULL, READDIR_OFF_DOT)) return 0;
+	if(offset < READDIR_OFF_DOTDOT && 0 != filler(buf, "..", NULL, READDIR_OFF_DOTDOT)) return 0;
 	
-	a1fs_ino_t i_num = path_lookup(path, fs);
+	// Directories are only changed with the namespace locked for writing
+	pthread_rwlock_rdlock(&fs->ns_lock);
+	a1fs_fh *fh = get_fh(fi);
+	int ret = NULL != fh ? (int)fh->ino : path_lookup(path, fs);
+	if (ret < 0) {
+		pthread_rwlock_unlock(&fs->ns_lock);
+		return ret;
+	}
+	a1fs_ino_t i_num = ret;
 	a1fs_inode *inode = &fs->inode_table[i_num];
-
-	a1fs_block_iterator b_iter;
-	block_iterator_init(inode, &b_iter, fs);
-
-	a1fs_dentry *cur_entry;
-	void *cur_blk;
-	// Iterate over the inode's data blocks
-	while(NULL != (cur_blk = block_iterator_next_blk(&b_iter, fs))){
-		// Iterate over the NUM_DENTRY_PER_BLOCK dir_entries in a block
-		for(uint32_t d_ind = 0; d_ind < NUM_DENTRY_PER_BLOCK; d_ind++)
-		{
-			cur_entry = (a1fs_dentry *) (cur_blk + d_ind * sizeof(a1fs_dentry));
-			// If the dir name is not the empty string, then that dir entry is allocated
-			if('\0' != *cur_entry->name)
-			{
-				if(0 != filler(buf, cur_entry->name, NULL, 0)) return -ENOMEM;
-			}
-		}
+	// An empty directory can be removed while it is open, and its inode reused (even by another
+	// directory). Its generation has changed since, and it has no entries
+	if (NULL != fh && fh->generation != inode->generation) {
+		pthread_rwlock_unlock(&fs->ns_lock);
+		return 0;
 	}
+
+	// The path of a handle may no longer lead to its directory, its entries are not cached under it
+	readdir_ctx ctx = { buf, filler, fs, i_num, "", 0, NULL == fh || path_lookup(path, fs) == ret };
+	ctx.path_len = strlen(path);
+	memcpy(ctx.path, path, ctx.path_len);
+	if(0 != strcmp(path, "/")) ctx.path[ctx.path_len++] = '/';
+	uint64_t pos = offset > READDIR_OFF_ENTRIES ? offset - READDIR_OFF_ENTRIES : 0;
+	dir_iterate(inode, pos, readdir_cb, &ctx, fs);
+	pthread_rwlock_unlock(&fs->ns_lock);
 	return 0;
 }
 
@@ -249,7 +437,10 @@ static int a1fs_mkdir(const char *path, mode_t mode)
 {	
 	if(VERBOSE) printf("mkdir(%s)\n", path);
 	fs_ctx *fs = get_fs();
-	return add_dir_entry(path, mode | S_IFDIR, 2, fs);
+	pthread_rwlock_wrlock(&fs->ns_lock);
+	int ret = add_dir_entry(path, mode | S_IFDIR, 2, fs);
+	pthread_rwlock_unlock(&fs->ns_lock);
+	return ret;
 }
 
 /**
@@ -270,31 +461,21 @@ static int a1fs_rmdir(const char *path)
 {
 	if(VERBOSE) printf("rmdir(%s)\n", path);
 	fs_ctx *fs = get_fs();
-	a1fs_inode *inode = &fs->inode_table[path_lookup(path, fs)];
+	pthread_rwlock_wrlock(&fs->ns_lock);
+	a1fs_ino_t ino = path_lookup(path, fs);
+	a1fs_inode *inode = &fs->inode_table[ino];
 
 	// Check if the directory is empty
-	a1fs_block_iterator b_iter;
-    block_iterator_init(inode, &b_iter, fs);
-
-	a1fs_dentry *cur_entry;
-    void *cur_blk;
-    // Iterate over the inodes data blocks
-    while(NULL != (cur_blk = block_iterator_next_blk(&b_iter, fs))){
-        // Iterate over the NUM_DENTRY_PER_BLOCK dir_entries in a block
-        for(uint32_t d_ind = 0; d_ind < NUM_DENTRY_PER_BLOCK; d_ind++)
-        {
-            cur_entry = (a1fs_dentry *) (cur_blk + d_ind * sizeof(a1fs_dentry));
-            // Check for an empty a1fs_dentry
-            if('\0' != *cur_entry->name)
-            {
-				// There is an entry with a non-empty name i.e it is NOT empty
-                return -ENOTEMPTY;
-            }
-        }
-    }
-	// The directory is empty so it can be removed
-	remove_dir_entry(path, fs);
-	return 0;
+	int ret = -ENOTEMPTY;
+	if(dir_is_empty(inode, fs))
+	{ // The directory is empty so it can be removed
+		fs_lock_inode(fs, ino, true);
+		remove_dir_entry(path, fs);
+		fs_unlock_inode(fs, ino);
+		ret = 0;
+	}
+	pthread_rwlock_unlock(&fs->ns_lock);
+	return ret;
 }
 
 /**
@@ -319,10 +500,14 @@ static int a1fs_rmdir(const char *path)
 static int a1fs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
 	if(VERBOSE) printf("creat(%s)\n", path);
-	(void)fi;// unused
 	assert(S_ISREG(mode));
 	fs_ctx *fs = get_fs();
-	return add_dir_entry(path, mode, 1, fs);
+	pthread_rwlock_wrlock(&fs->ns_lock);
+	int ret = add_dir_entry(path, mode, 1, fs);
+	// The file is opened as well
+	if(0 == ret && NULL != fi) ret = fh_open(path, fi);
+	pthread_rwlock_unlock(&fs->ns_lock);
+	return ret;
 }
 
 /**
@@ -342,8 +527,14 @@ static int a1fs_unlink(const char *path)
 {
 	if(VERBOSE) printf("unlink(%s)\n", path);
 	fs_ctx *fs = get_fs();
+	// Wait for any operation on the file through an open handle, since its blocks may be freed
+	pthread_rwlock_wrlock(&fs->ns_lock);
+	a1fs_ino_t ino = path_lookup(path, fs);
+	fs_lock_inode(fs, ino, true);
 	// Remove the file from its parent's directory entires
 	remove_dir_entry(path, fs);
+	fs_unlock_inode(fs, ino);
+	pthread_rwlock_unlock(&fs->ns_lock);
 	return 0;
 }
 
@@ -370,17 +561,50 @@ static int a1fs_utimens(const char *path, const struct timespec times[2])
 {
 	if(VERBOSE) printf("utimens(%s)\n", path);
 	fs_ctx *fs = get_fs();
-	a1fs_inode *inode = &fs->inode_table[path_lookup(path, fs)]; 
+	int ino = lock_file(fs, path, NULL, true);
+	if(ino < 0) return ino;
+	a1fs_inode *inode = &fs->inode_table[ino]; 
 
+	int ret = 0;
 	if(UTIME_NOW == times[1].tv_nsec || NULL == times)
 	{ 
 		// set mtime to the current time
-		if(clock_gettime(CLOCK_REALTIME, &inode->mtime) < 0) return -EFAULT;
+		if(clock_gettime(CLOCK_REALTIME, &inode->mtime) < 0) ret = -EFAULT;
 	}else if(UTIME_OMIT != times[1].tv_nsec)
 	{
 		// set mtime to times[1]
 		inode->mtime = times[1];
 	}
+	unlock_file(fs, ino, NULL);
+	return ret;
+}
+
+/** Change the size of a file, whose inode is locked. See a1fs_truncate(). */
+static int truncate_inode(fs_ctx *fs, a1fs_ino_t ino, off_t size)
+{
+	a1fs_inode *inode = &fs->inode_table[ino];
+	// Update the modification time
+	if(clock_gettime(CLOCK_REALTIME, &inode->mtime) < 0) return -EFAULT;
+
+	// Write out any pending data first, so the size of the inode is the size of the file
+	int ret;
+	if(0 != (ret = flush_inode(ino, fs))) return ret;
+
+	if((uint64_t)size > inode->size)
+	{ // The file is being extended. The new range is a hole, which reads as zeros without any blocks
+		return extend_inode(inode, size, fs);
+	}else if((uint64_t)size < inode->size && (inode->flags & A1FS_INODE_INLINE))
+	{ // The file is being shrunk, and has no blocks to free. Zero the end so it reads as zeros if extended
+		memset(inode->inline_data + size, 0, inode->size - size);
+	}else if((uint64_t)size < inode->size)
+	{ // The file is being shrunk, free the blocks past the new end (and any preallocated ones)
+		free_blocks_from(inode, Ceil((uint64_t)size, A1FS_BLOCK_SIZE), fs);
+		if(VERBOSE) print_data_block_bitmap("Dealocation Complete", fs);
+	}
+	// Note: if the size is equal than do nothing
+
+	// Set the inode size to the new size
+	inode->size = size;
 	return 0;
 }
 
@@ -389,13 +613,13 @@ static int a1fs_utimens(const char *path, const struct timespec times[2])
  *
  * Implements the truncate() system call. Supports both extending and shrinking.
  * If the file is extended, the new uninitialized range at the end must be
- * filled with zeros.
+ * filled with zeros. It is left as a hole, so extending a file takes no space
+ * however far it goes.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
  *
  * Errors:
- *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
  *   EFAULT	 inode->mtime points outside the accessible address space
  *
@@ -408,62 +632,11 @@ static int a1fs_truncate(const char *path, off_t size)
 	if(VERBOSE) printf("truncate(%s, %ld)\n", path, size);
 	fs_ctx *fs = get_fs();
 
-	a1fs_inode *inode = &fs->inode_table[path_lookup(path, fs)];
-	// Update the modification time
-	if(clock_gettime(CLOCK_REALTIME, &inode->mtime) < 0) return -EFAULT;
-
-	if((uint64_t)size > inode->size)
-	{ // The file is being extended
-		off_t additional_bytes = size - inode->size;
-		if(0 > allocate_data_blocks(inode, additional_bytes, fs)) return -ENOSPC;
-		
-		char *buf;
-		if(NULL == (buf = malloc(additional_bytes))) return -ENOMEM;
-		memset(buf, 0, additional_bytes);
-		// Write additional_bytes of zeros to the inodes data blocks, starting at
-		// offset=inode->size, i.e the end of the data blocks so far
-		copy_between_buf_and_fs(inode, buf, additional_bytes, inode->size, true, fs);
-		free(buf);
-	}else if((uint64_t)size < inode->size)
-	{ // The file is being shrunk        
-		a1fs_extent *cur_extent;
-		int num_extents = inode->num_extents;
-		int blk_idx = 0;
-        // Iterate over the inodes data blocks
-        for(uint32_t i = 0; i < inode->num_extents; i++)
-        {
-            cur_extent = get_extent(inode, i, fs);
-			int count = cur_extent->count;
-			// Itterate over the blocks
-            for(a1fs_blk_t b = cur_extent->start; b < cur_extent->start+count; b++, blk_idx++){
-				// Dealocate the data block if the blk index * block size is greater than the needed size
-                if(blk_idx * A1FS_BLOCK_SIZE > size)
-				{
-					fs->d_bitmap[b/8] = fs->d_bitmap[b/8] & ~(1 << (b % 8));
-                	fs->superblock->num_free_dblocks++;
-					cur_extent->count--;
-					if(0 == cur_extent->count)
-					{
-						if(A1FS_NUM_DIRECT_EXTENT == num_extents)
-						{ // Deallocate the indirect block
-							a1fs_blk_t indir = inode->indirect_extent_blk;
-							fs->d_bitmap[indir/8] = fs->d_bitmap[indir/8] & ~(1 << (indir % 8));
-                			fs->superblock->num_free_dblocks++;
-						}
-						num_extents--;
-					}
-				}
-            }
-        }
-		inode->num_extents = num_extents;
-
-		if(VERBOSE) print_data_block_bitmap("Dealocation Complete", fs);
-	}
-	// Note: if the size is equal than do nothing
-
-	// Set the inode size to the new size
-	inode->size = size;
-	return 0;
+	int ino = lock_file(fs, path, NULL, true);
+	if(ino < 0) return ino;
+	int ret = truncate_inode(fs, ino, size);
+	unlock_file(fs, ino, NULL);
+	return ret;
 }
 
 
@@ -484,7 +657,7 @@ static int a1fs_truncate(const char *path, off_t size)
  * @param buf     pointer to the buffer that receives the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to read from.
- * @param fi      unused.
+ * @param fi      the handle from open() or create(); may be NULL.
  * @return        number of bytes read on success; 0 if offset is beyond EOF;
  *                -errno on error.
  */
@@ -492,12 +665,40 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
                      struct fuse_file_info *fi)
 {
 	if(VERBOSE) printf("read(%s, %p, %ld, %ld)\n", path, (void *)buf, size, offset);	
-	(void)fi;// unused
 	fs_ctx *fs = get_fs();
 	memset(buf, 0, size); // Zero the buffer before use
-	a1fs_inode *inode = &fs->inode_table[path_lookup(path, fs)];
-	// Copy from the fs to buf
-	return copy_between_buf_and_fs(inode, buf, size, offset, false, fs);
+	a1fs_fh *fh = get_fh(fi);
+	int ino = lock_file(fs, path, fh, false);
+	if(ino < 0) return ino;
+	a1fs_extent_hint *hint = NULL != fh ? &fh->hint : NULL;
+	// Copy from the fs (and the pending data, with delayed allocation) to buf
+	int ret;
+	if(fs->delalloc.enabled) ret = buffered_read(ino, buf, size, offset, hint, fs);
+	else ret = copy_between_buf_and_fs(&fs->inode_table[ino], buf, size, offset, false, hint, fs);
+	unlock_file(fs, ino, fh);
+	return ret;
+}
+
+/** Write data to a file, whose inode is locked. See a1fs_write(). */
+static int write_inode(fs_ctx *fs, a1fs_ino_t ino, const char *buf, size_t size, off_t offset,
+                       a1fs_extent_hint *hint)
+{
+	a1fs_inode *inode = &fs->inode_table[ino];
+	// Update the modification time
+	if(clock_gettime(CLOCK_REALTIME, &inode->mtime) < 0) return -EFAULT;
+
+	// With delayed allocation the write is buffered. If that fails, the pending data has been written
+	// out and the write is done immediately, which reports the error if there is one
+	int ret;
+	if(fs->delalloc.enabled && 0 <= (ret = buffered_write(ino, buf, size, offset, hint, fs))) return ret;
+
+	// A write past EOF leaves a hole before it, which takes no blocks
+	if((uint64_t)offset > inode->size && 0 != (ret = extend_inode(inode, offset, fs))) return ret;
+
+	if(0 != (ret = write_data_blocks(inode, offset, size, fs))) return ret;
+	inode->size = Max(inode->size, offset + size);
+	// Copy from buf to the fs
+	return copy_between_buf_and_fs(inode, (char *)buf, size, offset, true, hint, fs);
 }
 
 /**
@@ -508,55 +709,279 @@ static int a1fs_read(const char *path, char *buf, size_t size, off_t offset,
  * file must be extended. If the write creates a "hole" of uninitialized data,
  * the new uninitialized range must filled with zeros. You can assume that the
  * byte range from offset to offset + size is contained within a single block.
+ * The hole gets no blocks, it reads as zeros until it is written.
  *
  * Assumptions (already verified by FUSE using getattr() calls):
  *   "path" exists and is a file.
  *
  * Errors:
- *   ENOMEM  not enough memory (e.g. a malloc() call failed).
  *   ENOSPC  not enough free space in the file system.
- *   ENOSPC  too many extents (a1fs only needs to support 512 extents per file)
  *   EFAULT	 inode->mtime points outside the accessible address space
  * 
  * @param path    path to the file to write to.
  * @param buf     pointer to the buffer containing the data.
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to write to.
- * @param fi      unused.
+ * @param fi      the handle from open() or create(); may be NULL.
  * @return        number of bytes written on success; -errno on error.
  */
 static int a1fs_write(const char *path, const char *buf, size_t size,
                       off_t offset, struct fuse_file_info *fi)
 {
 	if(VERBOSE) printf("write(%s, %p, %ld, %ld)\n", path, (void *)buf, size, offset);	
-	(void)fi;// unused
 	fs_ctx *fs = get_fs();
 	
-	a1fs_inode *inode = &fs->inode_table[path_lookup(path, fs)];
-	// Update the modification time
+	a1fs_fh *fh = get_fh(fi);
+	int ino = lock_file(fs, path, fh, true);
+	if(ino < 0) return ino;
+	int ret = write_inode(fs, ino, buf, size, offset, NULL != fh ? &fh->hint : NULL);
+	unlock_file(fs, ino, fh);
+	return ret;
+}
+
+/** Allocate or deallocate space for a range of a file, whose inode is locked. See a1fs_fallocate(). */
+static int fallocate_inode(fs_ctx *fs, a1fs_ino_t ino, int mode, off_t offset, off_t len, a1fs_extent_hint *hint)
+{
+	a1fs_inode *inode = &fs->inode_table[ino];
 	if(clock_gettime(CLOCK_REALTIME, &inode->mtime) < 0) return -EFAULT;
 
-	if((uint64_t)offset > inode->size)
-	{ // We need to fill in the 'hole' by zeroing out this memory
-		off_t additional_bytes = offset - inode->size;
-		if(0 > allocate_data_blocks(inode, additional_bytes, fs)) return -ENOSPC;
-		
-		char *zero_buf;
-		if(NULL == (zero_buf = malloc(additional_bytes))) return -ENOMEM;
-		memset(zero_buf, 0, additional_bytes);
-		copy_between_buf_and_fs(inode, zero_buf, additional_bytes, inode->size, true, fs);
-		free(zero_buf);
-		inode->size += additional_bytes;
+	// Write out any pending data first, so the size of the inode is the size of the file
+	int ret;
+	if(0 != (ret = flush_inode(ino, fs))) return ret;
+	uint64_t end = offset + len;
+
+	if(mode & FALLOC_FL_PUNCH_HOLE) return punch_hole(inode, offset, len, hint, fs);
+
+	// The holes in the range get unwritten blocks, which read as zeros without being zeroed
+	if(0 != (ret = allocate_unwritten(inode, offset, len, fs))) return ret;
+	// Zero the data already in the range for ZERO_RANGE, in place, there is no need to read it
+	if((mode & FALLOC_FL_ZERO_RANGE) && (uint64_t)offset < inode->size)
+		copy_between_buf_and_fs(inode, NULL, Min(end, inode->size) - offset, offset, true, hint, fs);
+	if(!(mode & FALLOC_FL_KEEP_SIZE) && end > inode->size) return extend_inode(inode, end, fs);
+	return 0;
+}
+
+/**
+ * Allocate or deallocate space for a range of a file.
+ *
+ * Implements the fallocate() system call. See "man 2 fallocate" for details.
+ * Supported modes:
+ *   0           allocate the blocks for the range, extending the file if it ends past EOF.
+ *   KEEP_SIZE   allocate the blocks for the range, without changing the size. Blocks past
+ *               EOF are used by later writes before any new ones are allocated.
+ *   PUNCH_HOLE  (with KEEP_SIZE) make the range a hole, anywhere in the file. The blocks it
+ *               covers whole are freed, the parts of the blocks at its edges are zeroed.
+ *   ZERO_RANGE  zero the range in place, allocating (and extending the file) like mode 0.
+ * The holes in the range get unwritten extents, which read as zeros without being zeroed (and
+ * become written when they are written to), so allocating is as cheap as extending. New blocks
+ * come from a single request per hole, so they are as contiguous as the free space allows.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists and is a file.
+ *
+ * Errors:
+ *   EINVAL      offset is negative or len is not positive.
+ *   EOPNOTSUPP  an unsupported mode.
+ *   ENOSPC      not enough free space in the file system.
+ *   EFAULT      inode->mtime points outside the accessible address space
+ *
+ * @param path    path to the file.
+ * @param mode    FALLOC_FL_* flags.
+ * @param offset  the start of the range.
+ * @param len     the length of the range.
+ * @param fi      the handle from open() or create(); may be NULL.
+ * @return        0 on success; -errno on error.
+ */
+static int a1fs_fallocate(const char *path, int mode, off_t offset, off_t len,
+                          struct fuse_file_info *fi)
+{
+	if(VERBOSE) printf("fallocate(%s, %d, %ld, %ld)\n", path, mode, offset, len);
+	fs_ctx *fs = get_fs();
+	if(offset < 0 || len <= 0) return -EINVAL;
+	if(0 != (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))) return -EOPNOTSUPP;
+	if((mode & FALLOC_FL_PUNCH_HOLE) && (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE)))
+		return -EOPNOTSUPP;
+
+	a1fs_fh *fh = get_fh(fi);
+	int ino = lock_file(fs, path, fh, true);
+	if(ino < 0) return ino;
+	int ret = fallocate_inode(fs, ino, mode, offset, len, NULL != fh ? &fh->hint : NULL);
+	unlock_file(fs, ino, fh);
+	return ret;
+}
+
+/**
+ * Open a file.
+ *
+ * Implements the open() system call. The inode number of the file is kept in
+ * the handle, so reads and writes through it don't look up the path.
+ *
+ * Assumptions (already verified by FUSE using getattr() calls):
+ *   "path" exists and is a file.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory (e.g. a malloc() call failed).
+ *
+ * @param path  path to the file to open.
+ * @param fi    file info which receives the handle.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_open(const char *path, struct fuse_file_info *fi)
+{
+	if(VERBOSE) printf("open(%s)\n", path);
+	fs_ctx *fs = get_fs();
+	pthread_rwlock_rdlock(&fs->ns_lock);
+	int ret = fh_open(path, fi);
+	pthread_rwlock_unlock(&fs->ns_lock);
+	return ret;
+}
+
+/**
+ * Flush the data of an open file, on every close() of one of its file descriptors.
+ *
+ * With delayed allocation, allocates the blocks for the data written so far and writes it to them.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param path  path to the file.
+ * @param fi    file info holding the handle.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_flush(const char *path, struct fuse_file_info *fi)
+{
+	if(VERBOSE) printf("flush(%s)\n", path);
+	fs_ctx *fs = get_fs();
+	a1fs_fh *fh = get_fh(fi);
+	int ino = lock_file(fs, path, fh, true);
+	if(ino < 0) return ino;
+	int ret = flush_inode(ino, fs);
+	unlock_file(fs, ino, fh);
+	return ret;
+}
+
+/**
+ * Synchronize the contents of a file. The image is a shared mapping, so this only needs to flush the
+ * data which is waiting for delayed allocation, and the free counts kept in memory.
+ *
+ * Implements the fsync() system call. See "man 2 fsync" for details.
+ *
+ * @param path      path to the file.
+ * @param datasync  sync only the data (ignored).
+ * @param fi        file info holding the handle.
+ * @return          0 on success; -errno on error.
+ */
+static int a1fs_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void)datasync;// unused
+	if(VERBOSE) printf("fsync(%s)\n", path);
+	int ret = a1fs_flush(path, fi);
+	if (0 == ret) fs_ctx_sync(get_fs());
+	return ret;
+}
+
+/**
+ * Release an open file, once all of its file descriptors are closed.
+ *
+ * @param path  path to the file (may be stale if the file was removed).
+ * @param fi    file info holding the handle.
+ * @return      0 on success; -errno on error.
+ */
+static int a1fs_release(const char *path, struct fuse_file_info *fi)
+{
+	if(VERBOSE) printf("release(%s)\n", path);
+	fs_ctx *fs = get_fs();
+	a1fs_fh *fh = get_fh(fi);
+	int ret = 0;
+	if(NULL != fh)
+	{ // The blocks preallocated for appends are no longer needed
+		fs_lock_inode(fs, fh->ino, true);
+		ret = flush_inode(fh->ino, fs);
+		trim_prealloc(&fs->inode_table[fh->ino], fs);
+		fs_unlock_inode(fs, fh->ino);
 	}
+	fh_release(fi);
+	return ret;
+}
 
-	if(0 > allocate_data_blocks(inode, size, fs)) return -ENOSPC;
-	inode->size += size;
-	// Copy from buf to the fs
-	return copy_between_buf_and_fs(inode, (char *)buf, size, offset, true, fs);
+/**
+ * Open a directory. Like a1fs_open(), the handle is used by readdir().
+ */
+static int a1fs_opendir(const char *path, struct fuse_file_info *fi)
+{
+	if(VERBOSE) printf("opendir(%s)\n", path);
+	fs_ctx *fs = get_fs();
+	pthread_rwlock_rdlock(&fs->ns_lock);
+	int ret = fh_open(path, fi);
+	pthread_rwlock_unlock(&fs->ns_lock);
+	return ret;
+}
+
+/**
+ * Release an open directory.
+ */
+static int a1fs_releasedir(const char *path, struct fuse_file_info *fi)
+{
+	if(VERBOSE) printf("releasedir(%s)\n", path);
+	fh_release(fi);
+	return 0;
+}
+
+/**
+ * Control the online defragmenter.
+ *
+ * Implements the ioctl() system call. See "man 2 ioctl" for details.
+ * Supported commands:
+ *   A1FS_IOC_DEFRAG        defragment the file, and return once it is done. On a
+ *                          directory, start defragmenting all the files in the
+ *                          background instead.
+ *   A1FS_IOC_DEFRAG_STATS  get the progress of the defragmenter.
+ *
+ * Errors:
+ *   ENOTTY  an unsupported command.
+ *   ENOSYS  a 32-bit caller on a 64-bit kernel.
+ *   EBUSY   the defragmenter is already going through all the files.
+ *
+ * @param path   path to the file or directory.
+ * @param cmd    the command.
+ * @param arg    the argument in the caller's address space (unused, FUSE copies it).
+ * @param fi     the handle from open() or opendir().
+ * @param flags  FUSE_IOCTL_* flags.
+ * @param data   the argument, copied in and out by FUSE.
+ * @return       0 on success; -errno on error.
+ */
+static int a1fs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+                      unsigned int flags, void *data)
+{
+	(void)arg;// unused
+	if(VERBOSE) printf("ioctl(%s, %x)\n", path, cmd);
+	fs_ctx *fs = get_fs();
+	if (flags & FUSE_IOCTL_COMPAT) return -ENOSYS;
+
+	switch ((unsigned int)cmd) {
+	case A1FS_IOC_DEFRAG_STATS:
+		defrag_get_stats(data, fs);
+		return 0;
+	case A1FS_IOC_DEFRAG: {
+		a1fs_defrag_args *args = data;
+		a1fs_fh *fh = get_fh(fi);
+		int ino = lock_file(fs, path, fh, false);
+		if (ino < 0) return ino;
+		bool dir = S_ISDIR(fs->inode_table[ino].mode);
+		unlock_file(fs, ino, fh);
+		// The defragmenter locks the file itself, a chunk at a time
+		if (dir) return start_defrag(args->rate, fs);
+		defrag_inode(ino, args->rate, fs);
+		return 0;
+	}
+	default:
+		return -ENOTTY;
+	}
 }
 
 
 static struct fuse_operations a1fs_ops = {
+	.init     = a1fs_start,
 	.destroy  = a1fs_destroy,
 	.statfs   = a1fs_statfs,
 	.getattr  = a1fs_getattr,
@@ -569,6 +994,14 @@ static struct fuse_operations a1fs_ops = {
 	.truncate = a1fs_truncate,
 	.read     = a1fs_read,
 	.write    = a1fs_write,
+	.open     = a1fs_open,
+	.fallocate = a1fs_fallocate,
+	.flush    = a1fs_flush,
+	.fsync    = a1fs_fsync,
+	.release  = a1fs_release,
+	.opendir  = a1fs_opendir,
+	.releasedir = a1fs_releasedir,
+	.ioctl    = a1fs_ioctl,
 };
 
 int main(int argc, char *argv[])
@@ -21,6 +21,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <limits.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 
 
@@ -45,7 +46,34 @@ typedef uint32_t a1fs_ino_t;
 #define A1FS_MAGIC 0xC5C369A1C5C369A1ul
 
 
-#define A1FS_NUM_DIRECT_EXTENT 10
+/** The maximum number of allocation groups, their descriptors are stored in the superblock. */
+#define A1FS_MAX_GROUPS 128
+
+/** The default number of data blocks in an allocation group (one block of the data bitmap). */
+#define A1FS_DEFAULT_GROUP_DBLOCKS (8 * A1FS_BLOCK_SIZE)
+
+/**
+ * An allocation group descriptor.
+ *
+ * The data blocks and the inodes are divided into allocation groups, each with its own slice of the
+ * data and inode bitmaps and its own free counts. The slices start on 64 bit boundaries, so no two
+ * groups share a word of a bitmap. A file's data is placed in the group of its inode, which is the
+ * group of its parent directory.
+ */
+typedef struct a1fs_group_desc {
+	/** The first data block of the group (an index into the data bitmap). */
+	a1fs_blk_t first_dblock;
+	/** The number of data blocks in the group. */
+	uint32_t num_dblocks;
+	/** The number of free data blocks in the group. */
+	uint32_t num_free_dblocks;
+	/** The first inode of the group (an index into the inode bitmap). */
+	a1fs_ino_t first_inode;
+	/** The number of inodes in the group. */
+	uint32_t num_inodes;
+	/** The number of free inodes in the group. */
+	uint32_t num_free_inodes;
+} a1fs_group_desc;
 
 /** a1fs superblock. */
 typedef struct a1fs_superblock {
@@ -63,26 +91,92 @@ typedef struct a1fs_superblock {
 	uint32_t num_free_dblocks;
 	/*The block index of the bitmap of allocated/deallcoated data blocks. */
 	a1fs_blk_t data_bitmap;
+	/*The block index of the bitmap of allocated/deallocated inodes. */
+	a1fs_blk_t inode_bitmap;
 	/*The block index of the array of inodes. */
 	a1fs_blk_t inode_table;
 	/*The block index of the start of the data blocks. */
 	a1fs_blk_t data_blk;
+	/** Optional format features enabled by mkfs (A1FS_FEATURE_*). */
+	uint32_t features;
+	/** The number of allocation groups. */
+	uint32_t num_groups;
+	/** The number of data blocks in each group (but the last one), a multiple of 64. */
+	uint32_t dblocks_per_group;
+	/** The number of inodes in each group (but the last ones), a multiple of 64. */
+	uint32_t inodes_per_group;
+	/**
+	 * The first inode of the orphan list, the unlinked files whose data blocks are yet to be freed
+	 * (linked by a1fs_inode.next_orphan). 0 if the list is empty, the root directory is never unlinked.
+	 */
+	a1fs_ino_t orphan_head;
+	/** The allocation group descriptors. The free counts above are their sums. */
+	a1fs_group_desc groups[A1FS_MAX_GROUPS];
 } a1fs_superblock;
 
+/** Directories which outgrow a single block are converted to hash-indexed directories. */
+#define A1FS_FEATURE_HTREE 0x1
+/** Directory blocks hold variable length entries (a1fs_var_dentry) instead of a1fs_dentry. */
+#define A1FS_FEATURE_VAR_DENTRY 0x2
+/** New files and directories keep their contents in the inode until they outgrow it. */
+#define A1FS_FEATURE_INLINE_DATA 0x4
+
 // Superblock must fit into a single block
 static_assert(sizeof(a1fs_superblock) <= A1FS_BLOCK_SIZE,
               "superblock is too large");
 
 
 
-/** Extent - a contiguous range of blocks. */
+/** Extent - a contiguous range of blocks, an entry of a leaf of the extent tree. */
 typedef struct a1fs_extent {
+	/** The index within the file of the first block of the extent. */
+	uint32_t lblk;
 	/** Starting block of the extent. */
 	a1fs_blk_t start;
 	/** Number of blocks in the extent. */
-	a1fs_blk_t count;
+	a1fs_blk_t count : 31;
+	/**
+	 * Set if the blocks were allocated (e.g. by fallocate()) but never written. They read as zeros,
+	 * and become written (splitting the extent if need be) when data is written to them.
+	 */
+	a1fs_blk_t unwritten : 1;
 } a1fs_extent;
 
+/** An entry of an interior node of the extent tree. */
+typedef struct a1fs_extent_idx {
+	/** The lowest logical block in the child. The first child of a node also holds any before it. */
+	uint32_t lblk;
+	/** The data block holding the child node. */
+	a1fs_blk_t child;
+} a1fs_extent_idx;
+
+/** Value of the magic field of an extent tree node. */
+#define A1FS_ETREE_MAGIC 0xE7EE
+
+/**
+ * Header of an extent tree node, followed by its entries.
+ *
+ * The extents of a file are kept in a B+tree keyed by logical block. The root is in the inode and the
+ * other nodes take a data block each. The leaves (depth 0) hold a1fs_extent entries and the interior
+ * nodes hold a1fs_extent_idx entries, both sorted by logical block.
+ */
+typedef struct a1fs_etree_header {
+	/** Must match A1FS_ETREE_MAGIC. */
+	uint16_t magic;
+	/** The number of used entries. */
+	uint16_t count;
+	/** The number of entries the node has room for. */
+	uint16_t max;
+	/** The height of the node, 0 for a leaf. */
+	uint16_t depth;
+} a1fs_etree_header;
+
+/** The size of the root node in the inode, including its header. */
+#define A1FS_ETREE_ROOT_SIZE 84
+
+/** The maximum depth of an extent tree, deep enough for any number of extents of a 32 bit file. */
+#define A1FS_ETREE_MAX_DEPTH 4
+
 
 /** a1fs inode. */
 typedef struct a1fs_inode {
@@ -111,23 +205,76 @@ typedef struct a1fs_inode {
 	 */
 	struct timespec mtime;
 
-	/** The number of allocated extents in the inode*/
+	/** The number of extents in the extent tree. */
 	uint32_t num_extents;
 
-	/*An array of extents which directly point to blocks*/
-	a1fs_extent direct_extents[A1FS_NUM_DIRECT_EXTENT];
+	union {
+		struct {
+			/** The header of the root node of the extent tree. */
+			a1fs_etree_header etree_root;
+			/** The entries of the root node, see a1fs_etree_header. */
+			uint32_t etree_root_entries[(A1FS_ETREE_ROOT_SIZE - sizeof(a1fs_etree_header)) / 4];
+		};
+		/**
+		 * The contents of the file (or the a1fs_var_dentry records of the directory) if the inode
+		 * has the A1FS_INODE_INLINE flag, in which case num_extents is 0.
+		 */
+		char inline_data[A1FS_ETREE_ROOT_SIZE];
+	};
+
+	/** Inode flags (A1FS_INODE_*). */
+	uint32_t flags;
+
+	/** The number of entries in a directory (not including "." and ".."). Unused for files. */
+	uint32_t dir_entries;
+
+	/**
+	 * The index of the first block of a (linear) directory which may have room for a new entry, all
+	 * the blocks before it are full. Unused for files and hash-indexed directories.
+	 */
+	uint32_t dir_free_hint;
+
+	/**
+	 * The number of blocks at the end of the extents which were speculatively preallocated for
+	 * appends. They are freed when the file is closed, or when the file system runs low on space.
+	 * Always 0 for directories.
+	 */
+	uint32_t prealloc_blocks;
+
+	/** The next inode of the orphan list (see a1fs_superblock.orphan_head), if the inode is on it. */
+	a1fs_ino_t next_orphan;
 
-	/** A pointer to a block of indirect extents. Which will begin to be filled if all the direct 
-	 *  extents are used
-	*/
-	a1fs_blk_t indirect_extent_blk;
+	/**
+	 * The number of data blocks in the extents (not counting the nodes of the extent tree). Less than
+	 * the blocks up to the end of the last extent if the file has holes.
+	 */
+	uint32_t num_blocks;
 
-	char padding[4];
+	/**
+	 * Changed each time the inode is allocated or freed, so a handle can tell that the file it was
+	 * opened on is gone (even if the inode was reused).
+	 */
+	uint32_t generation;
+
+	/** Reserved for future fields, pads the inode to 256 bytes. */
+	uint8_t reserved[108];
 } a1fs_inode;
 
+/** The directory's data blocks are organized as a hash tree (see a1fs_dx_node). */
+#define A1FS_INODE_INDEXED 0x1
+/** The contents are stored in inline_data rather than in data blocks. */
+#define A1FS_INODE_INLINE 0x2
+
+/** The number of bytes of data which can be stored in the inode. */
+#define A1FS_INLINE_DATA_MAX sizeof(((a1fs_inode *)0)->inline_data)
+
+// Inline directories hold 4 byte aligned a1fs_var_dentry records
+static_assert(A1FS_INLINE_DATA_MAX % 4 == 0, "invalid inline data size");
+
 #define NUM_INODES_PER_BLOCK (A1FS_BLOCK_SIZE/sizeof(a1fs_inode))
 
 // A single block must fit an integral number of inodes
+static_assert(sizeof(a1fs_inode) == 256, "invalid inode size");
 static_assert(A1FS_BLOCK_SIZE % sizeof(a1fs_inode) == 0, "invalid inode size");
 
 
@@ -148,3 +295,96 @@ typedef struct a1fs_dentry {
 #define NUM_DENTRY_PER_BLOCK (A1FS_BLOCK_SIZE/sizeof(a1fs_dentry))
 
 static_assert(sizeof(a1fs_dentry) == 256, "invalid dentry size");
+
+/**
+ * Variable length directory entry, used instead of a1fs_dentry if A1FS_FEATURE_VAR_DENTRY is set.
+ *
+ * The records of a block are chained by their lengths and cover the whole block. A record may be
+ * longer than its name needs, and the unused space at its end can hold new entries. A record with
+ * an empty name is unused, which is only ever the case for the first record of a block, since
+ * removed entries are merged into the record before them.
+ */
+typedef struct a1fs_var_dentry {
+	/** Inode number. */
+	a1fs_ino_t ino;
+	/** The length of the record in bytes, including any unused space after the name. */
+	uint16_t rec_len;
+	/** The length of the name, not including the null terminator. 0 if the record is unused. */
+	uint8_t name_len;
+	uint8_t padding;
+	/** File name. A null-terminated string. */
+	char name[];
+} a1fs_var_dentry;
+
+/** The number of bytes needed for an a1fs_var_dentry with a name_len long name (4 byte aligned). */
+#define A1FS_VAR_DENTRY_LEN(name_len) ((sizeof(a1fs_var_dentry) + (name_len) + 1 + 3) & ~3u)
+
+static_assert(A1FS_NAME_MAX - 1 <= UINT8_MAX, "name too long for a1fs_var_dentry");
+
+
+/** Value in the place of the inode number of the first dentry of an index block. */
+#define A1FS_DX_MAGIC 0xA1D1DE00u
+
+/** An entry of an index block. Points to the block holding names which hash to [hash, next entry's hash). */
+typedef struct a1fs_dx_entry {
+	/** The lowest name hash covered by the block. */
+	uint32_t hash;
+	/** The index of the block within the directory's data blocks. */
+	uint32_t blk;
+} a1fs_dx_entry;
+
+/**
+ * Index block of a hash-indexed directory. The root is always the directory's first data block.
+ *
+ * The header overlaps the first a1fs_dentry of the block, which appears to be empty.
+ */
+typedef struct a1fs_dx_node {
+	/** Must match A1FS_DX_MAGIC. */
+	uint32_t magic;
+	/** Always '\0'. */
+	char zero;
+	/** The height of the node, 0 if the entries point to leaf (dentry) blocks. */
+	uint8_t level;
+	/** The number of used entries, entries[0].hash is the lowest hash the node covers. */
+	uint16_t count;
+	/** The entries, sorted by hash. */
+	a1fs_dx_entry entries[];
+} a1fs_dx_node;
+
+#define A1FS_DX_LIMIT ((A1FS_BLOCK_SIZE - sizeof(a1fs_dx_node)) / sizeof(a1fs_dx_entry))
+
+/** The maximum height of the hash tree, including the root. */
+#define A1FS_DX_MAX_DEPTH 4
+
+
+/** Arguments of A1FS_IOC_DEFRAG. */
+typedef struct a1fs_defrag_args {
+	/** The most data blocks to move per second, 0 for the default (see DEFRAG_DEFAULT_RATE). */
+	uint32_t rate;
+} a1fs_defrag_args;
+
+/** Progress of the online defragmenter, from A1FS_IOC_DEFRAG_STATS. */
+typedef struct a1fs_defrag_stats {
+	/** Whether a pass over all the files is running. */
+	uint32_t running;
+	/** The number of inodes the current (or last) pass has gone through. */
+	uint32_t inodes_done;
+	/** The number of inodes in use when the current (or last) pass started. */
+	uint32_t inodes_total;
+	/** The number of files whose extents were merged or moved, since the file system was mounted. */
+	uint64_t files_defragged;
+	/** The number of extents removed by merging adjacent ones, since the file system was mounted. */
+	uint64_t extents_merged;
+	/** The number of data blocks moved into larger free sequences, since the file system was mounted. */
+	uint64_t blocks_moved;
+} a1fs_defrag_stats;
+
+/**
+ * Defragment a file: merge its physically adjacent extents, and move its small extents into large
+ * free sequences. Issued on a directory, it starts defragmenting all the files in the background
+ * instead (EBUSY if that is already running). The argument is an a1fs_defrag_args.
+ */
+#define A1FS_IOC_DEFRAG _IOW('a', 1, a1fs_defrag_args)
+
+/** Get the progress of the defragmenter. The argument is an a1fs_defrag_stats. */
+#define A1FS_IOC_DEFRAG_STATS _IOR('a', 2, a1fs_defrag_stats)
@@ -0,0 +1,185 @@
+#include <string.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include "bitmap.h"
+#include "util.h"
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "the word kernels assume bit b of a word is bit b % 8 of byte b / 8");
+
+/**
+ * Load word w of the bitmap, reading only the bytes which hold bits before end_bit (the rest are 0)
+*/
+static uint64_t load_word(const char *bm, uint32_t w, uint64_t end_bit)
+{
+    uint64_t word = 0;
+    memcpy(&word, bm + (uint64_t)w * 8, Min(8, Ceil(end_bit - (uint64_t)w * 64, 8)));
+    return word;
+}
+
+/**
+ * Store word w of the bitmap, writing only the bytes which hold bits before end_bit
+*/
+static void store_word(char *bm, uint32_t w, uint64_t word, uint64_t end_bit)
+{
+    memcpy(bm + (uint64_t)w * 8, &word, Min(8, Ceil(end_bit - (uint64_t)w * 64, 8)));
+}
+
+/**
+ * The bits of word w which are within [start, end)
+*/
+static uint64_t range_mask(uint32_t w, uint64_t start, uint64_t end)
+{
+    uint64_t lo = Max(start, (uint64_t)w * 64) - (uint64_t)w * 64;
+    uint64_t hi = Min(end, (uint64_t)w * 64 + 64) - (uint64_t)w * 64;
+    return (64 == hi - lo ? ~0ull : (1ull << (hi - lo)) - 1) << lo;
+}
+
+#ifdef __AVX2__
+/**
+ * Check if the 4 words starting at word w are all ones (if invert is set) or all zeros
+*/
+static bool skip_4_words(const char *bm, uint32_t w, uint64_t invert)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *)(bm + (uint64_t)w * 8));
+    return invert ? _mm256_testc_si256(v, _mm256_set1_epi64x(-1)) : _mm256_testz_si256(v, v);
+}
+#endif
+
+/**
+ * Find the first set bit at or after start of the bitmap xor invert
+*/
+static uint32_t find_next(const char *bm, uint32_t nbits, uint32_t start, uint64_t invert)
+{
+    if(start >= nbits) return nbits;
+    uint32_t w = start / 64;
+    uint64_t word = (load_word(bm, w, nbits) ^ invert) & (~0ull << (start % 64));
+    while(0 == word)
+    {
+        w++;
+#ifdef __AVX2__
+        // Skip over 256 bits at a time while there are no matches
+        while((uint64_t)(w + 4) * 64 <= nbits && skip_4_words(bm, w, invert)) w += 4;
+#endif
+        if((uint64_t)w * 64 >= nbits) return nbits;
+        word = load_word(bm, w, nbits) ^ invert;
+    }
+    // The bits after the end of the bitmap may match, since they read as 0
+    uint64_t b = (uint64_t)w * 64 + __builtin_ctzll(word);
+    return b < nbits ? b : nbits;
+}
+
+bool bitmap_test(const char *bm, uint32_t b)
+{
+    return 0 != (bm[b / 8] & (1 << (b % 8)));
+}
+
+uint32_t bitmap_find_next_zero(const char *bm, uint32_t nbits, uint32_t start)
+{
+    return find_next(bm, nbits, start, ~0ull);
+}
+
+uint32_t bitmap_find_next_set(const char *bm, uint32_t nbits, uint32_t start)
+{
+    return find_next(bm, nbits, start, 0);
+}
+
+uint32_t bitmap_find_zero_run(const char *bm, uint32_t nbits, uint32_t needed, uint32_t *len)
+{
+    uint32_t max_s = nbits, max_len = 0;
+    for(uint32_t b = 0; b < nbits;)
+    {
+        uint32_t s = bitmap_find_next_zero(bm, nbits, b);
+        if(s == nbits) break;
+        b = bitmap_find_next_set(bm, nbits, s);
+        if(b - s >= needed)
+        {
+            *len = b - s;
+            return s;
+        }
+        if(b - s > max_len)
+        {
+            max_len = b - s;
+            max_s = s;
+        }
+    }
+    *len = max_len;
+    return max_s;
+}
+
+/**
+ * Set (or clear) count bits starting at start, a word at a time
+*/
+static void update_range(char *bm, uint32_t start, uint32_t count, bool set)
+{
+    uint64_t end = (uint64_t)start + count;
+    for(uint32_t w = start / 64; (uint64_t)w * 64 < end; w++)
+    {
+        uint64_t mask = range_mask(w, start, end);
+        if(~0ull == mask)
+        { // The whole word is in the range, so it doesn't need to be read
+            store_word(bm, w, set ? ~0ull : 0, end);
+            continue;
+        }
+        uint64_t word = load_word(bm, w, end);
+        store_word(bm, w, set ? word | mask : word & ~mask, end);
+    }
+}
+
+void bitmap_set_range(char *bm, uint32_t start, uint32_t count)
+{
+    update_range(bm, start, count, true);
+}
+
+void bitmap_clear_range(char *bm, uint32_t start, uint32_t count)
+{
+    update_range(bm, start, count, false);
+}
+
+uint32_t bitmap_count_set(const char *bm, uint32_t start, uint32_t count)
+{
+    uint64_t end = (uint64_t)start + count;
+    uint32_t num_set = 0;
+    for(uint32_t w = start / 64; (uint64_t)w * 64 < end; w++)
+    {
+        num_set += __builtin_popcountll(load_word(bm, w, end) & range_mask(w, start, end));
+    }
+    return num_set;
+}
+
+uint32_t bitmap_find_next_zero_scalar(const char *bm, uint32_t nbits, uint32_t start)
+{
+    for(uint32_t b = start; b < nbits; b++)
+    {
+        if(!bitmap_test(bm, b)) return b;
+    }
+    return nbits;
+}
+
+uint32_t bitmap_find_next_set_scalar(const char *bm, uint32_t nbits, uint32_t start)
+{
+    for(uint32_t b = start; b < nbits; b++)
+    {
+        if(bitmap_test(bm, b)) return b;
+    }
+    return nbits;
+}
+
+void bitmap_set_range_scalar(char *bm, uint32_t start, uint32_t count)
+{
+    for(uint32_t b = start; b < start + count; b++) bm[b / 8] |= 1 << (b % 8);
+}
+
+void bitmap_clear_range_scalar(char *bm, uint32_t start, uint32_t count)
+{
+    for(uint32_t b = start; b < start + count; b++) bm[b / 8] &= ~(1 << (b % 8));
+}
+
+uint32_t bitmap_count_set_scalar(const char *bm, uint32_t start, uint32_t count)
+{
+    uint32_t num_set = 0;
+    for(uint32_t b = start; b < start + count; b++) num_set += bitmap_test(bm, b);
+    return num_set;
+}
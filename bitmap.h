@@ -0,0 +1,72 @@
+/**
+ * CSC369 Assignment 1 - Bitmap header file.
+ *  Operations on the data bitmap (bit b is bit b % 8 of byte b / 8, a set bit marks an allocated
+ *  block) which work on 64 bits at a time, so that scanning or updating a long range touches one
+ *  word per 64 blocks instead of every bit. Only the bytes holding bits of the range are accessed.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Check if a bit is set
+*/
+bool bitmap_test(const char *bm, uint32_t b);
+
+/**
+ * Find the first clear bit at or after start
+ *
+ * @param  bm     the bitmap
+ * @param  nbits  the number of bits in the bitmap
+ * @param  start  the first bit to check
+ * @return        the index of the bit; nbits if there are none
+*/
+uint32_t bitmap_find_next_zero(const char *bm, uint32_t nbits, uint32_t start);
+
+/**
+ * Find the first set bit at or after start
+ *
+ * @param  bm     the bitmap
+ * @param  nbits  the number of bits in the bitmap
+ * @param  start  the first bit to check
+ * @return        the index of the bit; nbits if there are none
+*/
+uint32_t bitmap_find_next_set(const char *bm, uint32_t nbits, uint32_t start);
+
+/**
+ * Find the first run of at least needed clear bits, and if there are none the longest run
+ *
+ * @param  bm      the bitmap
+ * @param  nbits   the number of bits in the bitmap
+ * @param  needed  the length of the run needed
+ * @param  len     set to the length of the run found, which may be more than needed
+ * @return         the index of the first bit of the run; nbits if there are no clear bits
+*/
+uint32_t bitmap_find_zero_run(const char *bm, uint32_t nbits, uint32_t needed, uint32_t *len);
+
+/**
+ * Set count bits starting at start
+*/
+void bitmap_set_range(char *bm, uint32_t start, uint32_t count);
+
+/**
+ * Clear count bits starting at start
+*/
+void bitmap_clear_range(char *bm, uint32_t start, uint32_t count);
+
+/**
+ * Count the set bits among the count bits starting at start
+*/
+uint32_t bitmap_count_set(const char *bm, uint32_t start, uint32_t count);
+
+/**
+ * Reference (one bit at a time) implementations of the functions above, which must give identical
+ * results
+*/
+uint32_t bitmap_find_next_zero_scalar(const char *bm, uint32_t nbits, uint32_t start);
+uint32_t bitmap_find_next_set_scalar(const char *bm, uint32_t nbits, uint32_t start);
+void bitmap_set_range_scalar(char *bm, uint32_t start, uint32_t count);
+void bitmap_clear_range_scalar(char *bm, uint32_t start, uint32_t count);
+uint32_t bitmap_count_set_scalar(const char *bm, uint32_t start, uint32_t count);
@@ -0,0 +1,123 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "util.h"
+
+/**
+ * Compute the hash of an entry, mixing the parent inode number into the name hash
+*/
+static uint32_t entry_hash(a1fs_ino_t parent, const char *name)
+{
+    return str_hash(name) ^ (parent * 2654435761u);
+}
+
+bool dcache_init(dcache *dc, uint32_t num_inodes)
+{
+    // Use about as many buckets as there are inodes (rounded up to a power of 2)
+    uint32_t num_buckets = 1;
+    while(num_buckets < num_inodes && num_buckets < DCACHE_MAX_BUCKETS) num_buckets <<= 1;
+
+    dc->buckets = calloc(num_buckets, sizeof(dcache_entry *));
+    if(NULL == dc->buckets) return false;
+    dc->num_buckets = num_buckets;
+    dc->hits = dc->negative_hits = dc->misses = 0;
+    return true;
+}
+
+void dcache_destroy(dcache *dc)
+{
+    if(NULL == dc->buckets) return;
+    for(uint32_t b = 0; b < dc->num_buckets; b++)
+    {
+        dcache_entry *entry = dc->buckets[b];
+        while(NULL != entry)
+        {
+            dcache_entry *next = entry->next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(dc->buckets);
+    dc->buckets = NULL;
+}
+
+int dcache_lookup(dcache *dc, a1fs_ino_t parent, const char *name)
+{
+    uint32_t hash = entry_hash(parent, name);
+    for(dcache_entry *entry = dc->buckets[hash & (dc->num_buckets-1)]; NULL != entry; entry = entry->next)
+    {
+        if(entry->hash == hash && entry->parent == parent && 0 == strcmp(entry->name, name))
+        {
+            if(DCACHE_NEGATIVE == entry->ino)
+            {
+                dc->negative_hits++;
+                return -ENOENT;
+            }
+            dc->hits++;
+            return entry->ino;
+        }
+    }
+    dc->misses++;
+    return DCACHE_MISS;
+}
+
+void dcache_insert(dcache *dc, a1fs_ino_t parent, const char *name, a1fs_ino_t ino)
+{
+    uint32_t hash = entry_hash(parent, name);
+    dcache_entry **bucket = &dc->buckets[hash & (dc->num_buckets-1)];
+
+    // Update the entry in place if it is already cached
+    for(dcache_entry *entry = *bucket; NULL != entry; entry = entry->next)
+    {
+        if(entry->hash == hash && entry->parent == parent && 0 == strcmp(entry->name, name))
+        {
+            entry->ino = ino;
+            return;
+        }
+    }
+
+    size_t len = strlen(name) + 1;
+    dcache_entry *new_entry = malloc(sizeof(dcache_entry) + len);
+    if(NULL == new_entry) return; // Caching is best effort
+    new_entry->parent = parent;
+    new_entry->ino = ino;
+    new_entry->hash = hash;
+    memcpy(new_entry->name, name, len);
+
+    // Insert at the head of the chain, and evict the oldest entry if the chain is too long
+    new_entry->next = *bucket;
+    *bucket = new_entry;
+
+    dcache_entry **link = bucket;
+    for(int i = 0; NULL != *link; i++, link = &(*link)->next)
+    {
+        if(DCACHE_MAX_CHAIN == i)
+        {
+            free(*link); // Since entries are inserted at the head, this is the tail
+            *link = NULL;
+            break;
+        }
+    }
+}
+
+void dcache_insert_negative(dcache *dc, a1fs_ino_t parent, const char *name)
+{
+    dcache_insert(dc, parent, name, DCACHE_NEGATIVE);
+}
+
+void dcache_remove(dcache *dc, a1fs_ino_t parent, const char *name)
+{
+    uint32_t hash = entry_hash(parent, name);
+    for(dcache_entry **link = &dc->buckets[hash & (dc->num_buckets-1)]; NULL != *link; link = &(*link)->next)
+    {
+        dcache_entry *entry = *link;
+        if(entry->hash == hash && entry->parent == parent && 0 == strcmp(entry->name, name))
+        {
+            *link = entry->next;
+            free(entry);
+            return;
+        }
+    }
+}
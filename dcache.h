@@ -0,0 +1,107 @@
+/**
+ * CSC369 Assignment 1 - Directory entry cache header file.
+ *  An in-memory hash table which maps a (parent inode, name) pair to the inode number of the entry,
+ *  so that path_lookup() does not have to scan the parent's data blocks for every path component.
+ *  Whole paths are also cached under the DCACHE_PATH_PARENT pseudo parent.
+ *  Names which are known not to exist are cached as negative entries.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+/** Pseudo parent inode number used to cache full (absolute) paths. */
+#define DCACHE_PATH_PARENT UINT32_MAX
+
+/** The inode number of a negative entry. */
+#define DCACHE_NEGATIVE UINT32_MAX
+
+/** Returned by dcache_lookup() if the entry is not cached. */
+#define DCACHE_MISS -1
+
+/** The maximum number of entries kept in a single hash chain, older entries are evicted. */
+#define DCACHE_MAX_CHAIN 4
+
+/** The maximum number of hash buckets. */
+#define DCACHE_MAX_BUCKETS (1u << 20)
+
+/**
+ * A single cached entry
+*/
+typedef struct dcache_entry {
+    struct dcache_entry *next; // The next entry in the hash chain
+    a1fs_ino_t parent;         // The inode number of the parent directory
+    a1fs_ino_t ino;            // The inode number the name maps to, DCACHE_NEGATIVE if the name doesn't exist
+    uint32_t   hash;           // The hash of the name
+    char       name[];         // The null-terminated name (or full path)
+} dcache_entry;
+
+/**
+ * The directory entry cache
+*/
+typedef struct dcache {
+    dcache_entry **buckets;
+    uint32_t       num_buckets; // Always a power of 2
+    uint64_t       hits;
+    uint64_t       negative_hits;
+    uint64_t       misses;
+} dcache;
+
+/**
+ * Initialize an empty cache
+ *
+ * @param  dc          a pointer to the cache
+ * @param  num_inodes  the number of inodes in the file system, used to size the hash table
+ * @return             true on success; false on failure (e.g. a malloc() call failed).
+*/
+bool dcache_init(dcache *dc, uint32_t num_inodes);
+
+/**
+ * Free all the entries and the hash table of the cache
+ *
+ * @param  dc  a pointer to the cache
+*/
+void dcache_destroy(dcache *dc);
+
+/**
+ * Lookup a name in a directory. Updates the hit/miss counters.
+ *
+ * @param  dc      a pointer to the cache
+ * @param  parent  the inode number of the parent directory (or DCACHE_PATH_PARENT)
+ * @param  name    the name of the entry (or the full path)
+ * @return         the cached inode number; -ENOENT if the name is cached as not existing;
+ *                 DCACHE_MISS if the entry is not cached
+*/
+int dcache_lookup(dcache *dc, a1fs_ino_t parent, const char *name);
+
+/**
+ * Add (or update) an entry. If the entry can't be allocated nothing is cached.
+ *
+ * @param  dc      a pointer to the cache
+ * @param  parent  the inode number of the parent directory (or DCACHE_PATH_PARENT)
+ * @param  name    the name of the entry (or the full path)
+ * @param  ino     the inode number the name maps to (or DCACHE_NEGATIVE)
+*/
+void dcache_insert(dcache *dc, a1fs_ino_t parent, const char *name, a1fs_ino_t ino);
+
+/**
+ * Add (or update) a negative entry, which records that the name doesn't exist. The entry must be
+ * replaced when the name is created.
+ *
+ * @param  dc      a pointer to the cache
+ * @param  parent  the inode number of the parent directory (or DCACHE_PATH_PARENT)
+ * @param  name    the name of the entry (or the full path)
+*/
+void dcache_insert_negative(dcache *dc, a1fs_ino_t parent, const char *name);
+
+/**
+ * Remove an entry, if it is cached
+ *
+ * @param  dc      a pointer to the cache
+ * @param  parent  the inode number of the parent directory (or DCACHE_PATH_PARENT)
+ * @param  name    the name of the entry (or the full path)
+*/
+void dcache_remove(dcache *dc, a1fs_ino_t parent, const char *name);
@@ -0,0 +1,251 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "defrag.h"
+#include "bitmap.h"
+#include "etree.h"
+#include "fs_utils.h"
+#include "util.h"
+
+/**
+ * Lock a file for a chunk of work, with ns_lock held for reading so it can't be unlinked meanwhile.
+ *  Directories are left alone (their blocks are cached by block number), and so are orphans (their
+ *  extents belong to the reclaimer) and inline files.
+ *
+ * @return  true if the file is locked; false if it is not one to defragment (nothing is locked)
+*/
+static bool lock_file(a1fs_ino_t ino, fs_ctx *fs)
+{
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    fs_lock_inode(fs, ino, true);
+    a1fs_inode *inode = &fs->inode_table[ino];
+    if(bitmap_test(fs->i_bitmap, ino) && S_ISREG(inode->mode) && 0 != inode->links &&
+       !(inode->flags & A1FS_INODE_INLINE)) return true;
+    fs_unlock_inode(fs, ino);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    return false;
+}
+
+static void unlock_file(a1fs_ino_t ino, fs_ctx *fs)
+{
+    fs_unlock_inode(fs, ino);
+    pthread_rwlock_unlock(&fs->ns_lock);
+}
+
+/**
+ * Wait for as long as moving a number of blocks takes at the rate limit, or until the defragmenter
+ *  is stopped
+ *
+ * @return  true to carry on; false if the defragmenter should stop
+*/
+static bool throttle(uint32_t blocks, uint32_t rate, fs_ctx *fs)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    uint64_t ns = (uint64_t)blocks * 1000000000ull / rate + until.tv_nsec;
+    until.tv_sec += ns / 1000000000ull;
+    until.tv_nsec = ns % 1000000000ull;
+
+    pthread_mutex_lock(&fs->defrag_lock);
+    while(0 != blocks && !fs->defrag_stop &&
+          ETIMEDOUT != pthread_cond_timedwait(&fs->defrag_cond, &fs->defrag_lock, &until));
+    bool stop = fs->defrag_stop;
+    pthread_mutex_unlock(&fs->defrag_lock);
+    return !stop;
+}
+
+/**
+ * Find the next window of a file to move: the extents from a logical block on which follow each other
+ *  without holes, are shorter than DEFRAG_CHUNK_BLOCKS, and fit in a chunk (or in the blocks a
+ *  shorter free sequence has room for)
+ *
+ * @param  inode   a pointer to the inode
+ * @param  lblk    the block from which to look
+ * @param  limit   the most blocks in the window
+ * @param  window  a pointer in which to put the logical blocks of the window (lblk and count). Its
+ *                  count is 0 if there are no more small extents
+ * @param  fs      a pointer to the context
+ * @return         the number of extents in the window which don't start where the one before them ends
+ *                  physically (the ones moving the window merges)
+*/
+static uint32_t find_window(a1fs_inode *inode, uint32_t lblk, uint32_t limit, a1fs_extent *window, fs_ctx *fs)
+{
+    etree_cursor cursor;
+    a1fs_extent *extent = etree_seek(&cursor, inode, lblk, fs);
+    while(NULL != extent && extent->count >= DEFRAG_CHUNK_BLOCKS) extent = etree_next(&cursor, fs);
+    *window = (a1fs_extent){ NULL == extent ? 0 : extent->lblk, 0, 0, 0 };
+
+    uint32_t gaps = 0, count = 0;
+    a1fs_extent *prev = NULL;
+    for(; NULL != extent && extent->count < DEFRAG_CHUNK_BLOCKS && count + extent->count <= limit;
+        extent = etree_next(&cursor, fs))
+    {
+        if(NULL != prev && prev->lblk + prev->count != extent->lblk) break;
+        if(NULL != prev && prev->start + prev->count != extent->start) gaps++;
+        count += extent->count;
+        prev = extent;
+    }
+    window->count = count;
+    return gaps;
+}
+
+/**
+ * Move the next window of small extents of a file into a single free sequence, and merge them. The
+ *  sequence starts right after the extent before the window if those blocks are free, so the window
+ *  joins it. A window whose extents are already contiguous is skipped. The file is locked.
+ *
+ * @param  inode   a pointer to the inode
+ * @param  lblk    a pointer to the block from which to look for the window, moved past it
+ * @param  moved   a pointer to the number of data blocks moved, which is increased
+ * @param  merged  a pointer to the number of extents merged, which is increased
+ * @param  fs      a pointer to the context
+ * @return         true if there may be more windows; false at the end of the file, or if there is no
+ *                  free space to move the data to
+*/
+static bool move_window(a1fs_inode *inode, uint32_t *lblk, uint64_t *moved, uint64_t *merged, fs_ctx *fs)
+{
+    a1fs_extent window;
+    uint32_t gaps = find_window(inode, *lblk, DEFRAG_CHUNK_BLOCKS, &window, fs);
+    if(0 == window.count) return false;
+    *lblk = window.lblk + window.count;
+    if(0 == gaps) return true;
+
+    a1fs_extent *prev = 0 != window.lblk ? get_extent(inode, window.lblk - 1, fs) : NULL;
+    a1fs_extent *first = get_extent(inode, window.lblk, fs);
+    a1fs_blk_t to;
+    uint32_t len = alloc_data_run(window.count, prev, block_group(first->start, fs), &to, fs);
+    if(0 == len) return false;
+    // With less space the window only takes the extents which fit in it
+    if(len < window.count && 0 == find_window(inode, window.lblk, len, &window, fs))
+    {
+        free_block_range(to, len, fs);
+        return true;
+    }
+    if(len > window.count) free_block_range(to + window.count, len - window.count, fs);
+
+    etree_cursor cursor;
+    a1fs_blk_t next = to;
+    for(a1fs_extent *extent = etree_seek(&cursor, inode, window.lblk, fs); next - to < window.count;
+        extent = etree_next(&cursor, fs))
+    {
+        // Unwritten extents read as zeros, they have nothing to copy
+        if(!extent->unwritten)
+        {
+            memcpy(fs->data_blks + (size_t)next * A1FS_BLOCK_SIZE, fs->data_blks + (size_t)extent->start * A1FS_BLOCK_SIZE,
+                   (size_t)extent->count * A1FS_BLOCK_SIZE);
+        }
+        free_block_range(extent->start, extent->count, fs);
+        extent->start = next;
+        next += extent->count;
+    }
+    *moved += window.count;
+    *lblk = window.lblk + window.count;
+    // The window joins the extent before it, and the one after it if that follows the new blocks
+    *merged += etree_merge(inode, NULL != prev ? window.lblk - 1 : window.lblk, *lblk + 1, fs);
+    invalidate_extent_map(inode, fs);
+    return true;
+}
+
+void defrag_inode(a1fs_ino_t ino, uint32_t rate, fs_ctx *fs)
+{
+    if(0 == rate) rate = DEFRAG_DEFAULT_RATE;
+    a1fs_inode *inode = &fs->inode_table[ino];
+    uint64_t total_moved = 0, total_merged = 0;
+    uint32_t lblk = 0;
+    bool more = true;
+    while(more && lock_file(ino, fs))
+    {
+        uint64_t moved = 0, merged = 0;
+        // Merging only changes the tree, the whole file is done at once
+        if(0 == lblk && 0 != (merged = etree_merge(inode, 0, UINT32_MAX, fs))) invalidate_extent_map(inode, fs);
+        more = move_window(inode, &lblk, &moved, &merged, fs);
+        unlock_file(ino, fs);
+
+        total_moved += moved;
+        total_merged += merged;
+        pthread_mutex_lock(&fs->defrag_lock);
+        fs->defrag_stats.blocks_moved += moved;
+        fs->defrag_stats.extents_merged += merged;
+        pthread_mutex_unlock(&fs->defrag_lock);
+        if(!throttle(moved, rate, fs)) break;
+    }
+    if(0 == total_moved && 0 == total_merged) return;
+    pthread_mutex_lock(&fs->defrag_lock);
+    fs->defrag_stats.files_defragged++;
+    pthread_mutex_unlock(&fs->defrag_lock);
+}
+
+/**
+ * The defragmenter thread, which makes one pass over all the inodes
+*/
+static void *defragger_main(void *arg)
+{
+    fs_ctx *fs = arg;
+    uint32_t num_inodes = fs->superblock->num_inodes;
+    pthread_rwlock_rdlock(&fs->ns_lock);
+    uint32_t total = num_inodes - fs->superblock->num_free_inodes;
+    a1fs_ino_t ino = bitmap_find_next_set(fs->i_bitmap, num_inodes, 0);
+    pthread_rwlock_unlock(&fs->ns_lock);
+    pthread_mutex_lock(&fs->defrag_lock);
+    fs->defrag_stats.inodes_total = total;
+    bool stop = fs->defrag_stop;
+    pthread_mutex_unlock(&fs->defrag_lock);
+
+    while(ino < num_inodes && !stop)
+    {
+        defrag_inode(ino, fs->defrag_rate, fs);
+        pthread_rwlock_rdlock(&fs->ns_lock);
+        ino = bitmap_find_next_set(fs->i_bitmap, num_inodes, ino + 1);
+        pthread_rwlock_unlock(&fs->ns_lock);
+        pthread_mutex_lock(&fs->defrag_lock);
+        fs->defrag_stats.inodes_done++;
+        stop = fs->defrag_stop;
+        pthread_mutex_unlock(&fs->defrag_lock);
+    }
+    pthread_mutex_lock(&fs->defrag_lock);
+    fs->defrag_stats.running = 0;
+    pthread_mutex_unlock(&fs->defrag_lock);
+    return NULL;
+}
+
+int start_defrag(uint32_t rate, fs_ctx *fs)
+{
+    pthread_mutex_lock(&fs->defrag_lock);
+    if(fs->defrag_stats.running)
+    {
+        pthread_mutex_unlock(&fs->defrag_lock);
+        return -EBUSY;
+    }
+    // The last pass is over, its thread only needs to be joined
+    if(fs->defragger_started) pthread_join(fs->defragger, NULL);
+    fs->defragger_started = false;
+    fs->defrag_stop = false;
+    fs->defrag_rate = rate;
+    fs->defrag_stats.running = 1;
+    fs->defrag_stats.inodes_done = 0;
+    fs->defrag_stats.inodes_total = 0;
+    int ret = pthread_create(&fs->defragger, NULL, defragger_main, fs);
+    if(0 == ret) fs->defragger_started = true;
+    else fs->defrag_stats.running = 0;
+    pthread_mutex_unlock(&fs->defrag_lock);
+    return -ret;
+}
+
+void stop_defrag(fs_ctx *fs)
+{
+    pthread_mutex_lock(&fs->defrag_lock);
+    fs->defrag_stop = true;
+    pthread_cond_broadcast(&fs->defrag_cond);
+    bool started = fs->defragger_started;
+    fs->defragger_started = false;
+    pthread_mutex_unlock(&fs->defrag_lock);
+    if(started) pthread_join(fs->defragger, NULL);
+}
+
+void defrag_get_stats(a1fs_defrag_stats *stats, fs_ctx *fs)
+{
+    pthread_mutex_lock(&fs->defrag_lock);
+    *stats = fs->defrag_stats;
+    pthread_mutex_unlock(&fs->defrag_lock);
+}
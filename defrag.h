@@ -0,0 +1,54 @@
+/**
+ * CSC369 Assignment 1 - Online defragmenter header file.
+ *  Files whose extents are small and scattered (e.g. written by interleaved writers) are read slowly
+ *  and use many extents. The defragmenter merges the extents of a file which are adjacent both
+ *  logically and physically, and moves runs of small extents into a single free sequence (right after
+ *  the extent before them when there is room), so they merge too. It works while the file system is
+ *  mounted: a file is only locked for one chunk of work at a time, and the data it moves is throttled
+ *  to a number of blocks per second. See A1FS_IOC_DEFRAG.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+/** The default limit on the data blocks moved per second (32 MiB/s). */
+#define DEFRAG_DEFAULT_RATE 8192
+
+/** The most data blocks moved with a file locked (2 MiB). Extents at least this long stay where they are. */
+#define DEFRAG_CHUNK_BLOCKS 512
+
+/**
+ * Defragment a file: merge its adjacent extents, then move its small extents chunk by chunk. Regular
+ * files with extents are defragmented, other inodes (and unlinked files) are left alone. No locks may
+ * be held by the caller.
+ *
+ * @param  ino   the inode number
+ * @param  rate  the most data blocks to move per second; 0 for DEFRAG_DEFAULT_RATE
+ * @param  fs    a pointer to the context
+*/
+void defrag_inode(a1fs_ino_t ino, uint32_t rate, fs_ctx *fs);
+
+/**
+ * Start a pass of the defragmenter over all the files, in a background thread. Its progress is in
+ * fs->defrag_stats.
+ *
+ * @param  rate  the most data blocks to move per second; 0 for DEFRAG_DEFAULT_RATE
+ * @param  fs    a pointer to the context
+ * @return       0 on success; -EBUSY if a pass is already running; -errno on other errors
+*/
+int start_defrag(uint32_t rate, fs_ctx *fs);
+
+/**
+ * Stop the defragmenter (after the chunk it is working on) and wait for its thread. Does nothing if
+ * it wasn't started.
+*/
+void stop_defrag(fs_ctx *fs);
+
+/**
+ * Copy the progress of the defragmenter
+*/
+void defrag_get_stats(a1fs_defrag_stats *stats, fs_ctx *fs);
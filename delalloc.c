@@ -0,0 +1,116 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "delalloc.h"
+#include "util.h"
+
+bool delalloc_init(delalloc *da, uint32_t num_inodes)
+{
+    // Use about as many buckets as there are inodes (rounded up to a power of 2)
+    uint32_t num_buckets = 1;
+    while(num_buckets < num_inodes && num_buckets < DELALLOC_MAX_BUCKETS) num_buckets <<= 1;
+
+    da->buckets = calloc(num_buckets, sizeof(da_buf *));
+    if(NULL == da->buckets) return false;
+    da->num_buckets = num_buckets;
+    da->enabled = false;
+    da->total_bytes = 0;
+    da->reserved_blocks = 0;
+    return true;
+}
+
+void delalloc_destroy(delalloc *da)
+{
+    if(NULL == da->buckets) return;
+    da_buf *buf;
+    while(NULL != (buf = delalloc_first(da))) delalloc_remove(da, buf);
+    free(da->buckets);
+    da->buckets = NULL;
+}
+
+da_buf *delalloc_get(delalloc *da, a1fs_ino_t ino)
+{
+    for(da_buf *buf = da->buckets[ino & (da->num_buckets-1)]; NULL != buf; buf = buf->next)
+    {
+        if(buf->ino == ino) return buf;
+    }
+    return NULL;
+}
+
+da_buf *delalloc_get_or_create(delalloc *da, a1fs_ino_t ino)
+{
+    da_buf *buf = delalloc_get(da, ino);
+    if(NULL != buf) return buf;
+
+    if(NULL == (buf = calloc(1, sizeof(da_buf)))) return NULL;
+    buf->ino = ino;
+    da_buf **bucket = &da->buckets[ino & (da->num_buckets-1)];
+    buf->next = *bucket;
+    *bucket = buf;
+    return buf;
+}
+
+da_buf *delalloc_first(delalloc *da)
+{
+    for(uint32_t b = 0; b < da->num_buckets; b++)
+    {
+        if(NULL != da->buckets[b]) return da->buckets[b];
+    }
+    return NULL;
+}
+
+bool delalloc_grow(delalloc *da, da_buf *buf, uint64_t len)
+{
+    if(len <= buf->len) return true;
+    if(len > buf->cap)
+    { // Double the allocation, so a file written in small pieces is copied a logarithmic number of times
+        uint64_t cap = 0 == buf->cap ? A1FS_BLOCK_SIZE : buf->cap;
+        while(cap < len) cap *= 2;
+        char *data = realloc(buf->data, cap);
+        if(NULL == data) return false;
+        buf->data = data;
+        buf->cap = cap;
+    }
+    memset(buf->data + buf->len, 0, len - buf->len);
+    da->total_bytes += len - buf->len;
+    buf->len = len;
+    return true;
+}
+
+bool delalloc_claim(delalloc *da, uint32_t blocks, pcounter *num_free)
+{
+    uint32_t reserved = AtomicLoad(&da->reserved_blocks);
+    do
+    {
+        if(!pcounter_at_least(num_free, (uint64_t)reserved + blocks)) return false;
+    }while(!AtomicCompareExchange(&da->reserved_blocks, &reserved, reserved + blocks));
+    return true;
+}
+
+void delalloc_release(delalloc *da, uint32_t blocks)
+{
+    if(0 != blocks) AtomicSub(&da->reserved_blocks, blocks);
+}
+
+void delalloc_reserve(delalloc *da, da_buf *buf, uint32_t blocks)
+{
+    // The blocks added to the reservation are already counted, since they were claimed
+    if(blocks < buf->reserved) delalloc_release(da, buf->reserved - blocks);
+    buf->reserved = blocks;
+}
+
+void delalloc_remove(delalloc *da, da_buf *buf)
+{
+    for(da_buf **link = &da->buckets[buf->ino & (da->num_buckets-1)]; NULL != *link; link = &(*link)->next)
+    {
+        if(*link == buf)
+        {
+            *link = buf->next;
+            break;
+        }
+    }
+    da->total_bytes -= buf->len;
+    AtomicSub(&da->reserved_blocks, buf->reserved);
+    free(buf->data);
+    free(buf);
+}
@@ -0,0 +1,121 @@
+/**
+ * CSC369 Assignment 1 - Delayed allocation buffer header file.
+ *  With delayed allocation, the bytes a write adds to the end of a file are kept in an in-memory buffer
+ *  of the inode instead of being written to newly allocated blocks. The blocks for the whole buffer are
+ *  allocated in one request when it is flushed (on close, fsync, truncate or when the buffers use too
+ *  much memory), so a file written in small pieces still gets a few large extents.
+ *  The data blocks a buffer will need are reserved, so the flush doesn't run out of space.
+ *  The buffers aren't thread safe, the caller locks them.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "pcounter.h"
+
+/** The maximum number of hash buckets. */
+#define DELALLOC_MAX_BUCKETS (1u << 12)
+
+/** The maximum number of bytes kept in all the buffers, after which they are flushed. */
+#define DELALLOC_MAX_BYTES (64ull << 20)
+
+/**
+ * The pending data of a single inode
+*/
+typedef struct da_buf {
+    struct da_buf *next; // The next buffer in the hash chain
+    a1fs_ino_t ino;      // The inode number
+    char      *data;     // The bytes which go after the end of the inode's data
+    uint64_t   len;      // The number of bytes in data
+    uint64_t   cap;      // The size of the allocation of data
+    uint32_t   reserved; // The number of data blocks reserved for the buffer
+} da_buf;
+
+/**
+ * The buffers of all the inodes with pending data
+*/
+typedef struct delalloc {
+    da_buf  **buckets;
+    uint32_t  num_buckets;     // Always a power of 2
+    bool      enabled;         // Set by the delalloc mount option
+    uint64_t  total_bytes;     // The number of bytes in all the buffers
+    uint32_t  reserved_blocks; // The number of data blocks reserved by all the buffers, and claimed by
+                               // allocations in progress (updated atomically)
+} delalloc;
+
+/**
+ * Initialize with no buffers, and delayed allocation disabled
+ *
+ * @param  da          a pointer to the buffers
+ * @param  num_inodes  the number of inodes in the file system, used to size the hash table
+ * @return             true on success; false on failure (e.g. a malloc() call failed).
+*/
+bool delalloc_init(delalloc *da, uint32_t num_inodes);
+
+/**
+ * Free all the buffers, discarding their data
+ *
+ * @param  da  a pointer to the buffers
+*/
+void delalloc_destroy(delalloc *da);
+
+/**
+ * Get the buffer of an inode
+ *
+ * @param  da   a pointer to the buffers
+ * @param  ino  the inode number
+ * @return      the buffer; NULL if the inode has no pending data
+*/
+da_buf *delalloc_get(delalloc *da, a1fs_ino_t ino);
+
+/**
+ * Get the buffer of an inode, adding an empty one if there is none
+ *
+ * @return  the buffer; NULL if it can't be allocated
+*/
+da_buf *delalloc_get_or_create(delalloc *da, a1fs_ino_t ino);
+
+/**
+ * Get any buffer, used to flush all of them
+ *
+ * @return  a buffer; NULL if there are none
+*/
+da_buf *delalloc_first(delalloc *da);
+
+/**
+ * Extend a buffer to len bytes, the new bytes are zero
+ *
+ * @return  true on success; false if the buffer can't be grown (the buffer is unchanged)
+*/
+bool delalloc_grow(delalloc *da, da_buf *buf, uint64_t len);
+
+/**
+ * Claim free data blocks, counting them as reserved so no other allocation or buffer can claim them.
+ * Every allocation claims its blocks first, and releases the claim as the blocks are allocated (after
+ * they are taken off the free count, so the free count never drops below the reserved count for long).
+ * Thread safe, without any lock.
+ *
+ * @param  blocks    the number of blocks to claim
+ * @param  num_free  the counter of free blocks
+ * @return           true if the blocks are claimed; false if there aren't enough unreserved free blocks
+*/
+bool delalloc_claim(delalloc *da, uint32_t blocks, pcounter *num_free);
+
+/**
+ * Release claimed blocks
+*/
+void delalloc_release(delalloc *da, uint32_t blocks);
+
+/**
+ * Set the number of data blocks reserved for a buffer. The blocks added to the reservation must have
+ * been claimed with delalloc_claim(), the claim becomes the buffer's.
+*/
+void delalloc_reserve(delalloc *da, da_buf *buf, uint32_t blocks);
+
+/**
+ * Remove a buffer, discarding its data and releasing its reservation
+*/
+void delalloc_remove(delalloc *da, da_buf *buf);
@@ -0,0 +1,793 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+#include "util.h"
+#include "fs_utils.h"
+#include "dtags.h"
+#include "etree.h"
+#include "dir.h"
+
+/*
+ * Operations on a single block of dentries (a leaf block)
+ */
+
+/**
+ * A block of dentries, of either format
+*/
+typedef struct dir_leaf {
+    void       *data;
+    uint32_t    size;    // The size of the block in bytes
+    bool        var_len; // The block holds a1fs_var_dentry records rather than a1fs_dentry
+    dtags      *tags;    // The cache of dentry tags for the block, NULL if tags are not used
+    a1fs_blk_t  blk;     // The block number of the block, if tags are used
+} dir_leaf;
+
+/** The maximum number of entries a leaf block can hold, in either format. */
+#define DIR_MAX_LEAF_ENTRIES (A1FS_BLOCK_SIZE / A1FS_VAR_DENTRY_LEN(1))
+
+/** Get the var length dentry at offset bytes into a leaf. */
+#define VAR_DENTRY_AT(leaf, offset) ((a1fs_var_dentry *)((char *)(leaf).data + (offset)))
+
+/**
+ * Get the leaf for a data block of a directory
+*/
+static dir_leaf dir_leaf_blk(void *blk, fs_ctx *fs)
+{
+    dir_leaf leaf;
+    leaf.data    = blk;
+    leaf.size    = A1FS_BLOCK_SIZE;
+    leaf.var_len = 0 != (fs->superblock->features & A1FS_FEATURE_VAR_DENTRY);
+    // Tags are only kept for fixed size dentries, var length dentries compare the name lengths instead
+    leaf.tags    = leaf.var_len ? NULL : &fs->dtags;
+    leaf.blk     = (blk - fs->data_blks) / A1FS_BLOCK_SIZE;
+    return leaf;
+}
+
+/**
+ * Get the leaf stored in the inode of an inline directory, which always holds var length records
+*/
+static dir_leaf dir_leaf_inline(a1fs_inode *dir)
+{
+    dir_leaf leaf = { dir->inline_data, A1FS_INLINE_DATA_MAX, true, NULL, 0 };
+    return leaf;
+}
+
+/**
+ * Check that a var length record is within the leaf, so a corrupt block can't be walked off of
+*/
+static bool var_dentry_valid(dir_leaf leaf, uint32_t offset)
+{
+    uint16_t rec_len = VAR_DENTRY_AT(leaf, offset)->rec_len;
+    return rec_len >= sizeof(a1fs_var_dentry) && rec_len <= leaf.size - offset;
+}
+
+/**
+ * Initialize an empty leaf
+*/
+static void leaf_init(dir_leaf leaf)
+{
+    memset(leaf.data, 0, leaf.size);
+    // The whole block is one unused record
+    if(leaf.var_len) VAR_DENTRY_AT(leaf, 0)->rec_len = leaf.size;
+    // All the dentries are empty
+    if(NULL != leaf.tags) memset(dtags_fill(leaf.tags, leaf.blk), DTAG_EMPTY, NUM_DENTRY_PER_BLOCK);
+}
+
+/**
+ * Find a name in a leaf
+ *
+ * @param  leaf  the leaf
+ * @param  name  the name to find
+ * @param  tag   the tag of the name (see dtag_of())
+ * @return       the inode number of the entry; -1 if the name is not in the leaf
+*/
+static int leaf_find(dir_leaf leaf, const char *name, uint8_t tag)
+{
+    if(leaf.var_len)
+    {
+        size_t name_len = strlen(name);
+        for(uint32_t off = 0; off < leaf.size && var_dentry_valid(leaf, off); off += VAR_DENTRY_AT(leaf, off)->rec_len)
+        {
+            a1fs_var_dentry *cur_entry = VAR_DENTRY_AT(leaf, off);
+            // Only compare the names if the lengths match
+            if(cur_entry->name_len == name_len && 0 == memcmp(cur_entry->name, name, name_len)) return cur_entry->ino;
+        }
+        return -1;
+    }
+
+    uint8_t *tags = NULL == leaf.tags ? NULL : dtags_get(leaf.tags, leaf.blk);
+    if(NULL != tags)
+    {
+        // Only compare the names of the dentries with a matching tag
+        for(uint32_t match = dtags_match(tags, tag); 0 != match; match &= match - 1)
+        {
+            a1fs_dentry *cur_entry = (a1fs_dentry *) (leaf.data + __builtin_ctz(match) * sizeof(a1fs_dentry));
+            if(0 == strcmp(cur_entry->name, name)) return cur_entry->ino;
+        }
+        return -1;
+    }
+
+    // The tags of the block are not cached, so compare every name, and fill in the tags along the way
+    if(NULL != leaf.tags) tags = dtags_fill(leaf.tags, leaf.blk);
+    int ino = -1;
+    // Iterate over the NUM_DENTRY_PER_BLOCK dir_entries in a block
+    for(uint32_t d_ind = 0; d_ind < NUM_DENTRY_PER_BLOCK; d_ind++)
+    {
+        a1fs_dentry *cur_entry = (a1fs_dentry *) (leaf.data + d_ind * sizeof(a1fs_dentry));
+        if(NULL != tags) tags[d_ind] = '\0' == *cur_entry->name ? DTAG_EMPTY : dtag_of(cur_entry->name);
+        // Check if the name of the cur entry is equal to the name we're searching for
+        if(ino < 0 && 0 == strcmp(cur_entry->name, name)) ino = cur_entry->ino;
+    }
+    return ino;
+}
+
+/**
+ * Put an entry in the first empty dentry of a leaf, or for var length dentries the first record with
+ * enough unused space for it.
+ *
+ * @return  true on success; false if the leaf is full
+*/
+static bool leaf_insert(dir_leaf leaf, const char *name, a1fs_ino_t ino)
+{
+    if(leaf.var_len)
+    {
+        size_t name_len = strlen(name);
+        uint32_t needed = A1FS_VAR_DENTRY_LEN(name_len);
+        for(uint32_t off = 0; off < leaf.size && var_dentry_valid(leaf, off); off += VAR_DENTRY_AT(leaf, off)->rec_len)
+        {
+            a1fs_var_dentry *cur_entry = VAR_DENTRY_AT(leaf, off);
+            uint32_t used = 0 == cur_entry->name_len ? 0 : A1FS_VAR_DENTRY_LEN(cur_entry->name_len);
+            if(cur_entry->rec_len - used < needed) continue;
+
+            // Split the unused space off the end of a used record
+            if(0 != used)
+            {
+                a1fs_var_dentry *new_entry = VAR_DENTRY_AT(leaf, off + used);
+                new_entry->rec_len = cur_entry->rec_len - used;
+                cur_entry->rec_len = used;
+                cur_entry = new_entry;
+            }
+            cur_entry->ino = ino;
+            cur_entry->name_len = name_len;
+            memcpy(cur_entry->name, name, name_len + 1);
+            return true;
+        }
+        return false;
+    }
+
+    for(uint32_t d_ind = 0; d_ind < NUM_DENTRY_PER_BLOCK; d_ind++)
+    {
+        a1fs_dentry *cur_entry = (a1fs_dentry *) (leaf.data + d_ind * sizeof(a1fs_dentry));
+        // Check for an empty a1fs_dentry
+        if('\0' == *cur_entry->name)
+        {
+            strncpy(cur_entry->name, name, A1FS_NAME_MAX);
+            cur_entry->ino = ino;
+            uint8_t *tags = NULL == leaf.tags ? NULL : dtags_get(leaf.tags, leaf.blk);
+            if(NULL != tags) tags[d_ind] = dtag_of(name);
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Check if a leaf has no room for any new entry (i.e. not even one with a single character name)
+*/
+static bool leaf_is_full(dir_leaf leaf)
+{
+    if(leaf.var_len)
+    {
+        for(uint32_t off = 0; off < leaf.size && var_dentry_valid(leaf, off); off += VAR_DENTRY_AT(leaf, off)->rec_len)
+        {
+            a1fs_var_dentry *cur_entry = VAR_DENTRY_AT(leaf, off);
+            uint32_t used = 0 == cur_entry->name_len ? 0 : A1FS_VAR_DENTRY_LEN(cur_entry->name_len);
+            if(cur_entry->rec_len - used >= A1FS_VAR_DENTRY_LEN(1)) return false;
+        }
+        return true;
+    }
+
+    for(uint32_t d_ind = 0; d_ind < NUM_DENTRY_PER_BLOCK; d_ind++)
+    {
+        if('\0' == *((a1fs_dentry *) (leaf.data + d_ind * sizeof(a1fs_dentry)))->name) return false;
+    }
+    return true;
+}
+
+/**
+ * Remove an entry from a leaf. A removed var length record is merged into the record before it.
+ *
+ * @return  true on success; false if the name is not in the leaf
+*/
+static bool leaf_delete(dir_leaf leaf, const char *name)
+{
+    if(leaf.var_len)
+    {
+        size_t name_len = strlen(name);
+        a1fs_var_dentry *prev = NULL;
+        for(uint32_t off = 0; off < leaf.size && var_dentry_valid(leaf, off); off += VAR_DENTRY_AT(leaf, off)->rec_len)
+        {
+            a1fs_var_dentry *cur_entry = VAR_DENTRY_AT(leaf, off);
+            if(cur_entry->name_len == name_len && 0 == memcmp(cur_entry->name, name, name_len))
+            {
+                if(NULL != prev)
+                {
+                    prev->rec_len += cur_entry->rec_len;
+                }else
+                { // The first record of the leaf can't be merged, so mark it unused
+                    cur_entry->name_len = 0;
+                    cur_entry->ino = 0;
+                }
+                return true;
+            }
+            prev = cur_entry;
+        }
+        return false;
+    }
+
+    for(uint32_t d_ind = 0; d_ind < NUM_DENTRY_PER_BLOCK; d_ind++)
+    {
+        a1fs_dentry *cur_entry = (a1fs_dentry *) (leaf.data + d_ind * sizeof(a1fs_dentry));
+        if(0 == strcmp(cur_entry->name, name))
+        {
+            *cur_entry->name = '\0';
+            uint8_t *tags = NULL == leaf.tags ? NULL : dtags_get(leaf.tags, leaf.blk);
+            if(NULL != tags) tags[d_ind] = DTAG_EMPTY;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Call cb for each entry in a leaf, starting from a position. The position of an entry is the
+ * position of the leaf plus the byte offset of the entry within it, which never changes while the
+ * entry exists since entries are never moved within a leaf.
+ *
+ * @param  leaf   the leaf
+ * @param  base   the position of the leaf
+ * @param  start  the position of the first entry to visit (entries before it are skipped)
+ * @param  cb     the function to call, along with the position following the entry
+ * @param  arg    an argument passed to cb
+ * @return        0 if all the entries were visited; otherwise the value returned by cb
+*/
+static int leaf_iterate(dir_leaf leaf, uint64_t base, uint64_t start, dir_iter_cb cb, void *arg)
+{
+    int ret;
+    if(leaf.var_len)
+    {
+        for(uint32_t off = 0; off < leaf.size && var_dentry_valid(leaf, off); off += VAR_DENTRY_AT(leaf, off)->rec_len)
+        {
+            a1fs_var_dentry *cur_entry = VAR_DENTRY_AT(leaf, off);
+            if(0 == cur_entry->name_len || base + off < start) continue;
+            if(0 != (ret = cb(cur_entry->name, cur_entry->ino, base + off + 1, arg))) return ret;
+        }
+        return 0;
+    }
+
+    for(uint32_t d_ind = 0; d_ind < NUM_DENTRY_PER_BLOCK; d_ind++)
+    {
+        a1fs_dentry *cur_entry = (a1fs_dentry *) (leaf.data + d_ind * sizeof(a1fs_dentry));
+        uint64_t pos = base + d_ind * sizeof(a1fs_dentry);
+        // If the dir name is not the empty string, then that dir entry is allocated
+        if('\0' != *cur_entry->name && pos >= start)
+        {
+            if(0 != (ret = cb(cur_entry->name, cur_entry->ino, pos + 1, arg))) return ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Add a new (zeroed) block to the end of a directory
+ *
+ * @param  dir  a pointer to the inode of the directory
+ * @param  fs   a pointer to the context
+ * @return      a pointer to the new block; NULL if there is no space for it
+*/
+static void *dir_append_block(a1fs_inode *dir, fs_ctx *fs)
+{
+    if (0 != allocate_data_blocks(dir, A1FS_BLOCK_SIZE, fs)) return NULL;
+    dir->size += A1FS_BLOCK_SIZE;
+
+    void *blk = get_data_block(dir, dir->size / A1FS_BLOCK_SIZE - 1, fs);
+    memset(blk, 0, A1FS_BLOCK_SIZE);
+    return blk;
+}
+
+/*
+ * Hash-indexed directories
+ */
+
+/**
+ * A step of the path from the root of the hash tree down to a leaf
+*/
+typedef struct dx_frame {
+    a1fs_dx_node *node;  // The index block
+    uint32_t      index; // The index of the entry followed within the node
+} dx_frame;
+
+/**
+ * Find the last entry of an index node with a hash lower or equal to the hash
+*/
+static uint32_t dx_search(a1fs_dx_node *node, uint32_t hash)
+{
+    // Binary search, note that entries[0] covers every hash lower than entries[1].hash
+    uint32_t lo = 0, hi = node->count;
+    while(hi - lo > 1)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if(node->entries[mid].hash <= hash) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Walk from the root of the hash tree to the leaf block which covers the hash
+ *
+ * @param  dir     a pointer to the inode of the directory
+ * @param  hash    the hash of a name
+ * @param  frames  an array of A1FS_DX_MAX_DEPTH frames which receives the path
+ * @param  fs      a pointer to the context
+ * @return         the number of frames (index blocks) in the path
+*/
+static int dx_descend(a1fs_inode *dir, uint32_t hash, dx_frame *frames, fs_ctx *fs)
+{
+    a1fs_dx_node *node = get_data_block(dir, 0, fs);
+    int depth = 0;
+    while(true)
+    {
+        assert(A1FS_DX_MAGIC == node->magic);
+        frames[depth].node  = node;
+        frames[depth].index = dx_search(node, hash);
+        depth++;
+        if(0 == node->level) return depth;
+        node = get_data_block(dir, node->entries[frames[depth-1].index].blk, fs);
+    }
+}
+
+/**
+ * Get a pointer to the leaf block at the end of a path
+*/
+static dir_leaf dx_leaf(a1fs_inode *dir, dx_frame *frames, int depth, fs_ctx *fs)
+{
+    dx_frame *frame = &frames[depth-1];
+    return dir_leaf_blk(get_data_block(dir, frame->node->entries[frame->index].blk, fs), fs);
+}
+
+/**
+ * Insert an entry into an index node (which is not full) right after the entry at index
+*/
+static void dx_insert_entry(a1fs_dx_node *node, uint32_t index, uint32_t hash, uint32_t blk)
+{
+    assert(node->count < A1FS_DX_LIMIT);
+    memmove(&node->entries[index+2], &node->entries[index+1], (node->count - index - 1) * sizeof(a1fs_dx_entry));
+    node->entries[index+1].hash = hash;
+    node->entries[index+1].blk  = blk;
+    node->count++;
+}
+
+/**
+ * Make sure the index node at the bottom of the path has room for one more entry, by splitting the
+ * full index nodes along the path (and growing the tree if the root is full).
+ * The frames are updated to the path which the original hash now follows.
+ *
+ * @return  0 on success; -errno on error
+*/
+static int dx_make_room(a1fs_inode *dir, dx_frame *frames, int *depth, fs_ctx *fs)
+{
+    // Find the lowest node on the path which is not full
+    int i = *depth - 1;
+    while(i >= 0 && A1FS_DX_LIMIT == frames[i].node->count) i--;
+
+    if(i < 0)
+    { // The root is full, so move its entries to a new block and make the root point to it
+        if(A1FS_DX_MAX_DEPTH == *depth) return -ENOSPC;
+
+        a1fs_dx_node *root = frames[0].node;
+        a1fs_dx_node *node = dir_append_block(dir, fs);
+        if(NULL == node) return -ENOSPC;
+        memcpy(node, root, A1FS_BLOCK_SIZE);
+
+        root->level++;
+        root->count = 1;
+        root->entries[0].hash = 0;
+        root->entries[0].blk  = dir->size / A1FS_BLOCK_SIZE - 1;
+
+        memmove(&frames[1], &frames[0], *depth * sizeof(dx_frame));
+        frames[1].node  = node;
+        frames[0].index = 0;
+        (*depth)++;
+        i = 0;
+        if(VERBOSE) printf("\t dx: root grew to level %d\n", root->level);
+    }
+
+    // Split the full nodes below it, top down, so there is always room for the separator in the parent
+    for(int j = i+1; j < *depth; j++)
+    {
+        a1fs_dx_node *node = frames[j].node;
+        a1fs_dx_node *new_node = dir_append_block(dir, fs);
+        if(NULL == new_node) return -ENOSPC;
+        uint32_t new_blk = dir->size / A1FS_BLOCK_SIZE - 1;
+
+        // Move the upper half of the entries to the new node
+        uint32_t half = node->count / 2;
+        new_node->magic = A1FS_DX_MAGIC;
+        new_node->level = node->level;
+        new_node->count = node->count - half;
+        memcpy(new_node->entries, &node->entries[half], new_node->count * sizeof(a1fs_dx_entry));
+        node->count = half;
+        dx_insert_entry(frames[j-1].node, frames[j-1].index, new_node->entries[0].hash, new_blk);
+
+        // Follow the new node if the path went through the upper half
+        if(frames[j].index >= half)
+        {
+            frames[j].node = new_node;
+            frames[j].index -= half;
+            frames[j-1].index++;
+        }
+    }
+    return 0;
+}
+
+/** An entry along with the hash of its name, used to split leaf blocks. */
+typedef struct dx_hashed_entry {
+    uint32_t    hash;
+    a1fs_ino_t  ino;
+    const char *name;
+} dx_hashed_entry;
+
+static int dx_collect_cb(const char *name, a1fs_ino_t ino, uint64_t next_pos, void *arg)
+{
+    (void)next_pos;
+    dx_hashed_entry **next = arg;
+    (*next)->hash = str_hash(name);
+    (*next)->ino  = ino;
+    (*next)->name = name;
+    (*next)++;
+    return 0;
+}
+
+static int dx_hash_cmp(const void *a, const void *b)
+{
+    uint32_t ha = ((const dx_hashed_entry *)a)->hash;
+    uint32_t hb = ((const dx_hashed_entry *)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+/**
+ * Split a full leaf block in two by hash, and add the new entry to the matching half
+ *
+ * @return  0 on success; -errno on error
+*/
+static int dx_split_leaf(a1fs_inode *dir, dx_frame *frames, int depth, const char *name, a1fs_ino_t ino, fs_ctx *fs)
+{
+    dir_leaf leaf = dx_leaf(dir, frames, depth, fs);
+
+    // Collect the entries of (a copy of) the leaf and the new entry, ordered by hash
+    char copy[A1FS_BLOCK_SIZE];
+    memcpy(copy, leaf.data, leaf.size);
+    dir_leaf copy_leaf = { copy, leaf.size, leaf.var_len, NULL, 0 };
+
+    dx_hashed_entry entries[DIR_MAX_LEAF_ENTRIES + 1];
+    dx_hashed_entry *next = entries;
+    leaf_iterate(copy_leaf, 0, 0, dx_collect_cb, &next);
+    dx_collect_cb(name, ino, 0, &next);
+    int count = next - entries;
+    qsort(entries, count, sizeof(dx_hashed_entry), dx_hash_cmp);
+
+    // Split in the middle, but never between two equal hashes, since a hash must map to a single leaf
+    int split = count / 2;
+    while(split < count && entries[split-1].hash == entries[split].hash) split++;
+    if(split == count)
+    {
+        split = count / 2;
+        while(split > 0 && entries[split-1].hash == entries[split].hash) split--;
+        if(0 == split) return -ENOSPC; // All the names have the same hash
+    }
+
+    void *new_blk = dir_append_block(dir, fs);
+    if(NULL == new_blk) return -ENOSPC;
+    uint32_t new_blk_idx = dir->size / A1FS_BLOCK_SIZE - 1;
+    dir_leaf new_leaf = dir_leaf_blk(new_blk, fs);
+
+    leaf_init(leaf);
+    leaf_init(new_leaf);
+    for(int i = 0; i < count; i++)
+    {
+        leaf_insert(i < split ? leaf : new_leaf, entries[i].name, entries[i].ino);
+    }
+    dx_frame *frame = &frames[depth-1];
+    dx_insert_entry(frame->node, frame->index, entries[split].hash, new_blk_idx);
+    if(VERBOSE) printf("\t dx: split leaf into block %u at hash %08x\n", new_blk_idx, entries[split].hash);
+    return 0;
+}
+
+static int dx_insert(a1fs_inode *dir, const char *name, a1fs_ino_t ino, fs_ctx *fs)
+{
+    dx_frame frames[A1FS_DX_MAX_DEPTH];
+    int depth = dx_descend(dir, str_hash(name), frames, fs);
+    if(leaf_insert(dx_leaf(dir, frames, depth, fs), name, ino)) return 0;
+
+    // The leaf is full, so it needs to be split, which needs room for one more entry in its parent
+    int ret;
+    if(0 != (ret = dx_make_room(dir, frames, &depth, fs))) return ret;
+    return dx_split_leaf(dir, frames, depth, name, ino, fs);
+}
+
+/**
+ * Convert a linear directory with a single (full) block into a hash-indexed directory.
+ * The entries are moved to a new leaf block, and the first block becomes the root of the index.
+ *
+ * @return  0 on success; -errno on error
+*/
+static int dx_convert(a1fs_inode *dir, fs_ctx *fs)
+{
+    void *leaf = dir_append_block(dir, fs);
+    if(NULL == leaf) return -ENOSPC;
+
+    a1fs_dx_node *root = get_data_block(dir, 0, fs);
+    memcpy(leaf, root, A1FS_BLOCK_SIZE);
+    dtags_drop(&fs->dtags, ((void *)root - fs->data_blks) / A1FS_BLOCK_SIZE);
+
+    memset(root, 0, A1FS_BLOCK_SIZE);
+    root->magic = A1FS_DX_MAGIC;
+    root->level = 0;
+    root->count = 1;
+    root->entries[0].hash = 0;
+    root->entries[0].blk  = 1;
+
+    dir->flags |= A1FS_INODE_INDEXED;
+    if(VERBOSE) printf("\t dx: converted directory to a hash-indexed directory\n");
+    return 0;
+}
+
+/**
+ * Call cb for each entry of a leaf with a hash higher or equal to the start hash, in hash order.
+ * Entries move between leaves when they are split, so the position of an entry is DIR_POS_HASHED
+ * plus its hash. Since names may have the same hash, the position following an entry which shares
+ * its hash with the next one is its own hash (so the rest of them are visited when resuming).
+*/
+static int dx_iterate_leaf(dir_leaf leaf, uint64_t start_hash, dir_iter_cb cb, void *arg)
+{
+    dx_hashed_entry entries[DIR_MAX_LEAF_ENTRIES];
+    dx_hashed_entry *next = entries;
+    leaf_iterate(leaf, 0, 0, dx_collect_cb, &next);
+    int count = next - entries;
+    qsort(entries, count, sizeof(dx_hashed_entry), dx_hash_cmp);
+
+    for(int i = 0; i < count; i++)
+    {
+        if(entries[i].hash < start_hash) continue;
+        uint64_t next_hash = entries[i].hash + (i+1 < count && entries[i+1].hash == entries[i].hash ? 0ul : 1ul);
+        int ret = cb(entries[i].name, entries[i].ino, DIR_POS_HASHED + next_hash, arg);
+        if(0 != ret) return ret;
+    }
+    return 0;
+}
+
+/**
+ * Call cb for each entry in the leaves below an index node with a hash higher or equal to the
+ * start hash, in hash order
+*/
+static int dx_iterate(a1fs_inode *dir, a1fs_dx_node *node, uint64_t start_hash, dir_iter_cb cb, void *arg, fs_ctx *fs)
+{
+    if(start_hash > UINT32_MAX) return 0;
+    for(uint32_t i = dx_search(node, start_hash); i < node->count; i++)
+    {
+        void *blk = get_data_block(dir, node->entries[i].blk, fs);
+        int ret = (0 == node->level) ? dx_iterate_leaf(dir_leaf_blk(blk, fs), start_hash, cb, arg)
+                                     : dx_iterate(dir, blk, start_hash, cb, arg, fs);
+        if(0 != ret) return ret;
+    }
+    return 0;
+}
+
+/*
+ * Inline directories
+ */
+
+static int dir_uninline_cb(const char *name, a1fs_ino_t ino, uint64_t next_pos, void *arg)
+{
+    (void)next_pos;
+    leaf_insert(*(dir_leaf *)arg, name, ino);
+    return 0;
+}
+
+/**
+ * Move the entries of an inline directory to its first data block
+ *
+ * @return  0 on success; -errno on error
+*/
+static int dir_uninline(a1fs_inode *dir, fs_ctx *fs)
+{
+    char copy[A1FS_INLINE_DATA_MAX];
+    memcpy(copy, dir->inline_data, A1FS_INLINE_DATA_MAX);
+
+    // The inline data area holds the root of the extent tree from now on
+    dir->flags &= ~A1FS_INODE_INLINE;
+    etree_init(dir);
+    dir->size = 0;
+
+    void *blk = dir_append_block(dir, fs);
+    if(NULL == blk)
+    {
+        memcpy(dir->inline_data, copy, A1FS_INLINE_DATA_MAX);
+        dir->flags |= A1FS_INODE_INLINE;
+        dir->size = A1FS_INLINE_DATA_MAX;
+        return -ENOSPC;
+    }
+
+    // A single block always has room for the inline entries
+    dir_leaf leaf = dir_leaf_blk(blk, fs);
+    if(leaf.var_len)
+    { // Keep the records at the same offsets so the positions of the entries don't change, and
+      // extend the last record to the end of the block
+        memcpy(blk, copy, A1FS_INLINE_DATA_MAX);
+        uint32_t off = 0;
+        while(off + VAR_DENTRY_AT(leaf, off)->rec_len < A1FS_INLINE_DATA_MAX) off += VAR_DENTRY_AT(leaf, off)->rec_len;
+        VAR_DENTRY_AT(leaf, off)->rec_len += A1FS_BLOCK_SIZE - A1FS_INLINE_DATA_MAX;
+    }else
+    {
+        dir_leaf copy_leaf = { copy, A1FS_INLINE_DATA_MAX, true, NULL, 0 };
+        leaf_init(leaf);
+        leaf_iterate(copy_leaf, 0, 0, dir_uninline_cb, &leaf);
+    }
+    dir->dir_free_hint = 0;
+    if(VERBOSE) printf("\t dir: moved inline directory to a data block\n");
+    return 0;
+}
+
+void dir_make_inline(a1fs_inode *dir)
+{
+    dir->flags |= A1FS_INODE_INLINE;
+    dir->num_extents = 0;
+    dir->size = A1FS_INLINE_DATA_MAX;
+    leaf_init(dir_leaf_inline(dir));
+}
+
+/*
+ * Directory operations
+ */
+
+int dir_lookup(a1fs_inode *dir, const char *name, fs_ctx *fs)
+{
+    if(dir->flags & A1FS_INODE_INLINE) return leaf_find(dir_leaf_inline(dir), name, 0);
+    if(dir->flags & A1FS_INODE_INDEXED)
+    {
+        dx_frame frames[A1FS_DX_MAX_DEPTH];
+        int depth = dx_descend(dir, str_hash(name), frames, fs);
+        return leaf_find(dx_leaf(dir, frames, depth, fs), name, dtag_of(name));
+    }
+
+    a1fs_block_iterator b_iter;
+    block_iterator_init(dir, &b_iter, fs);
+
+    void *cur_blk;
+    int ino;
+    uint8_t tag = dtag_of(name);
+    // Iterate over the inodes data blocks
+    while(NULL != (cur_blk = block_iterator_next_blk(&b_iter, fs))){
+        if(0 <= (ino = leaf_find(dir_leaf_blk(cur_blk, fs), name, tag))) return ino;
+    }
+    return -1;
+}
+
+/**
+ * Add an entry to a linear directory, starting from the first block which may have room for it
+*/
+static int dir_insert_linear(a1fs_inode *dir, const char *name, a1fs_ino_t ino, fs_ctx *fs)
+{
+    uint32_t num_blks = dir->size / A1FS_BLOCK_SIZE;
+    for(uint32_t blk_idx = dir->dir_free_hint; blk_idx < num_blks; blk_idx++)
+    {
+        dir_leaf leaf = dir_leaf_blk(get_data_block(dir, blk_idx, fs), fs);
+        if(leaf_insert(leaf, name, ino)) return 0;
+
+        // Only move the hint past blocks which can't hold any entry, a var length block may still
+        // have room for a shorter name
+        if(dir->dir_free_hint == blk_idx && (!leaf.var_len || leaf_is_full(leaf))) dir->dir_free_hint++;
+    }
+
+    // There was no room in any of the allocated blocks for the entry.
+    // A directory which outgrows its first block becomes hash-indexed, if the feature is enabled
+    if((fs->superblock->features & A1FS_FEATURE_HTREE) && A1FS_BLOCK_SIZE == dir->size)
+    {
+        int ret;
+        if(0 != (ret = dx_convert(dir, fs))) return ret;
+        return dx_insert(dir, name, ino, fs);
+    }
+
+    // Otherwise a new block is needed
+    void *new_blk = dir_append_block(dir, fs);
+    if(NULL == new_blk) return -ENOSPC;
+    dir_leaf new_leaf = dir_leaf_blk(new_blk, fs);
+    leaf_init(new_leaf);
+    leaf_insert(new_leaf, name, ino);
+    return 0;
+}
+
+int dir_insert(a1fs_inode *dir, const char *name, a1fs_ino_t ino, fs_ctx *fs)
+{
+    int ret;
+    if(dir->flags & A1FS_INODE_INLINE)
+    {
+        if(leaf_insert(dir_leaf_inline(dir), name, ino))
+        {
+            dir->dir_entries++;
+            return 0;
+        }
+        // The directory outgrew its inode
+        if(0 != (ret = dir_uninline(dir, fs))) return ret;
+    }
+
+    ret = (dir->flags & A1FS_INODE_INDEXED) ? dx_insert(dir, name, ino, fs) : dir_insert_linear(dir, name, ino, fs);
+    if(0 == ret) dir->dir_entries++;
+    return ret;
+}
+
+int dir_delete(a1fs_inode *dir, const char *name, fs_ctx *fs)
+{
+    if(dir->flags & A1FS_INODE_INLINE)
+    {
+        if(!leaf_delete(dir_leaf_inline(dir), name)) return -ENOENT;
+        dir->dir_entries--;
+        return 0;
+    }
+    if(dir->flags & A1FS_INODE_INDEXED)
+    {
+        dx_frame frames[A1FS_DX_MAX_DEPTH];
+        int depth = dx_descend(dir, str_hash(name), frames, fs);
+        if(!leaf_delete(dx_leaf(dir, frames, depth, fs), name)) return -ENOENT;
+        dir->dir_entries--;
+        return 0;
+    }
+
+    a1fs_block_iterator b_iter;
+    block_iterator_init(dir, &b_iter, fs);
+
+    void *cur_blk;
+    // Iterate over the inodes data blocks
+    for(uint32_t blk_idx = 0; NULL != (cur_blk = block_iterator_next_blk(&b_iter, fs)); blk_idx++){
+        if(leaf_delete(dir_leaf_blk(cur_blk, fs), name))
+        {
+            // The block now has room for an entry
+            if(blk_idx < dir->dir_free_hint) dir->dir_free_hint = blk_idx;
+            dir->dir_entries--;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+int dir_iterate(a1fs_inode *dir, uint64_t pos, dir_iter_cb cb, void *arg, fs_ctx *fs)
+{
+    if(dir->flags & A1FS_INODE_INLINE) return leaf_iterate(dir_leaf_inline(dir), 0, pos, cb, arg);
+    if(dir->flags & A1FS_INODE_INDEXED)
+    {
+        // A linear position is from before the directory was converted, so start over
+        uint64_t start_hash = pos >= DIR_POS_HASHED ? pos - DIR_POS_HASHED : 0;
+        return dx_iterate(dir, get_data_block(dir, 0, fs), start_hash, cb, arg, fs);
+    }
+
+    // The position of a linear directory's entry is the byte offset of the entry in the directory
+    uint32_t num_blks = dir->size / A1FS_BLOCK_SIZE;
+    int ret;
+    for(uint32_t blk_idx = pos / A1FS_BLOCK_SIZE; blk_idx < num_blks; blk_idx++)
+    {
+        dir_leaf leaf = dir_leaf_blk(get_data_block(dir, blk_idx, fs), fs);
+        if(0 != (ret = leaf_iterate(leaf, (uint64_t)blk_idx * A1FS_BLOCK_SIZE, pos, cb, arg))) return ret;
+    }
+    return 0;
+}
+
+bool dir_is_empty(a1fs_inode *dir, fs_ctx *fs)
+{
+    (void)fs;
+    return 0 == dir->dir_entries;
+}
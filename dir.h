@@ -0,0 +1,105 @@
+/**
+ * CSC369 Assignment 1 - Directory operations header file.
+ *  Lookup, insertion, removal and iteration of directory entries. Hides whether a directory is a
+ *  linear array of dentry blocks, a hash-indexed directory (see a1fs_dx_node), or is stored inline
+ *  in its inode.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+/**
+ * The positions of the entries of a hash-indexed directory are at least DIR_POS_HASHED, lower
+ * positions belong to linear directories.
+ */
+#define DIR_POS_HASHED (1ull << 32)
+
+/**
+ * Callback called for each entry of a directory by dir_iterate()
+ *
+ * @param  name      the name of the entry
+ * @param  ino       the inode number of the entry
+ * @param  next_pos  the position to pass to dir_iterate() to resume the iteration after this entry
+ * @param  arg       the argument passed to dir_iterate()
+ * @return           0 to continue the iteration; any other value stops it
+*/
+typedef int (*dir_iter_cb)(const char *name, a1fs_ino_t ino, uint64_t next_pos, void *arg);
+
+/**
+ * Find an entry in a directory
+ *
+ * @param  dir   a pointer to the inode of the directory
+ * @param  name  the name of the entry
+ * @param  fs    a pointer to the context
+ * @return       the inode number of the entry; -1 if there is no such entry
+*/
+int dir_lookup(a1fs_inode *dir, const char *name, fs_ctx *fs);
+
+/**
+ * Add an entry to a directory, allocating a new block for the directory if needed
+ *
+ * Assume: name is not already in the directory
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param  dir   a pointer to the inode of the directory
+ * @param  name  the name of the new entry
+ * @param  ino   the inode number of the new entry
+ * @param  fs    a pointer to the context
+ * @return       0 on success; -errno on error
+*/
+int dir_insert(a1fs_inode *dir, const char *name, a1fs_ino_t ino, fs_ctx *fs);
+
+/**
+ * Remove an entry from a directory. The directory's blocks are never released.
+ *
+ * @param  dir   a pointer to the inode of the directory
+ * @param  name  the name of the entry
+ * @param  fs    a pointer to the context
+ * @return       0 on success; -ENOENT if there is no such entry
+*/
+int dir_delete(a1fs_inode *dir, const char *name, fs_ctx *fs);
+
+/**
+ * Call cb for each entry in a directory (not including "." and ".."), starting from a position.
+ *
+ * Positions are stable: an iteration resumed from the position following an entry visits every
+ * entry after it which still exists (entries added in the meantime may or may not be visited).
+ * Linear directories are visited in the order of the entries on disk, and hash-indexed directories
+ * in hash order. Entries with the same hash may be visited twice when resuming between them, as
+ * may some entries when the directory changes format between the calls.
+ *
+ * @param  dir   a pointer to the inode of the directory
+ * @param  pos   the position to start from, 0 for the first entry
+ * @param  cb    the function to call for each entry
+ * @param  arg   an argument passed to cb
+ * @param  fs    a pointer to the context
+ * @return       0 if all the entries were visited; otherwise the value returned by cb which stopped the iteration
+*/
+int dir_iterate(a1fs_inode *dir, uint64_t pos, dir_iter_cb cb, void *arg, fs_ctx *fs);
+
+/**
+ * Check if a directory has no entries (other than "." and ".."), which is kept track of by
+ * dir_insert() and dir_delete()
+ *
+ * @param  dir   a pointer to the inode of the directory
+ * @param  fs    a pointer to the context
+ * @return       true if the directory is empty
+*/
+bool dir_is_empty(a1fs_inode *dir, fs_ctx *fs);
+
+/**
+ * Make an empty directory store its entries inline in its inode (see A1FS_INODE_INLINE). The entries
+ * are moved to a data block once they no longer fit.
+ *
+ * Assume: the directory has no data blocks
+ *
+ * @param  dir   a pointer to the inode of the directory
+*/
+void dir_make_inline(a1fs_inode *dir);
@@ -0,0 +1,77 @@
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dtags.h"
+#include "util.h"
+
+static_assert(NUM_DENTRY_PER_BLOCK <= 32, "dtags_match() returns a 32 bit mask");
+
+bool dtags_init(dtags *dt, uint32_t num_blocks)
+{
+    uint32_t num_slots = 1;
+    while(num_slots < num_blocks && num_slots < DTAGS_MAX_SLOTS) num_slots <<= 1;
+
+    dt->slots = calloc(num_slots, sizeof(dtags_slot));
+    if(NULL == dt->slots) return false;
+    dt->num_slots = num_slots;
+    return true;
+}
+
+void dtags_destroy(dtags *dt)
+{
+    free(dt->slots);
+    dt->slots = NULL;
+}
+
+uint8_t *dtags_get(dtags *dt, a1fs_blk_t blk)
+{
+    dtags_slot *slot = &dt->slots[blk & (dt->num_slots-1)];
+    return slot->blk == blk+1 ? slot->tags : NULL;
+}
+
+uint8_t *dtags_fill(dtags *dt, a1fs_blk_t blk)
+{
+    dtags_slot *slot = &dt->slots[blk & (dt->num_slots-1)];
+    slot->blk = blk+1;
+    return slot->tags;
+}
+
+void dtags_drop(dtags *dt, a1fs_blk_t blk)
+{
+    dtags_slot *slot = &dt->slots[blk & (dt->num_slots-1)];
+    if(slot->blk == blk+1) slot->blk = 0;
+}
+
+uint8_t dtag_of(const char *name)
+{
+    // Use the top bits of the hash, DTAG_EMPTY is remapped since it marks empty dentries
+    uint8_t tag = str_hash(name) >> 24;
+    return DTAG_EMPTY == tag ? 1 : tag;
+}
+
+uint32_t dtags_match_scalar(const uint8_t *tags, uint8_t tag)
+{
+    uint32_t mask = 0;
+    for(uint32_t i = 0; i < NUM_DENTRY_PER_BLOCK; i++)
+    {
+        if(tags[i] == tag) mask |= 1u << i;
+    }
+    return mask;
+}
+
+uint32_t dtags_match(const uint8_t *tags, uint8_t tag)
+{
+#ifdef __SSE2__
+    if(16 == NUM_DENTRY_PER_BLOCK)
+    {
+        // Compare the 16 tags in one instruction, and gather the top bit of each byte of the result
+        __m128i v = _mm_loadu_si128((const __m128i *)tags);
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)tag)));
+    }
+#endif
+    return dtags_match_scalar(tags, tag);
+}
@@ -0,0 +1,85 @@
+/**
+ * CSC369 Assignment 1 - Directory block tag cache header file.
+ *  Keeps a one byte tag (derived from the hash of the name) for each of the NUM_DENTRY_PER_BLOCK
+ *  dentries of a directory block, so a lookup compares all the tags of a block at once and only calls
+ *  strcmp() on the dentries whose tag matches. The cache is direct mapped by the block number.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+/** The tag of an empty dentry. */
+#define DTAG_EMPTY 0
+
+/** The maximum number of blocks whose tags are cached. */
+#define DTAGS_MAX_SLOTS (1u << 18)
+
+/**
+ * The tags of a single directory block
+*/
+typedef struct dtags_slot {
+    a1fs_blk_t blk;                         // The block number + 1, 0 if the slot is unused
+    uint8_t    tags[NUM_DENTRY_PER_BLOCK];  // The tag of each dentry of the block
+} dtags_slot;
+
+/**
+ * The tag cache
+*/
+typedef struct dtags {
+    dtags_slot *slots;
+    uint32_t    num_slots; // Always a power of 2
+} dtags;
+
+/**
+ * Initialize an empty cache
+ *
+ * @param  dt          a pointer to the cache
+ * @param  num_blocks  the number of data blocks in the file system, used to size the cache
+ * @return             true on success; false on failure (e.g. a malloc() call failed).
+*/
+bool dtags_init(dtags *dt, uint32_t num_blocks);
+
+/**
+ * Free the cache
+*/
+void dtags_destroy(dtags *dt);
+
+/**
+ * Get the cached tags of a block
+ *
+ * @return  a pointer to the NUM_DENTRY_PER_BLOCK tags of the block; NULL if they are not cached
+*/
+uint8_t *dtags_get(dtags *dt, a1fs_blk_t blk);
+
+/**
+ * Claim the slot of a block (evicting the block in the slot), so its tags can be filled in
+ *
+ * @return  a pointer to the NUM_DENTRY_PER_BLOCK tags of the block
+*/
+uint8_t *dtags_fill(dtags *dt, a1fs_blk_t blk);
+
+/**
+ * Forget the tags of a block, which must be done when a directory block is freed
+*/
+void dtags_drop(dtags *dt, a1fs_blk_t blk);
+
+/**
+ * Compute the tag of a name. Never DTAG_EMPTY.
+*/
+uint8_t dtag_of(const char *name);
+
+/**
+ * Compare all the tags of a block to a tag
+ *
+ * @return  a bitmask with bit i set if tags[i] == tag
+*/
+uint32_t dtags_match(const uint8_t *tags, uint8_t tag);
+
+/**
+ * Reference (one tag at a time) implementation of dtags_match(), which must give identical results
+*/
+uint32_t dtags_match_scalar(const uint8_t *tags, uint8_t tag);
@@ -0,0 +1,104 @@
+#include <stdlib.h>
+
+#include "emap.h"
+
+bool emap_init(emap_cache *ec, uint32_t num_inodes)
+{
+    uint32_t num_slots = 1;
+    while(num_slots < num_inodes && num_slots < EMAP_MAX_SLOTS) num_slots <<= 1;
+
+    ec->slots = calloc(num_slots, sizeof(emap));
+    if(NULL == ec->slots) return false;
+    ec->num_slots = num_slots;
+    return true;
+}
+
+void emap_destroy(emap_cache *ec)
+{
+    if(NULL == ec->slots) return;
+    for(uint32_t i = 0; i < ec->num_slots; i++) free(ec->slots[i].extents);
+    free(ec->slots);
+    ec->slots = NULL;
+}
+
+emap *emap_get(emap_cache *ec, a1fs_ino_t ino)
+{
+    emap *map = &ec->slots[ino & (ec->num_slots-1)];
+    return map->ino == ino+1 ? map : NULL;
+}
+
+/**
+ * Make sure a map has room for capacity extents
+*/
+static bool emap_reserve(emap *map, uint32_t capacity)
+{
+    if(capacity <= map->capacity) return true;
+
+    // Grow geometrically, since files grow one extent at a time
+    uint32_t new_capacity = map->capacity < 8 ? 8 : map->capacity;
+    while(new_capacity < capacity) new_capacity *= 2;
+    emap_extent *extents = realloc(map->extents, new_capacity * sizeof(emap_extent));
+    if(NULL == extents) return false;
+    map->extents = extents;
+    map->capacity = new_capacity;
+    return true;
+}
+
+emap *emap_fill(emap_cache *ec, a1fs_ino_t ino, uint32_t capacity)
+{
+    emap *map = &ec->slots[ino & (ec->num_slots-1)];
+    map->ino = 0;
+    map->num_extents = 0;
+    if(!emap_reserve(map, capacity)) return NULL;
+    map->ino = ino+1;
+    return map;
+}
+
+bool emap_append(emap *map, const a1fs_extent *extent)
+{
+    if(!emap_reserve(map, map->num_extents + 1)) return false;
+
+    emap_extent *last = &map->extents[map->num_extents++];
+    last->lblk  = extent->lblk;
+    last->start = extent->start;
+    last->count = extent->count;
+    last->unwritten = extent->unwritten;
+    return true;
+}
+
+void emap_drop(emap_cache *ec, a1fs_ino_t ino)
+{
+    emap *map = &ec->slots[ino & (ec->num_slots-1)];
+    if(map->ino == ino+1) map->ino = 0;
+}
+
+/**
+ * Binary search for the last extent starting at or before lblk
+ *
+ * @return  the index of the extent; -1 if there is none
+*/
+static int emap_search(const emap *map, uint32_t lblk)
+{
+    int lo = -1, hi = map->num_extents;
+    while(hi - lo > 1)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if(map->extents[mid].lblk <= lblk) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+int emap_find(const emap *map, uint32_t lblk)
+{
+    int i = emap_search(map, lblk);
+    if(i < 0) return -1;
+    const emap_extent *extent = &map->extents[i];
+    return lblk - extent->lblk < extent->count ? i : -1;
+}
+
+int emap_next(const emap *map, uint32_t lblk)
+{
+    int i = emap_search(map, lblk) + 1;
+    return (uint32_t)i < map->num_extents ? i : -1;
+}
@@ -0,0 +1,105 @@
+/**
+ * CSC369 Assignment 1 - Extent map header file.
+ *  An in-memory copy of the extents of recently accessed inodes, along with the logical block (the
+ *  index within the file) at which each extent starts. The extent holding any block of a file is
+ *  then found with a binary search of an array, instead of a walk down the inode's extent tree. The
+ *  cache is direct mapped by the inode number.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+/** The maximum number of inodes whose extents are cached. */
+#define EMAP_MAX_SLOTS (1u << 12)
+
+/**
+ * An extent along with its logical start
+*/
+typedef struct emap_extent {
+    uint32_t   lblk;          // The index within the file of the first block of the extent
+    a1fs_blk_t start;         // The first data block of the extent
+    uint32_t   count : 31;    // The number of blocks in the extent
+    uint32_t   unwritten : 1; // Whether the blocks read as zeros, see a1fs_extent
+} emap_extent;
+
+/**
+ * The extents of a single inode
+*/
+typedef struct emap {
+    a1fs_ino_t   ino;         // The inode number + 1, 0 if the slot is unused
+    uint32_t     num_extents;
+    uint32_t     capacity;    // The number of extents allocated
+    emap_extent *extents;     // Sorted by lblk
+} emap;
+
+/**
+ * The extent map cache
+*/
+typedef struct emap_cache {
+    emap     *slots;
+    uint32_t  num_slots; // Always a power of 2
+} emap_cache;
+
+/**
+ * Initialize an empty cache
+ *
+ * @param  ec          a pointer to the cache
+ * @param  num_inodes  the number of inodes in the file system, used to size the cache
+ * @return             true on success; false on failure (e.g. a malloc() call failed).
+*/
+bool emap_init(emap_cache *ec, uint32_t num_inodes);
+
+/**
+ * Free the cache and all of the maps
+*/
+void emap_destroy(emap_cache *ec);
+
+/**
+ * Get the cached map of an inode
+ *
+ * @return  a pointer to the map; NULL if it is not cached
+*/
+emap *emap_get(emap_cache *ec, a1fs_ino_t ino);
+
+/**
+ * Claim the slot of an inode (evicting the inode in the slot) with an empty map, which must then be
+ * filled in with emap_append()
+ *
+ * @param  capacity  the number of extents to make room for
+ * @return           a pointer to the map; NULL on failure (e.g. a malloc() call failed)
+*/
+emap *emap_fill(emap_cache *ec, a1fs_ino_t ino, uint32_t capacity);
+
+/**
+ * Add an extent after the last extent of a map
+ *
+ * @return  true on success; false on failure (e.g. a malloc() call failed)
+*/
+bool emap_append(emap *map, const a1fs_extent *extent);
+
+/**
+ * Forget the map of an inode, which must be done whenever extents are removed or shrunk
+*/
+void emap_drop(emap_cache *ec, a1fs_ino_t ino);
+
+/**
+ * Find the extent holding a block of the file
+ *
+ * @param  map   a pointer to the map
+ * @param  lblk  the index of the block within the file
+ * @return       the index of the extent; -1 if no extent holds the block (it is in a hole)
+*/
+int emap_find(const emap *map, uint32_t lblk);
+
+/**
+ * Find the first extent after a block of the file, e.g. the end of the hole holding the block
+ *
+ * @param  map   a pointer to the map
+ * @param  lblk  the index of the block within the file
+ * @return       the index of the extent; -1 if no extent starts after lblk
+*/
+int emap_next(const emap *map, uint32_t lblk);
@@ -0,0 +1,426 @@
+#include <string.h>
+
+#include "etree.h"
+#include "fs_utils.h"
+#include "util.h"
+
+/**
+ * Get the root node of an inode's extent tree
+*/
+static a1fs_etree_header *root_node(a1fs_inode *inode)
+{
+    return &inode->etree_root;
+}
+
+/**
+ * Get the node held by a data block
+*/
+static a1fs_etree_header *block_node(a1fs_blk_t blk, fs_ctx *fs)
+{
+    return fs->data_blks + (size_t)blk * A1FS_BLOCK_SIZE;
+}
+
+static size_t entry_size(const a1fs_etree_header *node)
+{
+    return 0 == node->depth ? sizeof(a1fs_extent) : sizeof(a1fs_extent_idx);
+}
+
+static void *node_entry(a1fs_etree_header *node, uint32_t i)
+{
+    return (char *)(node + 1) + i * entry_size(node);
+}
+
+static a1fs_extent *node_extent(a1fs_etree_header *node, uint32_t i)
+{
+    return node_entry(node, i);
+}
+
+static a1fs_extent_idx *node_index(a1fs_etree_header *node, uint32_t i)
+{
+    return node_entry(node, i);
+}
+
+/**
+ * Get the logical block an entry starts at. It is the first field of both kinds of entries.
+*/
+static uint32_t entry_lblk(a1fs_etree_header *node, uint32_t i)
+{
+    return *(uint32_t *)node_entry(node, i);
+}
+
+static void node_init(a1fs_etree_header *node, uint16_t depth, uint16_t max)
+{
+    node->magic = A1FS_ETREE_MAGIC;
+    node->count = 0;
+    node->max = max;
+    node->depth = depth;
+}
+
+/**
+ * The number of entries a node has room for
+*/
+static uint16_t node_max(bool root, uint16_t depth)
+{
+    if(root) return 0 == depth ? ETREE_ROOT_EXTENTS : ETREE_ROOT_INDEX;
+    return 0 == depth ? ETREE_BLOCK_EXTENTS : ETREE_BLOCK_INDEX;
+}
+
+/**
+ * Binary search for the last entry of a node starting at or before lblk
+ *
+ * @return  the index of the entry; -1 if all the entries start after lblk (or the node is empty)
+*/
+static int node_search(a1fs_etree_header *node, uint32_t lblk)
+{
+    int lo = -1, hi = node->count;
+    while(hi - lo > 1)
+    {
+        int mid = lo + (hi - lo) / 2;
+        if(entry_lblk(node, mid) <= lblk) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * Insert an entry into a node which has room for it
+*/
+static void node_insert(a1fs_etree_header *node, uint32_t pos, const void *entry)
+{
+    size_t size = entry_size(node);
+    memmove(node_entry(node, pos + 1), node_entry(node, pos), (node->count - pos) * size);
+    memcpy(node_entry(node, pos), entry, size);
+    node->count++;
+}
+
+/**
+ * Fill in the path from the root down to the leaf which holds (or would hold) lblk. The position in
+ *  the leaf is the last extent starting at or before lblk, -1 (as a uint32_t) if there is none.
+*/
+static void find_path(etree_cursor *cursor, a1fs_inode *inode, uint32_t lblk, fs_ctx *fs)
+{
+    a1fs_etree_header *node = root_node(inode);
+    cursor->depth = node->depth;
+    for(uint32_t level = 0; ; level++)
+    {
+        int pos = node_search(node, lblk);
+        cursor->nodes[level] = node;
+        if(0 == node->depth)
+        {
+            cursor->pos[level] = pos;
+            return;
+        }
+        // The first child also holds the blocks before its key
+        cursor->pos[level] = pos < 0 ? 0 : pos;
+        node = block_node(node_index(node, cursor->pos[level])->child, fs);
+    }
+}
+
+/**
+ * Move a cursor whose leaf position is past the end of the leaf to the first extent of the next leaf
+ *
+ * @return  a pointer to the extent the cursor is at; NULL if there are no more extents
+*/
+static a1fs_extent *cursor_settle(etree_cursor *cursor, fs_ctx *fs)
+{
+    uint32_t level = cursor->depth;
+    if(cursor->pos[level] < cursor->nodes[level]->count) return node_extent(cursor->nodes[level], cursor->pos[level]);
+
+    // Go up to the first node with a child after the one on the path, then down its leftmost path
+    while(level > 0 && cursor->pos[level-1] + 1 >= cursor->nodes[level-1]->count) level--;
+    if(0 == level) return NULL;
+    cursor->pos[--level]++;
+    for(; level < cursor->depth; level++)
+    {
+        cursor->nodes[level+1] = block_node(node_index(cursor->nodes[level], cursor->pos[level])->child, fs);
+        cursor->pos[level+1] = 0;
+    }
+    return 0 == cursor->nodes[level]->count ? NULL : node_extent(cursor->nodes[level], 0);
+}
+
+void etree_init(a1fs_inode *inode)
+{
+    memset(inode->inline_data, 0, A1FS_ETREE_ROOT_SIZE);
+    node_init(root_node(inode), 0, ETREE_ROOT_EXTENTS);
+    inode->num_extents = 0;
+    inode->num_blocks = 0;
+}
+
+a1fs_extent *etree_lookup(a1fs_inode *inode, uint32_t lblk, fs_ctx *fs)
+{
+    etree_cursor cursor;
+    find_path(&cursor, inode, lblk, fs);
+    uint32_t pos = cursor.pos[cursor.depth];
+    if((int)pos < 0) return NULL;
+    a1fs_extent *extent = node_extent(cursor.nodes[cursor.depth], pos);
+    return lblk - extent->lblk < extent->count ? extent : NULL;
+}
+
+a1fs_extent *etree_last(a1fs_inode *inode, fs_ctx *fs)
+{
+    a1fs_etree_header *node = root_node(inode);
+    if(0 == node->count) return NULL;
+    while(0 != node->depth) node = block_node(node_index(node, node->count-1)->child, fs);
+    return node_extent(node, node->count-1);
+}
+
+a1fs_extent *etree_seek(etree_cursor *cursor, a1fs_inode *inode, uint32_t lblk, fs_ctx *fs)
+{
+    find_path(cursor, inode, lblk, fs);
+    uint32_t *pos = &cursor->pos[cursor->depth];
+    // Skip the extent starting before lblk unless it holds it
+    if((int)*pos < 0)
+    {
+        *pos = 0;
+    }else
+    {
+        a1fs_extent *extent = node_extent(cursor->nodes[cursor->depth], *pos);
+        if(lblk - extent->lblk >= extent->count) (*pos)++;
+    }
+    return cursor_settle(cursor, fs);
+}
+
+a1fs_extent *etree_next(etree_cursor *cursor, fs_ctx *fs)
+{
+    cursor->pos[cursor->depth]++;
+    return cursor_settle(cursor, fs);
+}
+
+uint32_t etree_insert_blocks(a1fs_inode *inode, uint32_t lblk, fs_ctx *fs)
+{
+    etree_cursor cursor;
+    find_path(&cursor, inode, lblk, fs);
+    // A full node splits, and so does its parent if it is full too. The root moves to a new block
+    // (adding a level) instead of splitting
+    uint32_t blocks = 0;
+    for(int level = cursor.depth; level >= 0 && cursor.nodes[level]->count == cursor.nodes[level]->max; level--) blocks++;
+    return blocks;
+}
+
+uint32_t etree_append_blocks(a1fs_inode *inode, uint32_t num_extents, fs_ctx *fs)
+{
+    etree_cursor cursor;
+    find_path(&cursor, inode, UINT32_MAX, fs);
+    // Appends fill the last node of each level, and then new nodes one after the other. A root which
+    // overflows moves to a block (which then fills up too), and a new root points to the blocks
+    uint32_t blocks = 0, added = num_extents;
+    for(int level = cursor.depth; ; level--)
+    {
+        uint16_t depth = cursor.depth - level;
+        uint32_t count = level >= 0 ? cursor.nodes[level]->count : 0, max = node_max(level <= 0, depth);
+        if(count + added <= max) return blocks;
+        // A block keeps the entries it has room for, the root moves all of its entries to blocks
+        uint32_t moved = level > 0 ? count + added - max : count + added;
+        added = Ceil(moved, node_max(false, depth));
+        blocks += added;
+    }
+}
+
+uint32_t etree_insert(a1fs_inode *inode, const a1fs_extent *extent, const a1fs_blk_t *new_blks, fs_ctx *fs)
+{
+    etree_cursor cursor;
+    find_path(&cursor, inode, extent->lblk, fs);
+    inode->num_extents++;
+
+    uint32_t used = 0;
+    int level = cursor.depth;
+    uint32_t pos = cursor.pos[level] + 1; // After the last extent starting before it
+    a1fs_extent_idx idx;
+    const void *entry = extent;
+    while(true)
+    {
+        a1fs_etree_header *node = cursor.nodes[level];
+        if(node->count < node->max)
+        {
+            node_insert(node, pos, entry);
+            return used;
+        }
+
+        a1fs_blk_t blk = new_blks[used++];
+        a1fs_etree_header *new_node = block_node(blk, fs);
+        node_init(new_node, node->depth, node_max(false, node->depth));
+        if(0 == level)
+        { // Move the entries of the root to the new block, and make it the root's only child
+            memcpy(node_entry(new_node, 0), node_entry(node, 0), node->count * entry_size(node));
+            new_node->count = node->count;
+            node_init(node, node->depth + 1, node_max(true, node->depth + 1));
+            a1fs_extent_idx root_idx = { entry_lblk(new_node, 0), blk };
+            node_insert(node, 0, &root_idx);
+            // The new block has plenty of room
+            node_insert(new_node, pos, entry);
+            return used;
+        }
+
+        // Split the node, moving the entries after the split point to the new block. A file grows at
+        // its end, so an entry added at the end of a node starts the new node, leaving the old one full
+        uint32_t split = pos == node->count ? pos : node->count / 2;
+        size_t size = entry_size(node);
+        memcpy(node_entry(new_node, 0), node_entry(node, split), (node->count - split) * size);
+        new_node->count = node->count - split;
+        node->count = split;
+        if(pos >= split) node_insert(new_node, pos - split, entry);
+        else node_insert(node, pos, entry);
+
+        // Add the new node to the parent, after the old one
+        idx = (a1fs_extent_idx){ entry_lblk(new_node, 0), blk };
+        entry = &idx;
+        level--;
+        pos = cursor.pos[level] + 1;
+    }
+}
+
+void etree_shift_start(etree_cursor *cursor, uint32_t count)
+{
+    uint32_t level = cursor->depth;
+    a1fs_extent *extent = node_extent(cursor->nodes[level], cursor->pos[level]);
+    extent->lblk += count;
+    extent->start += count;
+    extent->count -= count;
+    // The key of each node the extent is the first entry of is its lblk
+    for(; level > 0 && 0 == cursor->pos[level]; level--)
+    {
+        node_index(cursor->nodes[level-1], cursor->pos[level-1])->lblk = extent->lblk;
+    }
+}
+
+/**
+ * Remove the extents of a subtree from a logical block on, freeing their blocks and the nodes under the
+ *  subtree's root which are left empty
+ *
+ * @param   freed  a pointer to the number of data blocks freed, which is increased
+ * @return  true if the root of the subtree is left empty
+*/
+static bool truncate_node(a1fs_inode *inode, a1fs_etree_header *node, uint32_t first, uint32_t *freed, fs_ctx *fs)
+{
+    while(0 != node->count)
+    {
+        if(0 != node->depth)
+        { // Children are only freed once they are empty, the last one left may hold blocks past first
+            a1fs_extent_idx *idx = node_index(node, node->count-1);
+            if(!truncate_node(inode, block_node(idx->child, fs), first, freed, fs)) break;
+            free_block_range(idx->child, 1, fs);
+            node->count--;
+            continue;
+        }
+
+        a1fs_extent *extent = node_extent(node, node->count-1);
+        if(extent->lblk >= first)
+        {
+            free_block_range(extent->start, extent->count, fs);
+            *freed += extent->count;
+            node->count--;
+            inode->num_extents--;
+            continue;
+        }
+        // Free the suffix of the extent past the first block, in one range
+        if(extent->lblk + extent->count > first)
+        {
+            free_block_range(extent->start + (first - extent->lblk), extent->lblk + extent->count - first, fs);
+            *freed += extent->lblk + extent->count - first;
+            extent->count = first - extent->lblk;
+        }
+        break;
+    }
+    return 0 == node->count;
+}
+
+/**
+ * Drop the levels of a tree it no longer needs, pulling a single child up into the root while its
+ *  entries fit there. A root left empty becomes an empty leaf.
+*/
+static void shrink_root(a1fs_inode *inode, fs_ctx *fs)
+{
+    a1fs_etree_header *root = root_node(inode);
+    if(0 == root->count)
+    {
+        node_init(root, 0, ETREE_ROOT_EXTENTS);
+        return;
+    }
+    while(0 != root->depth && 1 == root->count)
+    {
+        a1fs_blk_t blk = node_index(root, 0)->child;
+        a1fs_etree_header *child = block_node(blk, fs);
+        if(child->count > node_max(true, child->depth)) break;
+        uint16_t count = child->count;
+        node_init(root, child->depth, node_max(true, child->depth));
+        memcpy(node_entry(root, 0), node_entry(child, 0), count * entry_size(child));
+        root->count = count;
+        free_block_range(blk, 1, fs);
+    }
+}
+
+uint32_t etree_truncate(a1fs_inode *inode, uint32_t first, fs_ctx *fs)
+{
+    uint32_t freed = 0;
+    truncate_node(inode, root_node(inode), first, &freed, fs);
+    shrink_root(inode, fs);
+    return freed;
+}
+
+void etree_remove(a1fs_inode *inode, etree_cursor *cursor, fs_ctx *fs)
+{
+    inode->num_extents--;
+    uint32_t level = cursor->depth;
+    while(true)
+    {
+        a1fs_etree_header *node = cursor->nodes[level];
+        uint32_t pos = cursor->pos[level];
+        memmove(node_entry(node, pos), node_entry(node, pos + 1), (node->count - pos - 1) * entry_size(node));
+        node->count--;
+        if(0 != node->count || 0 == level) break;
+        // Remove the empty node from its parent
+        free_block_range(node_index(cursor->nodes[level-1], cursor->pos[level-1])->child, 1, fs);
+        level--;
+    }
+    // The key of each node the removed entry was the first entry of is now the entry after it
+    for(; level > 0 && 0 == cursor->pos[level]; level--)
+    {
+        node_index(cursor->nodes[level-1], cursor->pos[level-1])->lblk = entry_lblk(cursor->nodes[level], 0);
+    }
+    shrink_root(inode, fs);
+}
+
+uint32_t etree_merge(a1fs_inode *inode, uint32_t first, uint32_t last, fs_ctx *fs)
+{
+    uint32_t merged = 0;
+    etree_cursor cursor;
+    a1fs_extent *prev = etree_seek(&cursor, inode, first, fs);
+    while(NULL != prev)
+    {
+        a1fs_extent *next = etree_next(&cursor, fs);
+        if(NULL == next || next->lblk >= last) break;
+        if(prev->lblk + prev->count != next->lblk || prev->start + prev->count != next->start ||
+           prev->unwritten != next->unwritten)
+        {
+            prev = next;
+            continue;
+        }
+        // Removing the second extent can move the first one, so the cursor goes back to it
+        uint32_t lblk = prev->lblk;
+        prev->count += next->count;
+        etree_remove(inode, &cursor, fs);
+        merged++;
+        prev = etree_seek(&cursor, inode, lblk, fs);
+    }
+    return merged;
+}
+
+/**
+ * Count the nodes under a node
+*/
+static uint32_t subtree_nodes(a1fs_etree_header *node, fs_ctx *fs)
+{
+    if(0 == node->depth) return 0;
+    uint32_t blocks = node->count;
+    // The children of nodes just above the leaves are leaves, which have no children of their own
+    if(1 != node->depth)
+    {
+        for(uint32_t i = 0; i < node->count; i++) blocks += subtree_nodes(block_node(node_index(node, i)->child, fs), fs);
+    }
+    return blocks;
+}
+
+uint32_t etree_node_blocks(a1fs_inode *inode, fs_ctx *fs)
+{
+    return subtree_nodes(root_node(inode), fs);
+}
@@ -0,0 +1,150 @@
+/**
+ * CSC369 Assignment 1 - Extent tree header file.
+ *  The extents of a file are kept in a B+tree keyed by logical block (see a1fs_etree_header), rooted
+ *  in the inode. Finding the extent holding a block, and adding an extent, take O(log n) node visits
+ *  in the number of extents, and a file can have as many extents as there are free blocks for them.
+ *  The tree is only changed with the inode locked for writing.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+#include "fs_ctx.h"
+
+/** The number of extents the root node has room for. */
+#define ETREE_ROOT_EXTENTS ((A1FS_ETREE_ROOT_SIZE - sizeof(a1fs_etree_header)) / sizeof(a1fs_extent))
+
+/** The number of index entries the root node has room for. */
+#define ETREE_ROOT_INDEX ((A1FS_ETREE_ROOT_SIZE - sizeof(a1fs_etree_header)) / sizeof(a1fs_extent_idx))
+
+/** The number of extents a leaf block has room for. */
+#define ETREE_BLOCK_EXTENTS ((A1FS_BLOCK_SIZE - sizeof(a1fs_etree_header)) / sizeof(a1fs_extent))
+
+/** The number of index entries an interior block has room for. */
+#define ETREE_BLOCK_INDEX ((A1FS_BLOCK_SIZE - sizeof(a1fs_etree_header)) / sizeof(a1fs_extent_idx))
+
+/**
+ * A path from the root of a tree down to an extent, used to walk the extents in order. It is only
+ * valid until the tree is changed.
+*/
+typedef struct etree_cursor {
+    a1fs_etree_header *nodes[A1FS_ETREE_MAX_DEPTH + 1]; // The nodes on the path, the root first
+    uint32_t           pos[A1FS_ETREE_MAX_DEPTH + 1];   // The entry followed in each node
+    uint32_t           depth;                           // The depth of the tree (the level of the leaf)
+} etree_cursor;
+
+/**
+ * Make the extent tree of an inode empty (the root is an empty leaf, and the inode has no blocks),
+ * e.g. for a new inode or one whose inline data moved to a block
+*/
+void etree_init(a1fs_inode *inode);
+
+/**
+ * Find the extent holding a block of a file
+ *
+ * @param  inode  a pointer to the inode
+ * @param  lblk   the index of the block within the file
+ * @return        a pointer to the extent; NULL if no extent holds the block
+*/
+a1fs_extent *etree_lookup(a1fs_inode *inode, uint32_t lblk, fs_ctx *fs);
+
+/**
+ * Get the last extent of a file
+ *
+ * @return  a pointer to the extent; NULL if the file has no extents
+*/
+a1fs_extent *etree_last(a1fs_inode *inode, fs_ctx *fs);
+
+/**
+ * Point a cursor at the extent holding a block, or the first extent after it
+ *
+ * @param  cursor  a pointer to the cursor
+ * @param  inode   a pointer to the inode
+ * @param  lblk    the index of the block within the file
+ * @return         a pointer to the extent; NULL if there are no extents from lblk on
+*/
+a1fs_extent *etree_seek(etree_cursor *cursor, a1fs_inode *inode, uint32_t lblk, fs_ctx *fs);
+
+/**
+ * Move a cursor to the next extent
+ *
+ * @return  a pointer to the extent; NULL if the cursor was at the last extent
+*/
+a1fs_extent *etree_next(etree_cursor *cursor, fs_ctx *fs);
+
+/**
+ * Count the blocks of new nodes needed to add an extent (one per full node it splits, from the leaf up)
+ *
+ * @param  inode  a pointer to the inode
+ * @param  lblk   the logical block of the extent to add
+ * @return        the number of blocks etree_insert() will use
+*/
+uint32_t etree_insert_blocks(a1fs_inode *inode, uint32_t lblk, fs_ctx *fs);
+
+/**
+ * Bound the number of blocks of new nodes needed to add extents to the end of a file
+ *
+ * @param  inode        a pointer to the inode
+ * @param  num_extents  the most extents which may be added
+ * @return              the number of blocks the etree_insert() calls may use between them
+*/
+uint32_t etree_append_blocks(a1fs_inode *inode, uint32_t num_extents, fs_ctx *fs);
+
+/**
+ * Add an extent to a file, which must not overlap its other extents
+ *
+ * @param  inode     a pointer to the inode
+ * @param  extent    the extent to add
+ * @param  new_blks  the allocated data blocks to use for new nodes, at least etree_insert_blocks()
+ * @return           the number of new_blks used
+*/
+uint32_t etree_insert(a1fs_inode *inode, const a1fs_extent *extent, const a1fs_blk_t *new_blks, fs_ctx *fs);
+
+/**
+ * Drop the first blocks of the extent a cursor is at, which the caller gives to the extent before it
+ * (which must end where the extent starts, both logically and physically). The keys of the nodes the
+ * extent is the first entry of are updated along with its lblk.
+ *
+ * @param  cursor  a cursor at the extent, from etree_seek()
+ * @param  count   the number of blocks to move, fewer than the extent has
+*/
+void etree_shift_start(etree_cursor *cursor, uint32_t count);
+
+/**
+ * Remove the extent a cursor is at, without freeing its blocks (e.g. they joined the extent before it).
+ *  The nodes which are left empty are freed, and the tree loses levels it no longer needs.
+ *
+ * @param  inode   a pointer to the inode
+ * @param  cursor  a cursor at the extent, from etree_seek(). It is no longer valid afterwards
+*/
+void etree_remove(a1fs_inode *inode, etree_cursor *cursor, fs_ctx *fs);
+
+/**
+ * Merge the extents of a file which are adjacent both logically and physically (and are either both
+ *  written or both unwritten) into one, e.g. ones added by separate allocations which happened to be
+ *  contiguous
+ *
+ * @param  inode  a pointer to the inode
+ * @param  first  the index of a block in (or before) the first extent to merge
+ * @param  last   the index of the block from which extents are left as they are
+ * @return        the number of extents removed
+*/
+uint32_t etree_merge(a1fs_inode *inode, uint32_t first, uint32_t last, fs_ctx *fs);
+
+/**
+ * Remove the blocks of a file from a logical block on, freeing them one range per extent. The nodes
+ * which are left empty are freed, and the tree loses levels it no longer needs.
+ *
+ * @param  inode  a pointer to the inode
+ * @param  first  the index of the first block to remove
+ * @return        the number of data blocks freed (not counting the nodes)
+*/
+uint32_t etree_truncate(a1fs_inode *inode, uint32_t first, fs_ctx *fs);
+
+/**
+ * Count the data blocks used by the nodes of a file's extent tree (all but the root)
+*/
+uint32_t etree_node_blocks(a1fs_inode *inode, fs_ctx *fs);
@@ -16,8 +16,36 @@
  * CSC369 Assignment 1 - File system runtime context implementation.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "fs_ctx.h"
 #include "a1fs.h"
+#include "bitmap.h"
+
+/**
+ * Set up the runtime state of the allocation groups, indexing the free extents of each one
+*/
+static bool groups_init(fs_ctx *fs)
+{
+	fs->num_groups = fs->superblock->num_groups;
+	fs->groups = calloc(fs->num_groups, sizeof(fs_group));
+	if (!fs->groups) return false;
+	for (uint32_t g = 0; g < fs->num_groups; g++) {
+		fs_group *group = &fs->groups[g];
+		group->desc = &fs->superblock->groups[g];
+		// The group's slice of the bitmap starts on a byte boundary
+		pthread_mutex_init(&group->lock, NULL);
+		if (!fspace_init(&group->fspace, fs->d_bitmap + group->desc->first_dblock / 8, group->desc->num_dblocks)) {
+			while (g-- > 0) fspace_destroy(&fs->groups[g].fspace);
+			free(fs->groups);
+			fs->groups = NULL;
+			return false;
+		}
+	}
+	return true;
+}
 
 bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
 {
@@ -26,12 +54,92 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size)
 	fs->size = size;
 	fs->superblock   = (a1fs_superblock *)(image + A1FS_BLOCK_SIZE);
 	fs->d_bitmap = (char *)(image + fs->superblock->data_bitmap * A1FS_BLOCK_SIZE);
+	fs->i_bitmap = (char *)(image + fs->superblock->inode_bitmap * A1FS_BLOCK_SIZE);
 	fs->inode_table = (a1fs_inode *)(image + fs->superblock->inode_table * A1FS_BLOCK_SIZE);
 	fs->data_blks = (image + fs->superblock->data_blk * A1FS_BLOCK_SIZE);
-	return true;
+	// Files which weren't closed before the last unmount may still have preallocated blocks
+	fs->prealloc_blocks = 0;
+	uint32_t num_inodes = fs->superblock->num_inodes;
+	for(uint32_t i = bitmap_find_next_set(fs->i_bitmap, num_inodes, 0); i < num_inodes;
+	    i = bitmap_find_next_set(fs->i_bitmap, num_inodes, i + 1))
+	{
+		fs->prealloc_blocks += fs->inode_table[i].prealloc_blocks;
+	}
+	pthread_rwlock_init(&fs->ns_lock, NULL);
+	for (uint32_t i = 0; i < FS_INODE_LOCKS; i++) pthread_rwlock_init(&fs->inode_locks[i], NULL);
+	pthread_mutex_init(&fs->cache_lock, NULL);
+	pthread_mutex_init(&fs->emap_lock, NULL);
+	pthread_mutex_init(&fs->delalloc_lock, NULL);
+	pthread_mutex_init(&fs->reclaim_lock, NULL);
+	pthread_cond_init(&fs->reclaim_cond, NULL);
+	pthread_mutex_init(&fs->defrag_lock, NULL);
+	pthread_cond_init(&fs->defrag_cond, NULL);
+	fs->pending_free_blocks = 0;
+	fs->num_orphans = 0;
+	fs->reclaimer_running = false;
+	fs->defragger_started = false;
+	memset(&fs->defrag_stats, 0, sizeof(fs->defrag_stats));
+	if (!dcache_init(&fs->dcache, fs->superblock->num_inodes)) return false;
+	if (!emap_init(&fs->emaps, fs->superblock->num_inodes)) return false;
+	if (!groups_init(fs)) return false;
+	if (!delalloc_init(&fs->delalloc, fs->superblock->num_inodes)) return false;
+	// The count in the superblock misses the deltas which were never folded into it if the file system
+	// wasn't unmounted cleanly, but the counts of the groups are always exact
+	uint32_t free_dblocks = 0;
+	for (uint32_t g = 0; g < fs->num_groups; g++) free_dblocks += fs->groups[g].desc->num_free_dblocks;
+	fs->superblock->num_free_dblocks = free_dblocks;
+	if (!pcounter_init(&fs->free_dblocks, &fs->superblock->num_free_dblocks)) return false;
+	return dtags_init(&fs->dtags, fs->superblock->num_tot_dblocks);
 }
 
 void fs_ctx_destroy(fs_ctx *fs)
 {
-	(void)fs;
+	if(VERBOSE) printf("dcache: %lu hits, %lu negative hits, %lu misses\n",
+	                   fs->dcache.hits, fs->dcache.negative_hits, fs->dcache.misses);
+	if(VERBOSE) printf("defrag: %lu files, %lu extents merged, %lu blocks moved\n",
+	                   fs->defrag_stats.files_defragged, fs->defrag_stats.extents_merged, fs->defrag_stats.blocks_moved);
+	dcache_destroy(&fs->dcache);
+	dtags_destroy(&fs->dtags);
+	emap_destroy(&fs->emaps);
+	if (fs->groups) {
+		for (uint32_t g = 0; g < fs->num_groups; g++) {
+			fspace_destroy(&fs->groups[g].fspace);
+			pthread_mutex_destroy(&fs->groups[g].lock);
+		}
+		free(fs->groups);
+		fs->groups = NULL;
+	}
+	delalloc_destroy(&fs->delalloc);
+	pcounter_destroy(&fs->free_dblocks);
+	pthread_rwlock_destroy(&fs->ns_lock);
+	for (uint32_t i = 0; i < FS_INODE_LOCKS; i++) pthread_rwlock_destroy(&fs->inode_locks[i]);
+	pthread_mutex_destroy(&fs->cache_lock);
+	pthread_mutex_destroy(&fs->emap_lock);
+	pthread_mutex_destroy(&fs->delalloc_lock);
+	pthread_mutex_destroy(&fs->reclaim_lock);
+	pthread_cond_destroy(&fs->reclaim_cond);
+	pthread_mutex_destroy(&fs->defrag_lock);
+	pthread_cond_destroy(&fs->defrag_cond);
+}
+
+void fs_ctx_sync(fs_ctx *fs)
+{
+	pcounter_fold(&fs->free_dblocks);
+}
+
+void fs_lock_inode(fs_ctx *fs, a1fs_ino_t ino, bool write)
+{
+	pthread_rwlock_t *lock = &fs->inode_locks[ino % FS_INODE_LOCKS];
+	if (write) pthread_rwlock_wrlock(lock);
+	else pthread_rwlock_rdlock(lock);
+}
+
+bool fs_trylock_inode(fs_ctx *fs, a1fs_ino_t ino)
+{
+	return 0 == pthread_rwlock_trywrlock(&fs->inode_locks[ino % FS_INODE_LOCKS]);
+}
+
+void fs_unlock_inode(fs_ctx *fs, a1fs_ino_t ino)
+{
+	pthread_rwlock_unlock(&fs->inode_locks[ino % FS_INODE_LOCKS]);
 }
@@ -18,15 +18,52 @@
 
 #pragma once
 
+#include <pthread.h>
 #include <stddef.h>
 
 #include "options.h"
 #include "a1fs.h"
+#include "dcache.h"
+#include "dtags.h"
+#include "emap.h"
+#include "fspace.h"
+#include "delalloc.h"
+#include "pcounter.h"
 
 #define VERBOSE 1
 
+/** The number of inode locks, inodes share them by their number modulo this. */
+#define FS_INODE_LOCKS 1024
+
+/**
+ * The runtime state of an allocation group.
+ */
+typedef struct fs_group {
+	/** The group's descriptor in the superblock. */
+	a1fs_group_desc *desc;
+	/** Index of the free extents of the group's data blocks, relative to its first block. */
+	fspace fspace;
+	/** The inode number (relative to the group) at which to start looking for a free inode. */
+	a1fs_ino_t inode_cursor;
+	/** Protects the group's slice of the data bitmap, its free data block count and its fspace. */
+	pthread_mutex_t lock;
+} fs_group;
+
 /**
  * Mounted file system runtime state - "fs context".
+ *
+ * Locking: the operations run on multiple threads. The locks are always taken in this order:
+ *  1. ns_lock, held for reading while a path is used or a directory is read, and for writing while
+ *     directories are changed. Inodes are only allocated and freed while it is held for writing.
+ *  2. The lock of an inode, held for reading while its data or attributes are read, and for writing
+ *     while they are changed. Held for the whole operation, so e.g. the extents of a file don't change
+ *     while it is read. Only one inode is locked at a time (others are only try-locked).
+ *  3. reclaim_lock, then cache_lock, emap_lock, delalloc_lock and the group locks, held only within
+ *     fs_utils, and defrag_lock.
+ * The free counts and the totals of preallocated and reserved blocks are read without a lock, and
+ * updated with atomic operations (the free data block count through free_dblocks). Data blocks are
+ * claimed (see delalloc_claim()) before they are allocated, so a check for free space holds until the
+ * allocation.
  */
 typedef struct fs_ctx {
 	/** Pointer to the start of the image. */
@@ -37,10 +74,68 @@ typedef struct fs_ctx {
 	a1fs_superblock *superblock;
 	/** Pointer to bitmap showing allocated/deallocated data blocks. */
 	char *d_bitmap;	
+	/** Pointer to bitmap showing allocated/deallocated inodes. */
+	char *i_bitmap;
+	/** The allocation groups. */
+	fs_group *groups;
+	/** The number of allocation groups, the same as superblock->num_groups. */
+	uint32_t num_groups;
 	/** Pointer to the inode table (Array of inodes). */
 	a1fs_inode *inode_table;
 	/** Pointer to start of the data blocks. */
 	void *data_blks;
+	/** Cache of directory entries used by path_lookup(). */
+	dcache dcache;
+	/** Cache of the dentry tags of directory blocks. */
+	dtags dtags;
+	/** Cache of the extent maps of inodes. */
+	emap_cache emaps;
+	/** Pending data of writes whose blocks are not allocated yet. */
+	delalloc delalloc;
+	/** The number of speculatively preallocated blocks of all the inodes. */
+	uint32_t prealloc_blocks;
+	/** The number of free data blocks, kept per CPU and folded into superblock->num_free_dblocks. */
+	pcounter free_dblocks;
+	/** The number of data blocks of orphans which are yet to be freed. */
+	uint32_t pending_free_blocks;
+	/** The number of inodes on the orphan list. */
+	uint32_t num_orphans;
+	/** The thread which frees the orphans in the background, see start_reclaimer(). */
+	pthread_t reclaimer;
+	/** Whether the reclaimer was started. Without it, unlinked files are freed right away. */
+	bool reclaimer_running;
+	/** Set to make the reclaimer exit, once the orphan list is empty. */
+	bool reclaimer_stop;
+	/** The thread which defragments all the files in the background, see start_defrag(). */
+	pthread_t defragger;
+	/** Whether the defragmenter thread was started and is yet to be joined. */
+	bool defragger_started;
+	/** Set to make the defragmenter stop, between two chunks of work. */
+	bool defrag_stop;
+	/** The most data blocks the background pass of the defragmenter moves per second. */
+	uint32_t defrag_rate;
+	/** Progress of the defragmenter, see A1FS_IOC_DEFRAG_STATS. */
+	a1fs_defrag_stats defrag_stats;
+
+	/** The namespace lock, see above. */
+	pthread_rwlock_t ns_lock;
+	/** The inode locks, see fs_lock_inode(). */
+	pthread_rwlock_t inode_locks[FS_INODE_LOCKS];
+	/** Protects the dcache and the dtags, which are filled in by path lookups. Not needed while
+	 * ns_lock is held for writing. */
+	pthread_mutex_t cache_lock;
+	/** Protects the extent map cache and the extent hints of file handles. */
+	pthread_mutex_t emap_lock;
+	/** Protects the table of delayed allocation buffers. */
+	pthread_mutex_t delalloc_lock;
+	/** Protects the orphan list, and the extents of the inodes on it (which nothing else uses). */
+	pthread_mutex_t reclaim_lock;
+	/** Signalled when an inode is added to the orphan list, or the reclaimer should stop. */
+	pthread_cond_t reclaim_cond;
+	/** Protects the defragmenter's state and statistics. */
+	pthread_mutex_t defrag_lock;
+	/** Signalled when the defragmenter should stop, which it waits for between two chunks of work. */
+	pthread_cond_t defrag_cond;
 
 } fs_ctx;
 
@@ -60,3 +155,32 @@ bool fs_ctx_init(fs_ctx *fs, void *image, size_t size);
  * Must cleanup all the resources created in fs_ctx_init().
  */
 void fs_ctx_destroy(fs_ctx *fs);
+
+/**
+ * Write the free counts kept in memory to the superblock, so the image is correct (e.g. before it is
+ * unmapped).
+ */
+void fs_ctx_sync(fs_ctx *fs);
+
+/**
+ * Lock an inode for reading or writing.
+ *
+ * @param fs     pointer to the context.
+ * @param ino    the inode number.
+ * @param write  true to lock for writing; false for reading.
+ */
+void fs_lock_inode(fs_ctx *fs, a1fs_ino_t ino, bool write);
+
+/**
+ * Try to lock an inode for writing, without waiting. Used to work on another inode while one is
+ * already locked, which could deadlock if it waited.
+ *
+ * @return  true if the inode is now locked; false if its lock is held (possibly by the caller,
+ *          if the inodes share a lock).
+ */
+bool fs_trylock_inode(fs_ctx *fs, a1fs_ino_t ino);
+
+/**
+ * Unlock an inode locked by fs_lock_inode() or fs_trylock_inode().
+ */
+void fs_unlock_inode(fs_ctx *fs, a1fs_ino_t ino);
@@ -8,19 +8,68 @@
 #include "fs_ctx.h"
 #include "util.h"
 #include "fs_utils.h"
+#include "dir.h"
+#include "bitmap.h"
+#include "etree.h"
 
 typedef struct a1fs_tuple{
     int start;
     int end;
 } a1fs_tuple;
 
-int find_empty_inode(fs_ctx *fs)
+uint32_t block_group(a1fs_blk_t blk, fs_ctx *fs)
 {
-    // Iterate through the inodes table looking for an inode with 0 links (free).
-    // It must therefore not be in use. 
-    for(uint32_t i = 0; i < fs->superblock->num_inodes; i++)
+    return blk / fs->superblock->dblocks_per_group;
+}
+
+uint32_t inode_group(a1fs_ino_t ino, fs_ctx *fs)
+{
+    return ino / fs->superblock->inodes_per_group;
+}
+
+/**
+ * Choose the group for a new directory. Directories are spread out over the groups which have at least
+ *  the average number of free inodes, picking the one with the most free data blocks, so their files
+ *  have room to grow near them.
+ *
+ * @param  fs          a pointer to the context
+ * @return             the group number
+*/
+static uint32_t dir_group(fs_ctx *fs)
+{
+    uint32_t num_groups = fs->num_groups, best = 0;
+    uint32_t avg_free_inodes = fs->superblock->num_free_inodes / num_groups;
+    for(uint32_t g = 0; g < num_groups; g++)
     {
-        if(0 == fs->inode_table[i].links) return i;
+        a1fs_group_desc *desc = fs->groups[g].desc;
+        if(0 == desc->num_free_inodes || desc->num_free_inodes < avg_free_inodes) continue;
+        // The free block counts may be changing, since the group locks aren't held
+        if(0 == fs->groups[best].desc->num_free_inodes ||
+           AtomicLoad(&desc->num_free_dblocks) > AtomicLoad(&fs->groups[best].desc->num_free_dblocks)) best = g;
+    }
+    return best;
+}
+
+int find_empty_inode(a1fs_ino_t parent, mode_t mode, fs_ctx *fs)
+{
+    // A file goes in its parent's group, and its data blocks will too
+    uint32_t num_groups = fs->num_groups;
+    uint32_t goal = S_ISDIR(mode) ? dir_group(fs) : inode_group(parent, fs);
+    for(uint32_t i = 0; i < num_groups; i++)
+    {
+        fs_group *group = &fs->groups[(goal + i) % num_groups];
+        if(0 == group->desc->num_free_inodes) continue;
+
+        // Scan the group's slice of the inode bitmap from the cursor, wrapping around to the start once.
+        // All the inodes before the cursor are in use (unless one was freed, which moves the cursor
+        // back), so this is usually a single word.
+        const char *bitmap = fs->i_bitmap + group->desc->first_inode / 8;
+        uint32_t num_inodes = group->desc->num_inodes;
+        uint32_t ino = bitmap_find_next_zero(bitmap, num_inodes, group->inode_cursor);
+        if(ino == num_inodes) ino = bitmap_find_next_zero(bitmap, num_inodes, 0);
+        if(ino == num_inodes) continue;
+        group->inode_cursor = ino;
+        return group->desc->first_inode + ino;
     }
     return -1;
 }
@@ -33,18 +82,75 @@ bool init_inode(a1fs_ino_t index, mode_t mode, uint32_t links, void* image)
     a1fs_inode *inode = (a1fs_inode *)(image + superblock->inode_table * A1FS_BLOCK_SIZE +
                                         index * sizeof(a1fs_inode));
     // Set the inode's fields, note that the mtime is set to the current time
+    bitmap_set_range(image + superblock->inode_bitmap * A1FS_BLOCK_SIZE, index, 1);
+    superblock->groups[index / superblock->inodes_per_group].num_free_inodes--;
     inode->mode = mode;
     inode->links = links;
     inode->size = 0;
     if(clock_gettime(CLOCK_REALTIME, &inode->mtime) < 0) return false;
-    inode->num_extents = 0;
-    memset(inode->direct_extents, 0, A1FS_NUM_DIRECT_EXTENT*sizeof(a1fs_extent));
-    inode->indirect_extent_blk = 0;
-    superblock->num_free_inodes--;
+    etree_init(inode);
+    inode->flags = 0;
+    inode->dir_entries = 0;
+    inode->dir_free_hint = 0;
+    inode->prealloc_blocks = 0;
+    inode->generation++;
+    memset(inode->reserved, 0, sizeof(inode->reserved));
+    AtomicSub(&superblock->num_free_inodes, 1);
 
     return true;
 }
 
+/**
+ * Lookup the inode number assosiated with a path, with the cache lock held
+ *
+ * @param  unmodified_path  path to a file or directory.
+ * @param  path             a copy of the path, which is modified
+ * @param  fs               a pointer to the context
+ * @return                  inode number on sucsess; -errno on error;
+*/
+static int lookup_locked(const char *unmodified_path, char *path, fs_ctx *fs)
+{
+    // The whole path may already be cached (as existing or not)
+    int cur_inode_num = dcache_lookup(&fs->dcache, DCACHE_PATH_PARENT, unmodified_path);
+    if(DCACHE_MISS != cur_inode_num)
+    {
+        if(VERBOSE) printf("(cached) %d\n", cur_inode_num);
+        return cur_inode_num;
+    }
+    
+    cur_inode_num = 0; // Start at the root
+    // Iterate over the components (/ seperated values) of the path
+    char *save_ptr;
+    for(char *component; NULL != (component = strtok_r(path, "/", &save_ptr)); path = NULL)
+    {
+        if(cur_inode_num < 0) return -ENOENT; // A component was not found in the last iteration
+        
+        // A pointer to the inode currently being checked
+        a1fs_inode *inode = &(fs->inode_table[cur_inode_num]);
+        if (!S_ISDIR(inode->mode)) return -ENOTDIR;
+
+        // Only scan the directory if this component (i.e the path prefix up to it) is not cached
+        a1fs_ino_t parent_num = cur_inode_num;
+        if(DCACHE_MISS == (cur_inode_num = dcache_lookup(&fs->dcache, parent_num, component)))
+        {
+            cur_inode_num = dir_lookup(inode, component, fs);
+            dcache_insert(&fs->dcache, parent_num, component, cur_inode_num >= 0 ? (a1fs_ino_t)cur_inode_num : DCACHE_NEGATIVE);
+        }
+        if(VERBOSE) printf("%d ", cur_inode_num);
+    }
+    if(VERBOSE) printf("\n");
+
+    // Note: a path can only start (or stop) existing when its last component is added (or removed),
+    // which replaces the cached entry of the full path
+    if(cur_inode_num < 0)
+    {
+        dcache_insert_negative(&fs->dcache, DCACHE_PATH_PARENT, unmodified_path);
+        return -ENOENT;
+    }
+    if(0 != strcmp(unmodified_path, "/")) dcache_insert(&fs->dcache, DCACHE_PATH_PARENT, unmodified_path, cur_inode_num);
+    return cur_inode_num;
+}
+
 int path_lookup(const char *unmodified_path, fs_ctx *fs) 
 {
     if(VERBOSE) printf("\t path_lookup(%s). Inodes accessed: 0 ", unmodified_path);
@@ -57,243 +163,1131 @@ int path_lookup(const char *unmodified_path, fs_ctx *fs)
         if(VERBOSE) printf("\n");
         return -ENOENT;
     } // The path must be absolute
-    
-    int cur_inode_num = 0; // Start at the root
-    // Iterate over the components (/ seperated values) of the path
-    for(char *component; NULL != (component = strtok(path, "/")); path = NULL)
+
+    // Looking up a path fills in the dcache and the dtags
+    pthread_mutex_lock(&fs->cache_lock);
+    int ret = lookup_locked(unmodified_path, path, fs);
+    pthread_mutex_unlock(&fs->cache_lock);
+    return ret;
+}
+
+a1fs_extent *get_extent(a1fs_inode *inode, uint32_t lblk, fs_ctx *fs)
+{
+    return etree_lookup(inode, lblk, fs);
+}
+
+void *get_data_block(a1fs_inode *inode, uint32_t index, fs_ctx *fs)
+{
+    return get_data_block_hint(inode, index, NULL, fs);
+}
+
+/**
+ * Get the extent map of an inode, building it from the inode's extents if it isn't cached.
+ *  The emap lock must be held while the map is used, since other inodes can evict it.
+ *
+ * @return  a pointer to the map; NULL if it couldn't be built (e.g. a malloc() call failed)
+*/
+static emap *get_extent_map(a1fs_inode *inode, fs_ctx *fs)
+{
+    a1fs_ino_t ino = inode - fs->inode_table;
+    emap *map = emap_get(&fs->emaps, ino);
+    if(NULL != map) return map;
+
+    if(NULL == (map = emap_fill(&fs->emaps, ino, inode->num_extents))) return NULL;
+    etree_cursor cursor;
+    for(a1fs_extent *extent = etree_seek(&cursor, inode, 0, fs); NULL != extent; extent = etree_next(&cursor, fs))
     {
-        if(cur_inode_num < 0) return -ENOENT; // A component was not found in the last iteration
-        
-        // A pointer to the inode currently being checked
-        a1fs_inode *inode = &(fs->inode_table[cur_inode_num]);
-        if (!S_ISDIR(inode->mode)) return -ENOTDIR;
-        cur_inode_num = -1;
+        emap_append(map, extent); // Can't fail, the capacity is reserved
+    }
+    return map;
+}
 
-        a1fs_block_iterator b_iter;
-        block_iterator_init(inode, &b_iter, fs);
+void invalidate_extent_map(a1fs_inode *inode, fs_ctx *fs)
+{
+    pthread_mutex_lock(&fs->emap_lock);
+    emap_drop(&fs->emaps, inode - fs->inode_table);
+    pthread_mutex_unlock(&fs->emap_lock);
+}
 
-        a1fs_dentry *cur_entry;
-        void *cur_blk;
-        // Iterate over the inodes data blocks
-        while(NULL != (cur_blk = block_iterator_next_blk(&b_iter, fs))){
-            // Iterate over the NUM_DENTRY_PER_BLOCK dir_entries in a block
-            for(uint32_t d_ind = 0; d_ind < NUM_DENTRY_PER_BLOCK; d_ind++)
-            {
-                cur_entry = (a1fs_dentry *) (cur_blk + d_ind * sizeof(a1fs_dentry));
-                // Check if the name of the cur entry is equal to the component, we're searching for
-                if(0 == strcmp(cur_entry->name, component))
-                {                        
-                    cur_inode_num = cur_entry->ino;
-                }
-            }
+/**
+ * Find the extent of a map holding a block, checking the extent of the hint and the one after it
+ * (for sequential accesses) before searching the map, and update the hint
+ *
+ * @return  the index of the extent; -1 if the inode has index or fewer blocks
+*/
+static int find_extent(emap *map, uint32_t index, a1fs_extent_hint *hint)
+{
+    if(NULL != hint)
+    {
+        for(uint32_t i = hint->index; i < map->num_extents && i <= hint->index+1; i++)
+        {
+            if(index - map->extents[i].lblk < map->extents[i].count) return hint->index = i;
         }
-        if(VERBOSE) printf("%d ", cur_inode_num);
     }
-    if(VERBOSE) printf("\n");
-    return cur_inode_num >= 0 ? cur_inode_num : -ENOENT;
+    int i = emap_find(map, index);
+    if(NULL != hint && i >= 0) hint->index = i;
+    return i;
+}
+
+/**
+ * Get a data block of an inode, along with the number of contiguous blocks of the inode which start
+ *  with it (the rest of its extent). A block in a hole has no data block, the run is then the rest of
+ *  the hole (up to the next extent).
+ *
+ * @param  inode      a pointer to the inode
+ * @param  index      the index of the block within the inode
+ * @param  hint       the extent of the last block accessed; may be NULL
+ * @param  run_blks   a pointer in which to put the number of blocks in the run, 0 if there are no
+ *                     extents from index on
+ * @param  unwritten  a pointer in which to put whether the run is in an unwritten extent; may be NULL
+ * @param  fs         a pointer to the context
+ * @return            a pointer to the block; NULL if the block is in a hole (or past the last extent)
+*/
+static void *get_data_run(a1fs_inode *inode, uint32_t index, a1fs_extent_hint *hint, uint64_t *run_blks,
+                          bool *unwritten, fs_ctx *fs)
+{
+    void *blk = NULL;
+    bool in_unwritten = false;
+    *run_blks = 0;
+    pthread_mutex_lock(&fs->emap_lock);
+    emap *map = get_extent_map(inode, fs);
+    if(NULL == map)
+    { // Look the block up in the extent tree instead
+        etree_cursor cursor;
+        a1fs_extent *extent = etree_seek(&cursor, inode, index, fs);
+        if(NULL != extent && extent->lblk > index)
+        {
+            *run_blks = extent->lblk - index;
+        }else if(NULL != extent)
+        {
+            blk = fs->data_blks + (size_t)(extent->start + index - extent->lblk) * A1FS_BLOCK_SIZE;
+            *run_blks = extent->lblk + extent->count - index;
+            in_unwritten = extent->unwritten;
+        }
+    }else
+    {
+        int i = find_extent(map, index, hint);
+        if(i >= 0)
+        {
+            emap_extent *extent = &map->extents[i];
+            blk = fs->data_blks + (size_t)(extent->start + index - extent->lblk) * A1FS_BLOCK_SIZE;
+            *run_blks = extent->lblk + extent->count - index;
+            in_unwritten = extent->unwritten;
+        }else if((i = emap_next(map, index)) >= 0)
+        {
+            *run_blks = map->extents[i].lblk - index;
+        }
+    }
+    pthread_mutex_unlock(&fs->emap_lock);
+    if(NULL != unwritten) *unwritten = in_unwritten;
+    return blk;
+}
+
+void *get_data_block_hint(a1fs_inode *inode, uint32_t index, a1fs_extent_hint *hint, fs_ctx *fs)
+{
+    uint64_t run_blks;
+    return get_data_run(inode, index, hint, &run_blks, NULL, fs);
 }
 
-a1fs_extent *get_extent(a1fs_inode *inode, int index, fs_ctx *fs)
+/**
+ * Find the best fitting free sequence of a group (the smallest one long enough, or the longest one).
+ *  The free space index gives it directly. The group's slice of the bitmap is only scanned if the index
+ *  could not be kept up to date. The group must be locked.
+ *
+ * @param  group      a pointer to the group
+ * @param  needed     the number of blocks needed
+ * @param  start      a pointer in which to put the start of the sequence (relative to the group)
+ * @param  fs         a pointer to the context
+ * @return            the length of the sequence; 0 if the group has no free blocks
+*/
+static uint32_t group_free_sequence(fs_group *group, uint32_t needed, a1fs_blk_t *start, fs_ctx *fs)
 {
-    // If the index is less than A1FS_NUM_DIRECT_EXTENT, get the extent from the inode, 
-    // otherwise get it from the indirect block
-    if(index < A1FS_NUM_DIRECT_EXTENT)
+    uint32_t count = 0;
+    if(0 == group->desc->num_free_dblocks) return 0;
+    if(!group->fspace.stale) return fspace_find(&group->fspace, needed, start, &count) ? count : 0;
+
+    *start = bitmap_find_zero_run(fs->d_bitmap + group->desc->first_dblock / 8, group->desc->num_dblocks, needed, &count);
+    return count;
+}
+
+/**
+ * Mark a range of blocks within a group as allocated or free, in the bitmap, the free counts and the
+ *  free space index. The group must be locked.
+*/
+static void update_group_range(fs_group *group, a1fs_blk_t start, uint32_t count, bool allocate, fs_ctx *fs)
+{
+    uint32_t first = group->desc->first_dblock;
+    if(allocate)
     {
-        return &(inode->direct_extents[index]);
+        bitmap_set_range(fs->d_bitmap, start, count);
+        AtomicSub(&group->desc->num_free_dblocks, count);
+        pcounter_add(&fs->free_dblocks, -(int32_t)count);
+        fspace_alloc(&group->fspace, start - first, count);
     }else
     {
-        return (fs->data_blks + inode->indirect_extent_blk * A1FS_BLOCK_SIZE +
-					(index - A1FS_NUM_DIRECT_EXTENT) * sizeof(a1fs_extent));
+        bitmap_clear_range(fs->d_bitmap, start, count);
+        AtomicAdd(&group->desc->num_free_dblocks, count);
+        pcounter_add(&fs->free_dblocks, (int32_t)count);
+        fspace_free(&group->fspace, start - first, count);
     }
 }
 
 /**
- * Find the first sequence of blocks which can hold the needed number of blocks, and if there are none long enough
- *  return the longest sequence that exists.
- * 
- * Assume:
- *   superblock->num_tot_dblocks has been checked, and there is at least 1 free data block
+ * Allocate the best fitting free sequence of a group, if it is long enough
+ *
+ * @param  group          a pointer to the group
+ * @param  needed         the number of blocks needed
+ * @param  take_shorter   whether to allocate the sequence when it is shorter than needed
+ * @param  tuple          a pointer to a tuple in which to put the start and end of the allocated sequence.
+ *                         left unchanged if nothing is allocated
+ * @param  fs             a pointer to the context
+ * @return                the length of the free sequence found; 0 if the group has no free blocks
+*/
+static uint32_t group_alloc_sequence(fs_group *group, uint32_t needed, bool take_shorter, a1fs_tuple *tuple, fs_ctx *fs)
+{
+    a1fs_blk_t start;
+    pthread_mutex_lock(&group->lock);
+    uint32_t len = group_free_sequence(group, needed, &start, fs);
+    if(0 != len && (take_shorter || len >= needed))
+    {
+        start += group->desc->first_dblock;
+        update_group_range(group, start, Min(len, needed), true, fs);
+        tuple->start = start;
+        tuple->end = start + Min(len, needed) - 1;
+    }
+    pthread_mutex_unlock(&group->lock);
+    return len;
+}
+
+/**
+ * Allocate the best fitting free sequence of the first group which has one long enough (the smallest
+ *  sequence of that group which can hold the needed number of blocks, see group_free_sequence()), and
+ *  if no group has one long enough the longest sequence that exists.
+ *  The goal group is searched first, then the groups after it, so a file's blocks stay in its group
+ *  while there is room for them. A sequence is allocated before the lock of its group is released, so
+ *  another thread can't take it in the meantime.
  * 
  * @param  needed     the number of blocks needed to find
  * @param  tuple      a pointer to a tuple in which to put the start and end of the sequence.
  *                     set start and end to -1 if there is no sequence
+ * @param  goal       the group to search first
  * @param  fs         a pointer to the context
 */
-void first_free_sequence(int needed, a1fs_tuple *tuple, fs_ctx *fs)
+static void alloc_free_sequence(int needed, a1fs_tuple *tuple, uint32_t goal, fs_ctx *fs)
 {
-    int max_s, max_e, start, end;
-    max_s = max_e = start = end = 0;
-
-    // Iterate over the entire bitmap
-    for(uint32_t i = 0; i < fs->superblock->num_tot_dblocks; i++)
+    uint32_t num_groups = fs->num_groups, max_len = 0, max_group = goal;
+    tuple->start = tuple->end = -1;
+    for(uint32_t i = 0; i < num_groups; i++)
     {
-        // If the sequence of allocated blocks breaks i.e a new sequence of free blocks can begin
-        if (0 != (fs->d_bitmap[i / 8] & (1 << (i % 8))))
+        uint32_t g = (goal + i) % num_groups;
+        uint32_t len = group_alloc_sequence(&fs->groups[g], needed, false, tuple, fs);
+        if(tuple->start >= 0) return;
+        if(len > max_len)
         {
-            // Once a sequence long enough is found, return that sequence
-            // Note: we don't have end-start+1 since the last end++ should not be counted to this sequence so end-start+1-1
-            if(end-start == needed)
-            {
-                tuple->start = start;
-                tuple->end  = end;
-                return;
-            }
-
-            // If the last found sequnce is longer than the max, update the max
-            if(end-start > max_e-max_s)
-            {
-                max_e = end-1;
-                max_s = start;
-            }
-            start = end+1;
-            end = start;
-        }
-        else
-        { 
-            end +=1;
+            max_len = len;
+            max_group = g;
         }
     }
-    // If the last sequence, which reached the end without breaking, is longer update max
-    if(end-start > max_e-max_s)
+    // Nothing is long enough, take the longest sequence (which may have changed since it was found)
+    if(0 != max_len) group_alloc_sequence(&fs->groups[max_group], needed, true, tuple, fs);
+}
+
+/**
+ * Allocate the free blocks starting at start, up to the end of its group
+ * 
+ * @param  start      the index of the first block to allocate
+ * @param  wanted     the maximum number of blocks to allocate
+ * @param  fs         a pointer to the context
+ * @return            the number of blocks allocated
+*/
+static uint32_t alloc_tail(a1fs_blk_t start, uint32_t wanted, fs_ctx *fs)
+{
+    if(start >= fs->superblock->num_tot_dblocks) return 0;
+    fs_group *group = &fs->groups[block_group(start, fs)];
+    uint32_t first = group->desc->first_dblock;
+    pthread_mutex_lock(&group->lock);
+    uint32_t len;
+    if(!group->fspace.stale) len = fspace_run_length(&group->fspace, start - first);
+    else len = bitmap_find_next_set(fs->d_bitmap + first / 8, group->desc->num_dblocks, start - first) - (start - first);
+
+    len = Min(len, wanted);
+    if(0 != len) update_group_range(group, start, len, true, fs);
+    pthread_mutex_unlock(&group->lock);
+    return len;
+}
+
+/**
+ * Mark a range of blocks as allocated or free, in each group it is in
+*/
+static void update_block_range(a1fs_blk_t start, uint32_t count, bool allocate, fs_ctx *fs)
+{
+    while(0 != count)
     {
-        max_e = end-1;
-        max_s = start;
+        fs_group *group = &fs->groups[block_group(start, fs)];
+        uint32_t n = Min(count, group->desc->first_dblock + group->desc->num_dblocks - start);
+        pthread_mutex_lock(&group->lock);
+        update_group_range(group, start, n, allocate, fs);
+        pthread_mutex_unlock(&group->lock);
+        start += n;
+        count -= n;
     }
-    tuple->start = max_s;
-    tuple->end  = max_e;
-    if(max_e-max_s >= needed)
+}
+
+void alloc_block_range(a1fs_blk_t start, uint32_t count, fs_ctx *fs)
+{
+    update_block_range(start, count, true, fs);
+}
+
+void free_block_range(a1fs_blk_t start, uint32_t count, fs_ctx *fs)
+{
+    update_block_range(start, count, false, fs);
+}
+
+/**
+ * Keep the extent map of an inode (if it is cached) in sync with its last extent, which either grew or
+ *  was just added
+ * @param  inode     a pointer to the ionode
+ * @param  extent    a pointer to the last extent
+ * @param  fs        a pointer to the context
+*/
+static void update_last_extent(a1fs_inode *inode, const a1fs_extent *extent, fs_ctx *fs)
+{
+    pthread_mutex_lock(&fs->emap_lock);
+    emap *map = emap_get(&fs->emaps, inode - fs->inode_table);
+    if(NULL != map && map->num_extents == inode->num_extents)
     {
-        tuple->start = start;
-        tuple->end  = start+needed-1;
-        return;
+        map->extents[map->num_extents-1].count = extent->count;
+    }else if(NULL != map && (map->num_extents+1 != inode->num_extents || !emap_append(map, extent)))
+    {
+        emap_drop(&fs->emaps, inode - fs->inode_table);
+    }
+    pthread_mutex_unlock(&fs->emap_lock);
+}
+
+/**
+ * Move the contents of an inline file to a data block, so the extents can be used
+ *
+ * @param  inode     a pointer to the inode
+ * @param  fs        a pointer to the context
+ * @return           0 on success; -errno on error
+*/
+static int inode_uninline(a1fs_inode *inode, fs_ctx *fs)
+{
+    char copy[A1FS_INLINE_DATA_MAX];
+    memcpy(copy, inode->inline_data, A1FS_INLINE_DATA_MAX);
+
+    // The inline data area holds the root of the extent tree from now on
+    inode->flags &= ~A1FS_INODE_INLINE;
+    etree_init(inode);
+    if(0 == inode->size) return 0;
+
+    // Allocate a block for the current contents, as if the file was empty
+    uint64_t size = inode->size;
+    inode->size = 0;
+    int ret = allocate_data_blocks(inode, size, fs);
+    inode->size = size;
+    if(0 != ret)
+    {
+        memcpy(inode->inline_data, copy, A1FS_INLINE_DATA_MAX);
+        inode->flags |= A1FS_INODE_INLINE;
+        return ret;
     }
 
+    void *blk = get_data_block(inode, 0, fs);
+    memset(blk, 0, A1FS_BLOCK_SIZE);
+    memcpy(blk, copy, size);
+    return 0;
+}
+
+uint32_t allocated_blocks(a1fs_inode *inode, fs_ctx *fs)
+{
+    if(inode->flags & A1FS_INODE_INLINE) return 0;
+    pthread_mutex_lock(&fs->emap_lock);
+    emap *map = get_extent_map(inode, fs);
+    if(NULL != map)
+    {
+        uint32_t num_extents = map->num_extents;
+        uint32_t num_blocks = 0 == num_extents ? 0 : map->extents[num_extents-1].lblk + map->extents[num_extents-1].count;
+        pthread_mutex_unlock(&fs->emap_lock);
+        return num_blocks;
+    }
+    pthread_mutex_unlock(&fs->emap_lock);
+    a1fs_extent *last = etree_last(inode, fs);
+    return NULL == last ? 0 : last->lblk + last->count;
 }
 
 /**
- * Compute the number of consecutive free blocks starting at start
- * 
- * @param  start      the index (relative to the group) to start checking for free blocks
- * @param  fs         a pointer to the context
- * @
+ * Count the blocks of a range of an inode which are in holes (not in any extent)
+ *
+ * @param  inode     a pointer to the inode
+ * @param  first     the index of the first block of the range
+ * @param  last      the index of the block after the range
+ * @param  fs        a pointer to the context
+ * @return           the number of blocks
 */
-int tail_length(uint32_t start, fs_ctx *fs)
+static uint32_t hole_blocks(a1fs_inode *inode, uint32_t first, uint32_t last, fs_ctx *fs)
 {
-    int len =  0;
-    for(uint32_t i = start; i < fs->superblock->num_tot_dblocks; i++)
+    uint32_t holes = last - first;
+    etree_cursor cursor;
+    for(a1fs_extent *extent = etree_seek(&cursor, inode, first, fs); NULL != extent && extent->lblk < last;
+        extent = etree_next(&cursor, fs))
     {
-        if (0 != (fs->d_bitmap[i / 8] & (1 << (i % 8)))) return len;
-        len++;   
+        holes -= Min(extent->lblk + extent->count, last) - Max(extent->lblk, first);
     }
-    return len;
+    return holes;
 }
 
 /**
- * Update the last extent of an inode 
- * @param  inode     a pointer to the ionode
- * @param  start     the start of the extent. Should be the same as the original last extent's start
- * @param  count     the total number of blocks in the extent. Both old and new
+ * Compute the number of data blocks needed to write size bytes to an inode at an offset
+ *
+ * @param  inode     a pointer to the inode
+ * @param  offset    the offset of the write
+ * @param  size      the number of bytes to write
  * @param  fs        a pointer to the context
+ * @return           the number of blocks to allocate
 */
-void update_last_extent(a1fs_inode *inode, int start, int count, fs_ctx *fs)
+static uint32_t blocks_to_write(a1fs_inode *inode, uint64_t offset, uint64_t size, fs_ctx *fs)
 {
-    a1fs_extent *extent;
+    if(inode->flags & A1FS_INODE_INLINE)
+    { // The contents move to a block once they don't fit in the inode
+        if(offset + size <= A1FS_INLINE_DATA_MAX) return 0;
+        uint64_t contents = Ceil(inode->size, A1FS_BLOCK_SIZE), first = Max(offset / A1FS_BLOCK_SIZE, contents);
+        uint64_t last = Ceil(offset + size, A1FS_BLOCK_SIZE);
+        return contents + (last > first ? last - first : 0);
+    }
+    // The blocks already allocated in the range (e.g. the last block of the file, or blocks
+    // preallocated past the end) are used, only the holes need new ones
+    if(0 == size) return 0;
+    return hole_blocks(inode, offset / A1FS_BLOCK_SIZE, Ceil(offset + size, A1FS_BLOCK_SIZE), fs);
+}
 
-    // Mark the bitmap (This is done first so we can call allocate if a new inidrect block is needed)
-    for(int b = start; b < start+count; b++){
-        int byte = b/8;
-        int bit = b % 8;
-        fs->d_bitmap[byte] = fs->d_bitmap[byte] | (1 << bit);
+/**
+ * Set the number of speculatively preallocated blocks of an inode, keeping the total up to date
+*/
+static void set_prealloc_blocks(a1fs_inode *inode, uint32_t blocks, fs_ctx *fs)
+{
+    AtomicAdd(&fs->prealloc_blocks, blocks - inode->prealloc_blocks);
+    inode->prealloc_blocks = blocks;
+}
+
+void trim_prealloc(a1fs_inode *inode, fs_ctx *fs)
+{
+    if(0 == inode->prealloc_blocks) return;
+    // The preallocated blocks are the last ones, but some of them may hold data by now
+    uint32_t num_blocks = allocated_blocks(inode, fs);
+    free_blocks_from(inode, Max(num_blocks - inode->prealloc_blocks, (uint32_t)Ceil(inode->size, A1FS_BLOCK_SIZE)), fs);
+    set_prealloc_blocks(inode, 0, fs);
+}
+
+/**
+ * Free the preallocated blocks of all the inodes, when the file system is running out of space.
+ *  The inodes which are locked (including the caller's) are skipped, and so are the ones with delayed
+ *  allocation buffers, whose reservations count on the preallocated blocks.
+*/
+static void trim_all_prealloc(fs_ctx *fs)
+{
+    uint32_t num_inodes = fs->superblock->num_inodes;
+    for(uint32_t i = bitmap_find_next_set(fs->i_bitmap, num_inodes, 0); i < num_inodes && 0 != AtomicLoad(&fs->prealloc_blocks);
+        i = bitmap_find_next_set(fs->i_bitmap, num_inodes, i + 1))
+    {
+        if(!fs_trylock_inode(fs, i)) continue;
+        pthread_mutex_lock(&fs->delalloc_lock);
+        bool pending = NULL != delalloc_get(&fs->delalloc, i);
+        pthread_mutex_unlock(&fs->delalloc_lock);
+        // Orphans have no preallocated blocks, and their extents belong to the reclaimer
+        if(!pending && 0 != fs->inode_table[i].links) trim_prealloc(&fs->inode_table[i], fs);
+        fs_unlock_inode(fs, i);
     }
+}
+
+/**
+ * Count the data blocks an orphan will give back, including the nodes of its extent tree
+*/
+static uint32_t orphan_blocks(a1fs_inode *inode, fs_ctx *fs)
+{
+    if(inode->flags & A1FS_INODE_INLINE) return 0;
+    return inode->num_blocks + etree_node_blocks(inode, fs);
+}
 
-    // We need to allocate a new indirect block
-    if(inode->num_extents == A1FS_NUM_DIRECT_EXTENT+1)
+/**
+ * Free the data blocks of an orphan, with reclaim_lock held
+*/
+static void free_orphan_blocks(a1fs_inode *inode, fs_ctx *fs)
+{
+    uint32_t blocks = orphan_blocks(inode, fs);
+    if(0 == blocks) return;
+    free_blocks_from(inode, 0, fs);
+    AtomicSub(&fs->pending_free_blocks, blocks);
+}
+
+/**
+ * Free the data blocks of all the orphans. Their inodes stay on the orphan list until the reclaimer
+ *  can take ns_lock, see reclaim_orphan_inodes(). Called when an allocation runs out of space.
+*/
+static void reclaim_orphan_blocks(fs_ctx *fs)
+{
+    if(0 == AtomicLoad(&fs->pending_free_blocks)) return;
+    pthread_mutex_lock(&fs->reclaim_lock);
+    for(a1fs_ino_t ino = fs->superblock->orphan_head; 0 != ino; ino = fs->inode_table[ino].next_orphan)
     {
-        a1fs_tuple indirect_block;
-        // Find a free block and mark the bitmap
-        first_free_sequence(1, &indirect_block, fs);
-        fs->d_bitmap[indirect_block.start / 8] = fs->d_bitmap[indirect_block.start / 8] | (1 << (indirect_block.start % 8));
+        free_orphan_blocks(&fs->inode_table[ino], fs);
+    }
+    pthread_mutex_unlock(&fs->reclaim_lock);
+}
+
+/**
+ * Mark an inode as free, with ns_lock held for writing
+*/
+static void free_inode(a1fs_ino_t ino, fs_ctx *fs)
+{
+    fs_group *group = &fs->groups[inode_group(ino, fs)];
+    AtomicAdd(&fs->superblock->num_free_inodes, 1);
+    group->desc->num_free_inodes++;
+    bitmap_clear_range(fs->i_bitmap, ino, 1);
+    fs->inode_table[ino].generation++;
+    if(ino - group->desc->first_inode < group->inode_cursor) group->inode_cursor = ino - group->desc->first_inode;
+}
 
-        if(VERBOSE) print_data_block_bitmap("Indirect Block Alocation Complete", fs);
-        fs->superblock->num_free_dblocks -= 1;
-        inode->indirect_extent_blk = indirect_block.start;
+/**
+ * Free all the orphans (their data blocks and then their inodes), with ns_lock held for writing
+*/
+static void reclaim_orphan_inodes(fs_ctx *fs)
+{
+    pthread_mutex_lock(&fs->reclaim_lock);
+    while(0 != fs->superblock->orphan_head)
+    {
+        a1fs_ino_t ino = fs->superblock->orphan_head;
+        a1fs_inode *inode = &fs->inode_table[ino];
+        free_orphan_blocks(inode, fs);
+        // Off the list before it is freed, so the inode is never on the list once it is reused
+        fs->superblock->orphan_head = inode->next_orphan;
+        inode->next_orphan = 0;
+        AtomicSub(&fs->num_orphans, 1);
+        free_inode(ino, fs);
     }
-    extent = get_extent(inode, inode->num_extents-1, fs);
+    pthread_mutex_unlock(&fs->reclaim_lock);
+}
 
-    // Update the inode and the extent's content
-    extent->start = start;
-    // Only decrement the new count from the superblock free dblocks count
-    int count_additional_blocks = count;
-    if (0 != extent->count) count_additional_blocks = count - extent->count;
-    extent->count = count;
+/**
+ * Put an unlinked inode on the orphan list, for the reclaimer to free. The list is in the image, so
+ *  the orphans of a file system which isn't unmounted cleanly are freed on the next mount. FUSE renames
+ *  a file which is still open instead of unlinking it (unless mounted with hard_remove), so nothing else
+ *  uses an orphan.
+*/
+static void add_orphan(a1fs_ino_t ino, fs_ctx *fs)
+{
+    a1fs_inode *inode = &fs->inode_table[ino];
+    pthread_mutex_lock(&fs->reclaim_lock);
+    AtomicAdd(&fs->pending_free_blocks, orphan_blocks(inode, fs));
+    AtomicAdd(&fs->num_orphans, 1);
+    inode->next_orphan = fs->superblock->orphan_head;
+    fs->superblock->orphan_head = ino;
+    pthread_cond_signal(&fs->reclaim_cond);
+    pthread_mutex_unlock(&fs->reclaim_lock);
+}
 
-    fs->superblock->num_free_dblocks -= count_additional_blocks;
+/**
+ * The reclaimer thread, which frees the orphans until it is stopped. The data blocks are freed without
+ *  holding ns_lock, so the other operations carry on meanwhile.
+*/
+static void *reclaimer_main(void *arg)
+{
+    fs_ctx *fs = arg;
+    pthread_mutex_lock(&fs->reclaim_lock);
+    while(true)
+    {
+        while(0 == fs->superblock->orphan_head && !fs->reclaimer_stop)
+        {
+            pthread_cond_wait(&fs->reclaim_cond, &fs->reclaim_lock);
+        }
+        // Exit once all the orphans are freed
+        if(0 == fs->superblock->orphan_head) break;
+        pthread_mutex_unlock(&fs->reclaim_lock);
+
+        reclaim_orphan_blocks(fs);
+        pthread_rwlock_wrlock(&fs->ns_lock);
+        reclaim_orphan_inodes(fs);
+        pthread_rwlock_unlock(&fs->ns_lock);
+        pthread_mutex_lock(&fs->reclaim_lock);
+    }
+    pthread_mutex_unlock(&fs->reclaim_lock);
+    return NULL;
 }
 
-int allocate_data_blocks(a1fs_inode *inode, uint64_t size, fs_ctx *fs)
+int start_reclaimer(fs_ctx *fs)
 {
-    // We need to fill the last block before we start allocating new ones, to prevent holes
-    // So if the last block is not full, we'll use that before allocating new memory
-    if(0 != inode->size % A1FS_BLOCK_SIZE)
+    // The orphans left by the last mount are freed first
+    pthread_mutex_lock(&fs->reclaim_lock);
+    for(a1fs_ino_t ino = fs->superblock->orphan_head; 0 != ino; ino = fs->inode_table[ino].next_orphan)
     {
-        size -= (inode->size % A1FS_BLOCK_SIZE);
+        AtomicAdd(&fs->pending_free_blocks, orphan_blocks(&fs->inode_table[ino], fs));
+        AtomicAdd(&fs->num_orphans, 1);
     }
-    // The number of blocks needed to allocate
-    uint32_t blks_needed = Ceil(size, A1FS_BLOCK_SIZE);
-    
-    if(0 == blks_needed) return 0;
+    pthread_mutex_unlock(&fs->reclaim_lock);
 
-    // Make sure there is enough space for the needed blocks
-    if(fs->superblock->num_free_dblocks < blks_needed) return -ENOSPC;
+    fs->reclaimer_stop = false;
+    int ret = pthread_create(&fs->reclaimer, NULL, reclaimer_main, fs);
+    if(0 != ret) return -ret;
+    fs->reclaimer_running = true;
+    return 0;
+}
 
-    int remainder = blks_needed;
-    // Try and extend the last extent before allocating more blocks
-    if(0 != inode->num_extents) 
+void stop_reclaimer(fs_ctx *fs)
+{
+    if(!fs->reclaimer_running) return;
+    pthread_mutex_lock(&fs->reclaim_lock);
+    fs->reclaimer_stop = true;
+    pthread_cond_signal(&fs->reclaim_cond);
+    pthread_mutex_unlock(&fs->reclaim_lock);
+    pthread_join(fs->reclaimer, NULL);
+    fs->reclaimer_running = false;
+}
+
+/**
+ * Compute the size of the speculative preallocation for an append which needs new blocks. The
+ *  window grows with the file (it is the next power of 2 of the new number of blocks), so a file which
+ *  keeps growing needs a logarithmic number of allocations. It is capped, and only uses a fraction of
+ *  the free space, so it shrinks as the file system fills up.
+ *
+ * @param  inode     a pointer to the inode
+ * @param  needed    the number of blocks the append needs
+ * @param  fs        a pointer to the context
+ * @return           the number of blocks to allocate past the needed ones
+*/
+static uint32_t prealloc_window(a1fs_inode *inode, uint32_t needed, fs_ctx *fs)
+{
+    if(!S_ISREG(inode->mode)) return 0;
+    uint32_t num_blocks = inode->num_blocks + needed;
+
+    uint32_t window = PREALLOC_MIN_BLOCKS;
+    while(window < num_blocks && window < PREALLOC_MAX_BLOCKS) window *= 2;
+    // The needed blocks are already claimed, so they are counted as reserved
+    // It only sizes the window, so the count without the per-CPU deltas is close enough
+    uint32_t free_blocks = pcounter_read(&fs->free_dblocks);
+    uint32_t reserved = AtomicLoad(&fs->delalloc.reserved_blocks);
+    uint32_t available = free_blocks > reserved ? free_blocks - reserved : 0;
+    return Min(window, available / PREALLOC_FREE_FRACTION);
+}
+
+/**
+ * Claim free blocks for an allocation, see delalloc_claim()
+ *
+ * @param  blocks    the number of blocks to claim
+ * @param  claimed   a pointer to the number of blocks claimed so far, which is increased
+ * @param  fs        a pointer to the context
+ * @return           true on success; false if there aren't enough free blocks which aren't reserved
+*/
+static bool claim_blocks(uint32_t blocks, uint32_t *claimed, fs_ctx *fs)
+{
+    if(!delalloc_claim(&fs->delalloc, blocks, &fs->free_dblocks)) return false;
+    *claimed += blocks;
+    return true;
+}
+
+/**
+ * Release the claim on blocks which have been allocated (and so are no longer free)
+*/
+static void release_claimed(uint32_t blocks, uint32_t *claimed, fs_ctx *fs)
+{
+    blocks = Min(blocks, *claimed);
+    delalloc_release(&fs->delalloc, blocks);
+    *claimed -= blocks;
+}
+
+uint32_t alloc_data_run(uint32_t wanted, const a1fs_extent *prev, uint32_t goal, a1fs_blk_t *start, fs_ctx *fs)
+{
+    uint32_t claimed = 0, count = 0;
+    if(!claim_blocks(wanted, &claimed, fs)) return 0;
+    if(NULL != prev)
+    {
+        *start = prev->start + prev->count;
+        count = alloc_tail(*start, wanted, fs);
+        // Part of the blocks is worth less than a sequence which may hold all of them
+        if(count < wanted && 0 != count) free_block_range(*start, count, fs);
+        if(count < wanted) count = 0;
+    }
+    if(0 == count)
+    {
+        a1fs_tuple seq;
+        alloc_free_sequence(wanted, &seq, goal, fs);
+        if(seq.start >= 0)
+        {
+            *start = seq.start;
+            count = seq.end - seq.start + 1;
+        }
+    }
+    release_claimed(claimed, &claimed, fs);
+    return count;
+}
+
+/**
+ * Allocate the blocks of the extent tree nodes an insert splits, one at a time (a single block fits in
+ *  the smallest free sequence). They are claimed if the caller's claim doesn't cover them along with
+ *  the blocks it still needs (e.g. the claim of a delayed allocation made before the tree grew).
+ *
+ * @param  num_nodes  the number of blocks, from etree_insert_blocks()
+ * @param  keep       the number of claimed blocks the caller needs for data
+ * @param  node_blks  the array in which to put the blocks
+ * @param  goal       the group to search first
+ * @param  claimed    a pointer to the number of blocks claimed by the caller, which is updated
+ * @param  fs         a pointer to the context
+ * @return            true on success; false if there is no space
+*/
+static bool alloc_node_blocks(uint32_t num_nodes, uint32_t keep, a1fs_blk_t *node_blks, uint32_t goal,
+                              uint32_t *claimed, fs_ctx *fs)
+{
+    if(*claimed < keep + num_nodes && !claim_blocks(keep + num_nodes - *claimed, claimed, fs)) return false;
+    a1fs_tuple seq;
+    for(uint32_t i = 0; i < num_nodes; i++)
+    {
+        alloc_free_sequence(1, &seq, goal, fs);
+        if(seq.start < 0)
+        {
+            for(uint32_t j = 0; j < i; j++) free_block_range(node_blks[j], 1, fs);
+            return false;
+        }
+        release_claimed(1, claimed, fs);
+        node_blks[i] = seq.start;
+    }
+    return true;
+}
+
+/**
+ * Keep the extent map of an inode (if it is cached) in sync with an extent which grew or was just added
+*/
+static void update_extent_map(a1fs_inode *inode, a1fs_extent *extent, fs_ctx *fs)
+{
+    if(etree_last(inode, fs) == extent) update_last_extent(inode, extent, fs);
+    else invalidate_extent_map(inode, fs);
+}
+
+/**
+ * Add a new extent to an inode in a hole: allocate the best fitting free sequence (or the longest one),
+ *  and the blocks of the extent tree nodes adding it splits
+ *
+ * @param  inode      a pointer to the inode
+ * @param  lblk       the logical block of the new extent
+ * @param  wanted     the number of blocks wanted, which must fit in the hole
+ * @param  unwritten  whether the new extent is unwritten
+ * @param  goal       the group to search first
+ * @param  claimed    a pointer to the number of blocks claimed by the caller, which is updated
+ * @param  fs         a pointer to the context
+ * @return            the number of blocks in the new extent; 0 if there is no space
+*/
+static uint32_t insert_extent(a1fs_inode *inode, uint32_t lblk, uint32_t wanted, bool unwritten, uint32_t goal,
+                              uint32_t *claimed, fs_ctx *fs)
+{
+    // The nodes are allocated first, so the extent can take the rest of the claim
+    a1fs_blk_t node_blks[A1FS_ETREE_MAX_DEPTH + 1];
+    uint32_t num_nodes = etree_insert_blocks(inode, lblk, fs);
+    if(!alloc_node_blocks(num_nodes, wanted, node_blks, goal, claimed, fs)) return 0;
+
+    a1fs_tuple seq;
+    alloc_free_sequence(wanted, &seq, goal, fs);
+    if(seq.start < 0)
+    {
+        for(uint32_t i = 0; i < num_nodes; i++) free_block_range(node_blks[i], 1, fs);
+        return 0;
+    }
+    a1fs_extent extent = { lblk, seq.start, seq.end - seq.start + 1, unwritten };
+    release_claimed(extent.count, claimed, fs);
+    etree_insert(inode, &extent, node_blks, fs);
+    inode->num_blocks += extent.count;
+    update_extent_map(inode, get_extent(inode, lblk, fs), fs);
+    return extent.count;
+}
+
+/**
+ * Allocate the holes of a range of blocks of an inode. The extent before a hole grows into it if the
+ *  blocks after the extent are free, otherwise new extents are added, from the best fitting free
+ *  sequences.
+ *
+ * @param  inode      a pointer to the inode
+ * @param  first      the index of the first block of the range
+ * @param  last       the index of the block after the range
+ * @param  extra      a pointer to the number of speculative blocks to allocate past the range, if the
+ *                     range ends in a hole past the last extent. Set to the number allocated
+ * @param  unwritten  whether the new blocks are unwritten
+ * @param  claimed    a pointer to the number of blocks claimed by the caller, which is updated
+ * @param  fs         a pointer to the context
+ * @return            0 on success; -ENOSPC if not all the holes could be allocated
+*/
+static int fill_holes(a1fs_inode *inode, uint32_t first, uint32_t last, uint32_t *extra, bool unwritten,
+                      uint32_t *claimed, fs_ctx *fs)
+{
+    // New extents go in the group of the inode, or the group the file's blocks have moved on to
+    uint32_t goal = inode_group(inode - fs->inode_table, fs);
+    uint32_t lblk = first;
+    while(true)
     {
-        a1fs_extent *last_extent = get_extent(inode, inode->num_extents-1, fs);
-        // The number of free blocks  after the end of the last extent, which could be expanded into
-        uint32_t room_for_growth = tail_length(last_extent->start+last_extent->count, fs);
+        // Skip the extents up to the next hole
+        etree_cursor cursor;
+        a1fs_extent *next = etree_seek(&cursor, inode, lblk, fs);
+        while(NULL != next && next->lblk <= lblk)
+        {
+            lblk = next->lblk + next->count;
+            next = etree_next(&cursor, fs);
+        }
+        if(lblk >= last)
+        {
+            *extra = 0;
+            return 0;
+        }
+        // The hole ends at the next extent, the speculative blocks go in the hole after the last one
+        uint32_t optional = NULL == next ? *extra : 0;
+        uint32_t remainder = (NULL == next ? last : Min(next->lblk, last)) - lblk + optional;
 
-        a1fs_tuple extention;
-        extention.start = last_extent->start+last_extent->count; // Start right after the end of the original extent
-        if(0 != room_for_growth)
+        // Try and extend the extent before the hole before allocating more blocks
+        a1fs_extent *prev = 0 != lblk ? get_extent(inode, lblk - 1, fs) : NULL;
+        if(NULL != prev)
         {
-            if(room_for_growth >= blks_needed){
-                extention.end = extention.start+blks_needed-1;
-            }else{
-                remainder = blks_needed - room_for_growth;
-                extention.end = extention.start+blks_needed-remainder-1;
+            goal = block_group(prev->start, fs);
+            // Expand into the free blocks after the end of the extent
+            uint32_t extention = prev->unwritten == unwritten ? alloc_tail(prev->start + prev->count, remainder, fs) : 0;
+            if(0 != extention)
+            {
+                release_claimed(extention, claimed, fs);
+                prev->count += extention;
+                inode->num_blocks += extention;
+                update_extent_map(inode, prev, fs);
+                remainder -= extention;
+                lblk += extention;
             }
-            update_last_extent(inode, last_extent->start, extention.end-last_extent->start+1, fs);
+        }
+        while(0 < remainder)
+        {
+            // Once the needed blocks are allocated, fewer speculative ones will do
+            bool have_needed = remainder <= optional;
+            uint32_t count = insert_extent(inode, lblk, remainder, unwritten, goal, claimed, fs);
+            if(0 == count)
+            {
+                if(have_needed) break;
+                *extra = 0;
+                return -ENOSPC;
+            }
+            remainder -= count;
+            lblk += count;
+        }
+        if(NULL == next)
+        {
+            *extra = optional - remainder;
+            return 0;
         }
     }
-    a1fs_tuple new_extent_info;
-    while (0 < remainder)
+}
+
+/**
+ * Split an extent of an inode in two at a block, allocating the blocks of the tree nodes the insert of
+ *  the second half splits
+ *
+ * @param  inode     a pointer to the inode
+ * @param  lblk      the block at which the second half starts, within the extent (but not its first)
+ * @param  claimed   a pointer to the number of blocks claimed by the caller, which is updated
+ * @param  fs        a pointer to the context
+ * @return           true on success; false if there is no space for the nodes
+*/
+static bool split_extent(a1fs_inode *inode, uint32_t lblk, uint32_t *claimed, fs_ctx *fs)
+{
+    a1fs_extent *extent = get_extent(inode, lblk, fs);
+    a1fs_blk_t node_blks[A1FS_ETREE_MAX_DEPTH + 1];
+    uint32_t num_nodes = etree_insert_blocks(inode, lblk, fs);
+    if(!alloc_node_blocks(num_nodes, 0, node_blks, block_group(extent->start, fs), claimed, fs)) return false;
+
+    // The insert can move the extent, so it is shrunk first
+    uint32_t offset = lblk - extent->lblk;
+    a1fs_extent second = { lblk, extent->start + offset, extent->count - offset, extent->unwritten };
+    extent->count = offset;
+    etree_insert(inode, &second, node_blks, fs);
+    return true;
+}
+
+/**
+ * Mark the blocks of a range of an inode which are in unwritten extents as written, splitting the
+ *  extents at the ends of the range. The blocks at the start of an unwritten extent join the extent
+ *  before it instead, if it is written and physically contiguous, so writes which fill an unwritten
+ *  extent in order keep growing one written extent.
+ *
+ * @param  inode     a pointer to the inode
+ * @param  first     the index of the first block of the range
+ * @param  last      the index of the block after the range
+ * @param  claimed   a pointer to the number of blocks claimed by the caller, which is updated
+ * @param  fs        a pointer to the context
+ * @return           0 on success; -ENOSPC if there is no space for the nodes of a split
+*/
+static int convert_unwritten(a1fs_inode *inode, uint32_t first, uint32_t last, uint32_t *claimed, fs_ctx *fs)
+{
+    int ret = 0;
+    bool changed = false;
+    uint32_t lblk = first;
+    while(lblk < last)
     {
-        // Find the longest free sequence
-        first_free_sequence(remainder, &new_extent_info, fs);
-        remainder = remainder - (new_extent_info.end-new_extent_info.start+1);
-        // Mark the new extent.
-        // Note: We assume that we never need more than 512 extents
-        if(512 == inode->num_extents) return -ENOSPC;
-        inode->num_extents++;
-        
-        update_last_extent(inode, new_extent_info.start, new_extent_info.end-new_extent_info.start+1, fs);
+        etree_cursor cursor;
+        a1fs_extent *extent = etree_seek(&cursor, inode, lblk, fs);
+        if(NULL == extent || extent->lblk >= last) break;
+        uint32_t start = Max(extent->lblk, lblk), end = Min(extent->lblk + extent->count, last);
+        if(!extent->unwritten)
+        {
+            lblk = end;
+            continue;
+        }
+        changed = true;
+
+        a1fs_extent *prev = start == extent->lblk && 0 != start ? get_extent(inode, start - 1, fs) : NULL;
+        if(NULL != prev && !prev->unwritten && prev->start + prev->count == extent->start &&
+           end < extent->lblk + extent->count)
+        { // Give the blocks to the extent before
+            prev->count += end - start;
+            etree_shift_start(&cursor, end - start);
+        }else if(start != extent->lblk)
+        { // The blocks before the range stay unwritten, the rest is handled once it is an extent of its own
+            if(!split_extent(inode, start, claimed, fs))
+            {
+                ret = -ENOSPC;
+                break;
+            }
+            continue;
+        }else if(end != extent->lblk + extent->count)
+        {
+            if(!split_extent(inode, end, claimed, fs))
+            {
+                ret = -ENOSPC;
+                break;
+            }
+            continue;
+        }else
+        {
+            extent->unwritten = 0;
+        }
+        lblk = end;
+    }
+    // The extents were moved or split, the map is rebuilt on the next access
+    if(changed) invalidate_extent_map(inode, fs);
+    return ret;
+}
+
+/**
+ * Check whether a block of an inode reads as zeros: it is in a hole or an unwritten extent
+*/
+static bool reads_as_zeros(a1fs_inode *inode, uint32_t lblk, fs_ctx *fs)
+{
+    a1fs_extent *extent = get_extent(inode, lblk, fs);
+    return NULL == extent || extent->unwritten;
+}
+
+/**
+ * Allocate the data blocks needed to write a range of bytes of an inode, and speculative extra blocks
+ *  past them if the range ends past the last extent. The blocks are claimed before they are allocated,
+ *  so other threads can't allocate them in the meantime.
+ *
+ * @param  inode        a pointer to the inode
+ * @param  offset       the offset of the range
+ * @param  size         the number of bytes in the range
+ * @param  speculative  whether to preallocate a window of blocks past the needed ones
+ * @param  unwritten    whether the new blocks are unwritten. Otherwise the unwritten blocks in the range
+ *                       become written, and the parts of the first and last blocks outside the range are
+ *                       zeroed if they read as zeros
+ * @param  claimed      a pointer to the number of blocks the caller claimed for the allocation. Updated
+ *                       as blocks are claimed and allocated, the caller releases the rest
+ * @param  fs           a pointer to the context
+ * @return              0 on sucsess, -errno of failure
+*/
+static int allocate_claimed(a1fs_inode *inode, uint64_t offset, uint64_t size, bool speculative, bool unwritten,
+                            uint32_t *claimed, fs_ctx *fs)
+{
+    if(inode->flags & A1FS_INODE_INLINE)
+    {
+        // Nothing to allocate while the contents fit in the inode
+        if(offset + size <= A1FS_INLINE_DATA_MAX) return 0;
+        int ret;
+        if(0 != (ret = inode_uninline(inode, fs))) return ret;
+    }
+    if(0 == size) return 0;
+    uint32_t first = offset / A1FS_BLOCK_SIZE, last = Ceil(offset + size, A1FS_BLOCK_SIZE);
+
+    // The preallocated blocks hold stale data, which must not become part of the file without being
+    // written. Unwritten blocks don't use them. The ones the new data goes into are no longer speculative
+    if(unwritten)
+    {
+        trim_prealloc(inode, fs);
+    }else if(0 != inode->prealloc_blocks)
+    {
+        uint32_t num_blocks = allocated_blocks(inode, fs);
+        uint64_t used = Max((uint64_t)last, Ceil(inode->size, A1FS_BLOCK_SIZE));
+        set_prealloc_blocks(inode, used < num_blocks ? Min(inode->prealloc_blocks, num_blocks - used) : 0, fs);
+    }
+
+    // The first and last blocks are only partly written, the rest of them is zeroed if it isn't data
+    uint32_t head = offset % A1FS_BLOCK_SIZE, tail = (offset + size) % A1FS_BLOCK_SIZE;
+    bool zero_head = !unwritten && 0 != head && reads_as_zeros(inode, first, fs);
+    bool zero_tail = !unwritten && 0 != tail && reads_as_zeros(inode, last - 1, fs);
+
+    // The number of blocks needed to allocate
+    uint32_t blks_needed = hole_blocks(inode, first, last, fs);
+    if(0 != blks_needed)
+    {
+        // Claim the needed blocks (and the blocks of the tree nodes the new extents may need, if each
+        // block was an extent), without using the blocks reserved for delayed allocation. The blocks
+        // preallocated for other files are given up first, and the orphans' blocks are freed without
+        // waiting for the reclaimer
+        uint32_t claim = blks_needed + etree_append_blocks(inode, blks_needed, fs);
+        if(claim > *claimed && !claim_blocks(claim - *claimed, claimed, fs))
+        {
+            trim_all_prealloc(fs);
+            reclaim_orphan_blocks(fs);
+            if(!claim_blocks(claim - *claimed, claimed, fs)) return -ENOSPC;
+        }
+
+        // The preallocated blocks are requested along with the needed ones, so they are in the same extent.
+        // They go past the end of the file, and past the last extent
+        uint32_t blks_extra = 0;
+        if(speculative && last >= Ceil(inode->size, A1FS_BLOCK_SIZE) && last > allocated_blocks(inode, fs))
+        {
+            blks_extra = Min(prealloc_window(inode, blks_needed, fs), UINT32_MAX - last);
+            if(0 != blks_extra && !claim_blocks(blks_extra, claimed, fs)) blks_extra = 0;
+        }
+        int ret = fill_holes(inode, first, last, &blks_extra, unwritten, claimed, fs);
+        if(0 != blks_extra) set_prealloc_blocks(inode, inode->prealloc_blocks + blks_extra, fs);
+        if(0 != ret) return ret;
+        if(VERBOSE) print_data_block_bitmap("Alocation Complete", fs);
+    }
+    if(unwritten) return 0;
+
+    int ret = convert_unwritten(inode, first, last, claimed, fs);
+    if(0 != ret) return ret;
+    if(zero_head) memset(get_data_block(inode, first, fs), 0, head);
+    if(zero_tail) memset((char *)get_data_block(inode, last - 1, fs) + tail, 0, A1FS_BLOCK_SIZE - tail);
+    return 0;
+}
+
+/**
+ * Allocate blocks for an inode, see allocate_claimed(). The claim is released whether or not it is used
+*/
+static int allocate_blocks(a1fs_inode *inode, uint64_t offset, uint64_t size, bool speculative, bool unwritten,
+                           uint32_t claimed, fs_ctx *fs)
+{
+    int ret = allocate_claimed(inode, offset, size, speculative, unwritten, &claimed, fs);
+    delalloc_release(&fs->delalloc, claimed);
+    return ret;
+}
+
+int allocate_data_blocks(a1fs_inode *inode, uint64_t size, fs_ctx *fs)
+{
+    return allocate_blocks(inode, inode->size, size, false, false, 0, fs);
+}
+
+int write_data_blocks(a1fs_inode *inode, uint64_t offset, uint64_t size, fs_ctx *fs)
+{
+    return allocate_blocks(inode, offset, size, true, false, 0, fs);
+}
+
+int allocate_unwritten(a1fs_inode *inode, uint64_t offset, uint64_t size, fs_ctx *fs)
+{
+    return allocate_blocks(inode, offset, size, false, true, 0, fs);
+}
+
+int extend_inode(a1fs_inode *inode, uint64_t size, fs_ctx *fs)
+{
+    if(inode->flags & A1FS_INODE_INLINE)
+    { // The end of the contents is zeroed when they shrink
+        int ret;
+        if(size > A1FS_INLINE_DATA_MAX && 0 != (ret = inode_uninline(inode, fs))) return ret;
+        inode->size = size;
+        return 0;
+    }
+    // The preallocated blocks hold stale data, and the last block may too (past the end it had when the
+    // file was shrunk). The rest of the new range is in holes or unwritten extents
+    trim_prealloc(inode, fs);
+    uint64_t block_end = Ceil(inode->size, A1FS_BLOCK_SIZE) * A1FS_BLOCK_SIZE;
+    if(block_end > inode->size)
+    {
+        copy_between_buf_and_fs(inode, NULL, Min(size, block_end) - inode->size, inode->size, true, NULL, fs);
+    }
+    inode->size = size;
+    return 0;
+}
+
+int punch_hole(a1fs_inode *inode, uint64_t offset, uint64_t size, a1fs_extent_hint *hint, fs_ctx *fs)
+{
+    uint64_t end = offset + size;
+    uint32_t first = Ceil(offset, A1FS_BLOCK_SIZE), last = end / A1FS_BLOCK_SIZE;
+    // Zero the parts of the blocks at the edges of the range which hold data (the rest of the file
+    // past its size reads as zeros already)
+    if(first > last || (inode->flags & A1FS_INODE_INLINE))
+    {
+        if(offset < inode->size) copy_between_buf_and_fs(inode, NULL, Min(end, inode->size) - offset, offset, true, hint, fs);
+        return 0;
+    }
+    uint64_t head_end = (uint64_t)first * A1FS_BLOCK_SIZE, tail_start = (uint64_t)last * A1FS_BLOCK_SIZE;
+    if(offset < Min(head_end, inode->size))
+        copy_between_buf_and_fs(inode, NULL, Min(head_end, inode->size) - offset, offset, true, hint, fs);
+    if(tail_start < Min(end, inode->size))
+        copy_between_buf_and_fs(inode, NULL, Min(end, inode->size) - tail_start, tail_start, true, hint, fs);
+    if(first == last) return 0;
+
+    // The preallocated blocks are only kept at the end of the blocks, past the size
+    if(last > Ceil(inode->size, A1FS_BLOCK_SIZE)) trim_prealloc(inode, fs);
+    if(last >= allocated_blocks(inode, fs))
+    {
+        free_blocks_from(inode, first, fs);
+        return 0;
     }
-    if(VERBOSE) print_data_block_bitmap("Alocation Complete", fs);
+
+    // Split the extents at the ends of the range, so it is made of whole extents
+    int ret = 0;
+    uint32_t claimed = 0;
+    uint32_t ends[] = { last, first };
+    for(int i = 0; i < 2 && 0 == ret; i++)
+    {
+        a1fs_extent *extent = get_extent(inode, ends[i], fs);
+        if(NULL != extent && extent->lblk != ends[i] && !split_extent(inode, ends[i], &claimed, fs)) ret = -ENOSPC;
+    }
+    release_claimed(claimed, &claimed, fs);
+    if(0 != ret)
+    {
+        invalidate_extent_map(inode, fs);
+        return ret;
+    }
+
+    etree_cursor cursor;
+    for(a1fs_extent *extent = etree_seek(&cursor, inode, first, fs); NULL != extent && extent->lblk < last;
+        extent = etree_seek(&cursor, inode, first, fs))
+    {
+        free_block_range(extent->start, extent->count, fs);
+        inode->num_blocks -= extent->count;
+        etree_remove(inode, &cursor, fs);
+    }
+    invalidate_extent_map(inode, fs);
     return 0;
 }
 
+void free_blocks_from(a1fs_inode *inode, uint32_t first, fs_ctx *fs)
+{
+    if(inode->flags & A1FS_INODE_INLINE) return;
+    uint32_t lblk = allocated_blocks(inode, fs);
+    // One range per extent, and the tree nodes which are left empty
+    inode->num_blocks -= etree_truncate(inode, first, fs);
+    invalidate_extent_map(inode, fs);
+
+    // Only the preallocated blocks before the first freed one are left
+    if(first < lblk && 0 != inode->prealloc_blocks)
+    {
+        uint32_t prealloc_start = lblk - inode->prealloc_blocks;
+        set_prealloc_blocks(inode, first > prealloc_start ? first - prealloc_start : 0, fs);
+    }
+}
+
 int add_dir_entry(const char *unmodified_path, mode_t mode, uint32_t links, fs_ctx *fs)
 {
     char path[A1FS_PATH_MAX];
 	strncpy(path, unmodified_path, A1FS_PATH_MAX);
 
+	// The inodes of orphans are free once their blocks are, which can't wait for the reclaimer
+	if (0 == fs->superblock->num_free_inodes) reclaim_orphan_inodes(fs);
 	if (0 == fs->superblock->num_free_inodes) return -ENOSPC;
 
 	// Find the last slash, the following string is the new directory name
 	char * file_name = strrchr(path, '/')+1;
-    if(strlen(file_name) > A1FS_NAME_MAX) return -ENAMETOOLONG;
+    if(strlen(file_name) >= A1FS_NAME_MAX) return -ENAMETOOLONG;
 
 	// The first part of the path is the path to the parent inode 
 	char *parent_path;
@@ -304,43 +1298,33 @@ int add_dir_entry(const char *unmodified_path, mode_t mode, uint32_t links, fs_c
 		parent_path = "/";
 	}
 		
-	a1fs_inode *par_inode = &fs->inode_table[path_lookup(parent_path, fs)]; 
+	a1fs_ino_t par_ino = path_lookup(parent_path, fs);
+	a1fs_inode *par_inode = &fs->inode_table[par_ino]; 
+
+	// Add the entry to the parent before initializing the inode, since there may be no room for it
+	int ret = find_empty_inode(par_ino, mode, fs);
+	if(ret < 0) return -ENOSPC;
+	a1fs_ino_t ino = ret;
+	if(0 != (ret = dir_insert(par_inode, file_name, ino, fs))) return ret;
+	// Other threads may look at the inode while it is initialized (see trim_all_prealloc())
+	fs_lock_inode(fs, ino, true);
+	init_inode(ino, mode, links, fs->image);
+	if(fs->superblock->features & A1FS_FEATURE_INLINE_DATA)
+	{ // The contents start out in the inode
+		if(S_ISDIR(mode)) dir_make_inline(&fs->inode_table[ino]);
+		else
+		{ // Past the end, the contents read as zeros if the file is extended
+			fs->inode_table[ino].flags |= A1FS_INODE_INLINE;
+			memset(fs->inode_table[ino].inline_data, 0, A1FS_INLINE_DATA_MAX);
+		}
+	}
+	fs_unlock_inode(fs, ino);
+	// Replace any negative entries for the new file
+	dcache_insert(&fs->dcache, par_ino, file_name, ino);
+	dcache_insert(&fs->dcache, DCACHE_PATH_PARENT, unmodified_path, ino);
 
 	// If the new file is a directory, it has a link to the parent
 	if(S_ISDIR(mode)) par_inode->links++;
-
-    a1fs_block_iterator b_iter;
-    block_iterator_init(par_inode, &b_iter, fs);
-
-	a1fs_dentry *cur_entry;
-    void *cur_blk;
-    // Iterate over the inodes data blocks
-    while(NULL != (cur_blk = block_iterator_next_blk(&b_iter, fs))){
-        // Iterate over the NUM_DENTRY_PER_BLOCK dir_entries in a block
-        for(uint32_t d_ind = 0; d_ind < NUM_DENTRY_PER_BLOCK; d_ind++)
-        {
-            cur_entry = (a1fs_dentry *) (cur_blk + d_ind * sizeof(a1fs_dentry));
-            // Check for an empty a1fs_dentry
-            if('\0' == *cur_entry->name)
-            {
-                strncpy(cur_entry->name, file_name, A1FS_NAME_MAX);
-                cur_entry->ino = find_empty_inode(fs);
-                init_inode(cur_entry->ino, mode, links, fs->image);
-                return 0;
-            }
-        }
-    }
-	
-    // There was no room in any of the allocated blocks for the entry, so a new block is needed
-	if (0 != allocate_data_blocks(par_inode, A1FS_BLOCK_SIZE, fs)) return -ENOSPC;
-    par_inode->size += A1FS_BLOCK_SIZE;
-
-    // Get the last block of the last extent
-	a1fs_extent *cur_extent = get_extent(par_inode, par_inode->num_extents-1, fs);
-	cur_entry  = (a1fs_dentry *)(fs->data_blks + (cur_extent->start + cur_extent->count - 1) * A1FS_BLOCK_SIZE);
-	strncpy(cur_entry->name, file_name, A1FS_NAME_MAX);
-	cur_entry->ino = find_empty_inode(fs);
-	init_inode(cur_entry->ino, mode, links, fs->image);
 	return 0;
 }
 
@@ -360,8 +1344,14 @@ void remove_dir_entry(const char *unmodified_path, fs_ctx *fs)
 		parent_path = "/";
 	}
 		
-	a1fs_inode *par_inode = &fs->inode_table[path_lookup(parent_path, fs)];
-    a1fs_inode *inode     = &fs->inode_table[path_lookup(unmodified_path, fs)];
+	a1fs_ino_t par_ino    = path_lookup(parent_path, fs);
+	a1fs_inode *par_inode = &fs->inode_table[par_ino];
+    a1fs_ino_t ino        = path_lookup(unmodified_path, fs);
+    a1fs_inode *inode     = &fs->inode_table[ino];
+
+    // The name no longer exists
+    dcache_insert_negative(&fs->dcache, par_ino, file_name);
+    dcache_insert_negative(&fs->dcache, DCACHE_PATH_PARENT, unmodified_path);
 
 	if(S_ISDIR(inode->mode)) // If the file is a directory
     {
@@ -371,117 +1361,279 @@ void remove_dir_entry(const char *unmodified_path, fs_ctx *fs)
     inode->links--; // Remove the link from the parent to the file
 
 
-    a1fs_block_iterator b_iter;
-    block_iterator_init(par_inode, &b_iter, fs);
-
-	a1fs_dentry *cur_entry;
-    void *cur_blk;
-    // Iterate over the inodes data blocks
-    while(NULL != (cur_blk = block_iterator_next_blk(&b_iter, fs))){
-        // Iterate over the NUM_DENTRY_PER_BLOCK dir_entries in a block
-        for(uint32_t d_ind = 0; d_ind < NUM_DENTRY_PER_BLOCK; d_ind++)
-        {
-            cur_entry = (a1fs_dentry *) (cur_blk + d_ind * sizeof(a1fs_dentry));
-            // Check for file_name
-            if(0 == strcmp(cur_entry->name, file_name))
-            {
-                *cur_entry->name = '\0';
-            }
-        }
-    }
+    // Remove the file from its parent's directory entires
+    dir_delete(par_inode, file_name, fs);
 
     if(0 == inode->links)
     { // The inode is now unallocated so mark unallocate its data blocks
-        fs->superblock->num_free_inodes++;
-        
-        block_iterator_init(par_inode, &b_iter, fs);
+        // Any data which is yet to be written is discarded
+        pthread_mutex_lock(&fs->delalloc_lock);
+        da_buf *pending = delalloc_get(&fs->delalloc, ino);
+        if(NULL != pending) delalloc_remove(&fs->delalloc, pending);
+        pthread_mutex_unlock(&fs->delalloc_lock);
+        set_prealloc_blocks(inode, 0, fs);
 
-        a1fs_extent *cur_extent;
-        // Deallocate the data blocks
-        // Iterate over the inodes data blocks
-        for(uint32_t i = 0; i < inode->num_extents; i++)
-        {
-            cur_extent = get_extent(inode, i, fs);
-            for(uint32_t b = cur_extent->start; b < cur_extent->start+cur_extent->count; b++){
-                fs->d_bitmap[b/8] = fs->d_bitmap[b/8] & ~(1 << (b % 8));
-                fs->superblock->num_free_dblocks += cur_extent->count;
+        if(fs->reclaimer_running && S_ISREG(inode->mode) && 0 != inode->num_extents)
+        { // The blocks of a file are freed in the background, so a large unlink returns right away
+            add_orphan(ino, fs);
+            return;
+        }
+        free_inode(ino, fs);
+        if(S_ISDIR(inode->mode) && !(inode->flags & A1FS_INODE_INLINE))
+        { // The tags of a directory block are no longer valid once it is freed
+            etree_cursor cursor;
+            for(a1fs_extent *cur_extent = etree_seek(&cursor, inode, 0, fs); NULL != cur_extent; cur_extent = etree_next(&cursor, fs))
+            {
+                for(a1fs_blk_t b = cur_extent->start; b < cur_extent->start+cur_extent->count; b++) dtags_drop(&fs->dtags, b);
             }
         }
+        // Deallocate the data blocks, one range per extent, and the nodes of the extent tree
+        free_blocks_from(inode, 0, fs);
         if (VERBOSE) print_data_block_bitmap("Dealocation Complete", fs);
     }
 }
 
 void block_iterator_init(a1fs_inode *inode, a1fs_block_iterator *b_iter, fs_ctx *fs)
 {
+    (void)fs;
     b_iter->inode = inode;
-    if (0 != inode->num_extents)
+    b_iter->lblk = 0;
+    b_iter->run = NULL;
+    b_iter->run_blks = 0;
+    b_iter->hint.index = 0;
+}
+
+void *block_iterator_next_blk(a1fs_block_iterator *b_iter, fs_ctx *fs)
+{   
+    // Once the run of contiguous blocks is done, look up the extent holding the next block
+    if(0 == b_iter->run_blks)
     {
-        b_iter->cur_extent = get_extent(inode, 0, fs);
-    }else
+        b_iter->run = get_data_run(b_iter->inode, b_iter->lblk, &b_iter->hint, &b_iter->run_blks, NULL, fs);
+        // If we're past the last extent return NULL since there are no blocks left (a directory has no holes)
+        if(NULL == b_iter->run)
+        {
+            b_iter->run_blks = 0;
+            return NULL;
+        }
+    }
+
+    // Get the block and then move on to the next one
+    void *ptr = b_iter->run;
+    b_iter->run += A1FS_BLOCK_SIZE;
+    b_iter->run_blks--;
+    b_iter->lblk++;
+    return ptr;
+}
+
+int copy_between_buf_and_fs(a1fs_inode *inode, char *buf, size_t size, off_t offset, bool to_fs,
+                            a1fs_extent_hint *hint, fs_ctx *fs)
+{
+    // Nothing is read past the end of the file
+    if(!to_fs) size = (uint64_t)offset < inode->size ? Min(size, inode->size - offset) : 0;
+    if(inode->flags & A1FS_INODE_INLINE)
     {
-        b_iter->cur_extent = NULL;
+        if(offset >= (off_t)A1FS_INLINE_DATA_MAX) return 0;
+        size = Min(size, A1FS_INLINE_DATA_MAX - offset);
+        if(to_fs && NULL == buf) memset(inode->inline_data + offset, 0, size);
+        else if(to_fs) memcpy(inode->inline_data + offset, buf, size);
+        else memcpy(buf, inode->inline_data + offset, size);
+        return size;
     }
-    b_iter->extent_index = 0;
-    b_iter->blk_in_extent_index = 0;
+
+    size_t bytes_copied = 0;
+    a1fs_extent_hint local_hint = { 0 };
+    if(NULL == hint) hint = &local_hint;
+    // Copy one run of contiguous blocks (the part of the range within an extent, or a hole) at a time.
+    // The extent is looked up under the emap lock, but the data is copied without it
+    while(bytes_copied < size)
+    {
+        uint64_t pos = offset + bytes_copied;
+        uint64_t run_blks;
+        bool unwritten;
+        char *cur_blk = get_data_run(inode, pos / A1FS_BLOCK_SIZE, hint, &run_blks, &unwritten, fs);
+        if(0 == run_blks)
+        { // Past the last extent, the rest of the file is a hole
+            if(to_fs) break;
+            memset(buf + bytes_copied, 0, size - bytes_copied);
+            bytes_copied = size;
+            break;
+        }
+        size_t offset_within_blk = pos % A1FS_BLOCK_SIZE;
+        size_t bytes_in_run = Min(run_blks * A1FS_BLOCK_SIZE - offset_within_blk, size - bytes_copied);
+        if(NULL == cur_blk || unwritten)
+        { // Holes and unwritten extents read as zeros. The caller allocates the blocks before writing
+            if(to_fs && NULL != buf) break;
+            if(!to_fs) memset(buf + bytes_copied, 0, bytes_in_run);
+        }else if(to_fs && NULL == buf)
+        { // Zero the range in place
+            memset(cur_blk + offset_within_blk, 0, bytes_in_run);
+        }else if(to_fs)
+        { // Write from buf to the file system (write)
+            memcpy(cur_blk + offset_within_blk, buf + bytes_copied, bytes_in_run);
+        }else
+        { // Write from the file system to the buf (read)
+            memcpy(buf + bytes_copied, cur_blk + offset_within_blk, bytes_in_run);
+        }
+        bytes_copied += bytes_in_run;
+    }
+    return bytes_copied;
 }
 
-void *block_iterator_next_blk(a1fs_block_iterator *b_iter, fs_ctx *fs)
-{   
-    // If there are no allocated extents
-    if(NULL == b_iter->cur_extent) return NULL;
+/**
+ * Get the delayed allocation buffer of an inode
+ *
+ * @param  create    whether to add an empty buffer if the inode has none
+ * @return           the buffer; NULL if there is none (or it can't be allocated)
+*/
+static da_buf *get_pending(a1fs_ino_t ino, bool create, fs_ctx *fs)
+{
+    pthread_mutex_lock(&fs->delalloc_lock);
+    da_buf *pending = create ? delalloc_get_or_create(&fs->delalloc, ino) : delalloc_get(&fs->delalloc, ino);
+    pthread_mutex_unlock(&fs->delalloc_lock);
+    return pending;
+}
 
-    // blk_in_extent_index is equal to the count then the extent is done, and we should go to the next one
-    if(b_iter->blk_in_extent_index == b_iter->cur_extent->count){
-        
-        // If we're past the last extent return NULL since there are no blocks left
-        b_iter->extent_index++;
-        if(b_iter->extent_index == b_iter->inode->num_extents) return NULL;
-        
-        // Otherwise set current extent to the next extent and reset blk_in_extent_index to 0
-        b_iter->cur_extent = get_extent(b_iter->inode, b_iter->extent_index, fs);
-        b_iter->blk_in_extent_index = 0;
+/**
+ * Remove the delayed allocation buffer of an inode
+*/
+static void remove_pending(da_buf *pending, fs_ctx *fs)
+{
+    pthread_mutex_lock(&fs->delalloc_lock);
+    delalloc_remove(&fs->delalloc, pending);
+    pthread_mutex_unlock(&fs->delalloc_lock);
+}
+
+int flush_inode(a1fs_ino_t ino, fs_ctx *fs)
+{
+    da_buf *pending = get_pending(ino, false, fs);
+    if(NULL == pending) return 0;
+
+    // Allocate the blocks for all the pending data at once, using the blocks which were reserved for it
+    a1fs_inode *inode = &fs->inode_table[ino];
+    uint64_t offset = inode->size;
+    uint32_t claimed = pending->reserved;
+    pending->reserved = 0; // The reservation becomes the allocation's claim
+    int ret = allocate_blocks(inode, offset, pending->len, true, false, claimed, fs);
+    if(0 == ret)
+    {
+        inode->size += pending->len;
+        copy_between_buf_and_fs(inode, pending->data, pending->len, offset, true, NULL, fs);
     }
+    remove_pending(pending, fs);
+    return ret;
+}
 
-    // Get the value of the block and then increment the blk_in_extent_index
-    void *ptr = fs->data_blks + (b_iter->cur_extent->start + b_iter->blk_in_extent_index) * A1FS_BLOCK_SIZE;
-    b_iter->blk_in_extent_index++;
-    return ptr;
+int flush_all_inodes(fs_ctx *fs)
+{
+    int ret = 0;
+    uint32_t num_inodes = fs->superblock->num_inodes;
+    for(uint32_t i = bitmap_find_next_set(fs->i_bitmap, num_inodes, 0); i < num_inodes;
+        i = bitmap_find_next_set(fs->i_bitmap, num_inodes, i + 1))
+    {
+        // The inodes which are locked (including the caller's) are left to the threads using them
+        if(!fs_trylock_inode(fs, i)) continue;
+        int err = flush_inode(i, fs);
+        fs_unlock_inode(fs, i);
+        if(0 == ret) ret = err;
+    }
+    return ret;
 }
 
-int copy_between_buf_and_fs(a1fs_inode *inode, char *buf, size_t size, off_t offset, bool to_fs, fs_ctx *fs)
+int buffered_write(a1fs_ino_t ino, const char *buf, size_t size, off_t offset, a1fs_extent_hint *hint, fs_ctx *fs)
 {
-    a1fs_block_iterator b_iter;
-    block_iterator_init(inode, &b_iter, fs);
+    a1fs_inode *inode = &fs->inode_table[ino];
+    da_buf *pending = get_pending(ino, true, fs);
+    if(NULL == pending) return -ENOMEM;
 
-    void *cur_blk;
-    off_t cur_offset = 0;
-    off_t offset_within_blk;
-    size_t bytes_written_so_far = 0;
+    // A write past the end of the file leaves a hole, which isn't buffered: the pending data is written
+    // out, and the file is extended to the start of the write
+    int ret;
+    if((uint64_t)offset > inode->size + pending->len)
+    {
+        if(0 == (ret = flush_inode(ino, fs))) ret = extend_inode(inode, offset, fs);
+        if(0 != ret) return ret;
+        if(NULL == (pending = get_pending(ino, true, fs))) return -ENOMEM;
+    }
+    // The part of the write before the end of the inode's data isn't buffered, its blocks are allocated
+    // now if it is in a hole
+    if((uint64_t)offset < inode->size && 0 != (ret = write_data_blocks(inode, offset, Min(size, inode->size - offset), fs)))
+    {
+        flush_inode(ino, fs);
+        return ret;
+    }
 
+    // The buffer holds the data from the end of the inode's data to the end of the file
+    uint64_t end = offset + size;
+    uint64_t len = end > inode->size ? Max(pending->len, end - inode->size) : pending->len;
 
-    // Iterate over the inode's data blocks and check that size is not 0, meaning all the bytes have been written
-    while(NULL != (cur_blk = block_iterator_next_blk(&b_iter, fs)) && size != 0)
+    // Write out all the buffers if they would use too much memory
+    pthread_mutex_lock(&fs->delalloc_lock);
+    bool too_big = fs->delalloc.total_bytes + (len - pending->len) > DELALLOC_MAX_BYTES;
+    pthread_mutex_unlock(&fs->delalloc_lock);
+    if(too_big)
     {
-        if(cur_offset - offset <= A1FS_BLOCK_SIZE)
-        {
-            // We are in a block we want to write.read into/from (Either from the start or from an offset within the block)
-            offset_within_blk = offset > cur_offset ? (offset - cur_offset) : 0;
-
-            size_t bytes_to_write_in_blk = Min(A1FS_BLOCK_SIZE, size);
-            if(to_fs)
-            { // Write from buf to the file system (write)
-                memcpy(cur_blk+offset_within_blk, buf+bytes_written_so_far, bytes_to_write_in_blk);
-            }else
-            { // Write from the file system to the buf (read)
-                memcpy(buf+bytes_written_so_far, cur_blk+offset_within_blk, bytes_to_write_in_blk);
-            }
-            
-            size -= bytes_to_write_in_blk;
-            bytes_written_so_far += bytes_to_write_in_blk;
-        }
-        cur_offset += A1FS_BLOCK_SIZE; 
+        // The inode's own buffer is skipped by flush_all_inodes() if the caller has it locked
+        if(0 == (ret = flush_all_inodes(fs))) ret = flush_inode(ino, fs);
+        if(0 != ret) return ret;
+        if(NULL == (pending = get_pending(ino, true, fs))) return -ENOMEM;
+        len = end > inode->size ? end - inode->size : 0;
+    }
+
+    // Reserve the blocks the buffer will need, including the tree nodes the new extents may need (an
+    // inline inode has no tree yet, it gets one the size of the data). The blocks added to the
+    // reservation are claimed, so no other allocation can take them
+    uint32_t reserve = blocks_to_write(inode, inode->size, len, fs);
+    if(inode->flags & A1FS_INODE_INLINE) reserve += Ceil(reserve, ETREE_BLOCK_EXTENTS);
+    else if(0 != reserve) reserve += etree_append_blocks(inode, reserve, fs);
+    uint32_t claim = reserve > pending->reserved ? reserve - pending->reserved : 0;
+    bool reserved = 0 == claim || delalloc_claim(&fs->delalloc, claim, &fs->free_dblocks);
+    if(reserved)
+    {
+        pthread_mutex_lock(&fs->delalloc_lock);
+        reserved = delalloc_grow(&fs->delalloc, pending, len);
+        pthread_mutex_unlock(&fs->delalloc_lock);
+        if(reserved) delalloc_reserve(&fs->delalloc, pending, reserve);
+        else delalloc_release(&fs->delalloc, claim);
+    }
+    if(!reserved)
+    {
+        ret = flush_inode(ino, fs);
+        return 0 != ret ? ret : -ENOSPC;
+    }
+
+    // The part of the write before the end of the inode's data goes straight to its blocks (the ones
+    // flushed above are allocated too)
+    if((uint64_t)offset < inode->size)
+    {
+        copy_between_buf_and_fs(inode, (char *)buf, Min(size, inode->size - offset), offset, true, hint, fs);
+    }
+    if(offset + size > inode->size)
+    {
+        uint64_t start = Max((uint64_t)offset, inode->size);
+        memcpy(pending->data + (start - inode->size), buf + (start - offset), offset + size - start);
+    }
+    return size;
+}
+
+int buffered_read(a1fs_ino_t ino, char *buf, size_t size, off_t offset, a1fs_extent_hint *hint, fs_ctx *fs)
+{
+    a1fs_inode *inode = &fs->inode_table[ino];
+    da_buf *pending = get_pending(ino, false, fs);
+    if(NULL == pending) return copy_between_buf_and_fs(inode, buf, size, offset, false, hint, fs);
+
+    int bytes_read = 0;
+    if((uint64_t)offset < inode->size)
+    {
+        bytes_read = copy_between_buf_and_fs(inode, buf, Min(size, inode->size - offset), offset, false, hint, fs);
+    }
+    uint64_t end = Min(offset + size, inode->size + pending->len);
+    if(end > inode->size && (uint64_t)offset < end)
+    {
+        uint64_t start = Max((uint64_t)offset, inode->size);
+        memcpy(buf + (start - offset), pending->data + (start - inode->size), end - start);
+        bytes_read = end - offset;
     }
-    return bytes_written_so_far;
+    return bytes_read;
 }
 
 void print_data_block_bitmap(const char *msg, fs_ctx *fs)
@@ -489,7 +1641,7 @@ void print_data_block_bitmap(const char *msg, fs_ctx *fs)
     printf("-----%s----\n", msg);
     for(uint32_t i = 0; i < fs->superblock->num_tot_dblocks; i++)
     {
-        printf("%d",0 != (fs->d_bitmap[i / 8] & (1 << (i % 8))));
+        printf("%d", bitmap_test(fs->d_bitmap, i));
     }
     printf("\n----------------\n");
 }
\ No newline at end of file
@@ -6,6 +6,15 @@
 
 #pragma once
 
+/** The smallest speculative preallocation window (64 KiB). */
+#define PREALLOC_MIN_BLOCKS 16
+
+/** The largest speculative preallocation window (8 MiB). */
+#define PREALLOC_MAX_BLOCKS 2048
+
+/** A preallocation window uses at most this fraction (1/n) of the free blocks. */
+#define PREALLOC_FREE_FRACTION 8
+
 /**
  * Initialize an inode. 
  * 
@@ -21,13 +30,34 @@
 bool init_inode(a1fs_ino_t index, mode_t mode, uint32_t links, void* image);
 
 /**
- * Find the first unused inode in the inode index
+ * Compute the allocation group of a data block
+ *
+ * @param  blk         the index of the data block
+ * @param  fs          a pointer to the context
+ * @return             the group number
+*/
+uint32_t block_group(a1fs_blk_t blk, fs_ctx *fs);
+
+/**
+ * Compute the allocation group of an inode
+ *
+ * @param  ino         the inode number
+ * @param  fs          a pointer to the context
+ * @return             the group number
+*/
+uint32_t inode_group(a1fs_ino_t ino, fs_ctx *fs);
+
+/**
+ * Find an unused inode for a new file or directory. A file's inode is in its parent's group, if it has
+ *  a free inode, and a directory's is in a group with plenty of free inodes and data blocks. Each group's
+ *  slice of the inode bitmap is searched from its inode cursor.
  * 
- * @param  superblock  a pointer to the super block
+ * @param  parent      the inode number of the parent directory
+ * @param  mode        the mode of the new inode
  * @param  fs          a pointer to the context
- * @return             the inode number of the first unused inode; -1 on failure
+ * @return             the inode number of the unused inode; -1 on failure
 */
-int find_empty_inode(fs_ctx *fs);
+int find_empty_inode(a1fs_ino_t parent, mode_t mode, fs_ctx *fs);
 
 /** 
  * Lookup the inode number assosiated with a path
@@ -42,18 +72,71 @@ int find_empty_inode(fs_ctx *fs);
 int path_lookup(const char *path, fs_ctx *fs);
 
 /**
- * Get a pointer to the extent at index in the inode
+ * Get a pointer to the extent holding a block of the inode, found in its extent tree
+ * 
+ * @param  inode      a pointer to the inode
+ * @param  lblk       the index of the block within the inode's data blocks
+ * @param  fs         a pointer to the context
+ * @return            a pointer to the extent; NULL if no extent holds the block (it is in a hole)
+*/
+a1fs_extent *get_extent(a1fs_inode *inode, uint32_t lblk, fs_ctx *fs);
+
+/**
+ * Remembers the extent of the last block accessed through a file handle, so the next access to a
+ * block of the same extent doesn't need to search the extent map.
+*/
+typedef struct a1fs_extent_hint {
+    uint32_t index; // The index of the extent
+} a1fs_extent_hint;
+
+/**
+ * Get a pointer to a data block of an inode
+ * 
+ * @param  inode      a pointer to the inode
+ * @param  index      the index of the block within the inode's data blocks
+ * @param  fs         a pointer to the context
+ * @return            a pointer to the start of the block; NULL if no extent holds the block (it is in a hole)
+*/
+void *get_data_block(a1fs_inode *inode, uint32_t index, fs_ctx *fs);
+
+/**
+ * Get a pointer to a data block of an inode, using the extent of the hint if it holds the block or
+ * otherwise a binary search of the inode's extent map, and update the hint to the extent holding the
+ * block.
  * 
  * @param  inode      a pointer to the inode
- * @param  index      the index of the extent
+ * @param  index      the index of the block within the inode's data blocks
+ * @param  hint       a pointer to the hint; may be NULL
  * @param  fs         a pointer to the context
- * @return            a pointer to the indexth extent of the inode
+ * @return            a pointer to the start of the block; NULL if no extent holds the block (it is in a hole)
 */
-a1fs_extent *get_extent(a1fs_inode *inode, int index, fs_ctx *fs);
+void *get_data_block_hint(a1fs_inode *inode, uint32_t index, a1fs_extent_hint *hint, fs_ctx *fs);
+
+/**
+ * Forget the cached extent map of an inode, which must be done whenever its extents are removed or
+ * shrunk (appending blocks keeps the map up to date).
+ *
+ * @param  inode      a pointer to the inode
+ * @param  fs         a pointer to the context
+*/
+void invalidate_extent_map(a1fs_inode *inode, fs_ctx *fs);
+
+/**
+ * Compute the number of blocks of an inode up to the end of its last extent. This may be more than its
+ * size needs, if blocks were preallocated past the end of the file, and more than the number of data
+ * blocks it has (inode->num_blocks), if it has holes.
+ *
+ * @param  inode     a pointer to the inode
+ * @param  fs        a pointer to the context
+ * @return           the logical block after the last extent
+*/
+uint32_t allocated_blocks(a1fs_inode *inode, fs_ctx *fs);
 
 /**
  * Allocate the data blocks needed to write size bytes to the d-blocks 
- * for the inode.
+ * for the inode, past its end. The contents of an inline inode are moved
+ * to a data block once they no longer fit in the inode. Blocks already
+ * allocated past the end of the file (e.g. by fallocate) are used first.
  * 
  * Errors:
  *   ENOSPC  not enough free space in the file system.
@@ -65,6 +148,129 @@ a1fs_extent *get_extent(a1fs_inode *inode, int index, fs_ctx *fs);
 */
 int allocate_data_blocks(a1fs_inode *inode, uint64_t size, fs_ctx *fs);
 
+/**
+ * Make a range of a file ready to be written: allocate blocks for the holes in the range, and mark
+ * the unwritten blocks in it as written. The parts of the first and last blocks outside the range
+ * are zeroed if they read as zeros before. The blocks a regular file needs past its last extent are
+ * allocated together with a speculative window of blocks past them (which grows with the file), so
+ * the following appends use blocks in the same extent instead of competing with other files for the
+ * blocks after it. The window is recorded in inode->prealloc_blocks, and freed by trim_prealloc().
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param inode      the inode which will have data written
+ * @param offset     the offset of the range
+ * @param size       the number of bytes in the range
+ * @param fs         a pointer to the context
+ * @return           0 on sucsess, -errno of failure
+*/
+int write_data_blocks(a1fs_inode *inode, uint64_t offset, uint64_t size, fs_ctx *fs);
+
+/**
+ * Allocate blocks for the holes in a range of a file as unwritten extents, which read as zeros
+ * without being zeroed (see fallocate()). The blocks already in the range are left as they are.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space in the file system.
+ *
+ * @param inode      the inode
+ * @param offset     the offset of the range
+ * @param size       the number of bytes in the range
+ * @param fs         a pointer to the context
+ * @return           0 on sucsess, -errno of failure
+*/
+int allocate_unwritten(a1fs_inode *inode, uint64_t offset, uint64_t size, fs_ctx *fs);
+
+/**
+ * Extend a file without allocating any blocks, the new range is a hole (or the unwritten extents
+ * already past the end). The end of the last block, and any preallocated blocks, are stale data, so
+ * the first is zeroed and the others are freed. An inline file whose size outgrows the inode moves
+ * its contents to a block.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space to move inline contents to a block.
+ *
+ * @param inode      the inode, which has no delayed allocation buffer
+ * @param size       the new size, larger than the current one
+ * @param fs         a pointer to the context
+ * @return           0 on sucsess, -errno of failure
+*/
+int extend_inode(a1fs_inode *inode, uint64_t size, fs_ctx *fs);
+
+/**
+ * Free the speculatively preallocated blocks of an inode which hold no data.
+ *
+ * @param inode      a pointer to the inode
+ * @param fs         a pointer to the context
+*/
+void trim_prealloc(a1fs_inode *inode, fs_ctx *fs);
+
+/**
+ * Punch a hole in a range of a file: the blocks the range covers whole are freed (the extents are
+ * split at the ends of the range, the ones within it are removed), and the parts of the blocks at
+ * its edges are zeroed. The size doesn't change.
+ *
+ * Errors:
+ *   ENOSPC  not enough free space for the extent tree nodes splitting an extent needs.
+ *
+ * @param inode      the inode, which has no delayed allocation buffer
+ * @param offset     the start of the range
+ * @param size       the length of the range
+ * @param hint       the extent hint of the handle; may be NULL
+ * @param fs         a pointer to the context
+ * @return           0 on success, -errno on failure
+*/
+int punch_hole(a1fs_inode *inode, uint64_t offset, uint64_t size, a1fs_extent_hint *hint, fs_ctx *fs);
+
+/**
+ * Free the data blocks of an inode from a block (the index within the file)
+ * to the end, including the extent tree nodes which are no longer needed. Each
+ * extent is freed as one range.
+ *
+ * @param inode      the inode
+ * @param first      the index of the first block to free
+ * @param fs         a pointer to the context
+*/
+void free_blocks_from(a1fs_inode *inode, uint32_t first, fs_ctx *fs);
+
+/**
+ * Mark a range of data blocks as allocated, in the bitmap, the free counts of the superblock and
+ * the groups, and the groups' free space indexes. All allocations must go through here so that
+ * they stay in sync.
+ *
+ * @param start      the first block of the range, which must be free
+ * @param count      the number of blocks in the range
+ * @param fs         a pointer to the context
+*/
+void alloc_block_range(a1fs_blk_t start, uint32_t count, fs_ctx *fs);
+
+/**
+ * Mark a range of data blocks as free, in the bitmap, the free counts of the superblock and the
+ * groups, and the groups' free space indexes. All frees must go through here so that they stay
+ * in sync.
+ *
+ * @param start      the first block of the range, which must be allocated
+ * @param count      the number of blocks in the range
+ * @param fs         a pointer to the context
+*/
+void free_block_range(a1fs_blk_t start, uint32_t count, fs_ctx *fs);
+
+/**
+ * Allocate a free sequence of data blocks for data which is moving (e.g. by the defragmenter): the
+ * blocks right after an extent if they are all free, so the moved blocks can join it, otherwise the
+ * best fitting free sequence. The blocks are claimed first, so the blocks reserved for delayed
+ * allocations are left alone.
+ *
+ * @param wanted     the number of blocks wanted
+ * @param prev       the extent the sequence should follow; may be NULL
+ * @param goal       the group to search first
+ * @param start      a pointer in which to put the first block of the sequence
+ * @param fs         a pointer to the context
+ * @return           the length of the sequence, which may be less than wanted; 0 if there is no space
+*/
+uint32_t alloc_data_run(uint32_t wanted, const a1fs_extent *prev, uint32_t goal, a1fs_blk_t *start, fs_ctx *fs);
+
 /**
  * An entry for the new file (Reg file or directory) to be created
  * 
@@ -86,7 +292,8 @@ int allocate_data_blocks(a1fs_inode *inode, uint64_t size, fs_ctx *fs);
 int add_dir_entry(const char *path, mode_t mode, uint32_t links, fs_ctx *fs);
 
 /** 
- * Remove a directory entry and free up the resources
+ * Remove a directory entry and free up the resources. Once the reclaimer is running, a regular file's
+ * inode and data blocks are put on the orphan list and freed in the background instead.
  * 
  * @param   unmodified_path  path to the file to create.
  * @param   fs               a pointer to the context
@@ -97,10 +304,11 @@ void remove_dir_entry(const char *unmodified_path, fs_ctx *fs);
  * A struct used to keep track of the state of the traversal of the data blocks pointed to by an inode
 */
 typedef struct a1fs_block_iterator{
-    a1fs_inode  *inode; 
-    a1fs_extent *cur_extent;          // A pointer to the current extent being travered
-    uint32_t     extent_index;        // The index of the extent within the inode
-    uint32_t     blk_in_extent_index; // The index of the block within the extent
+    a1fs_inode       *inode; 
+    uint32_t          lblk;     // The index of the next block within the inode
+    char             *run;      // The next block, within a run of contiguous blocks
+    uint64_t          run_blks; // The number of blocks left in the run
+    a1fs_extent_hint  hint;     // The extent of the run, so the next one is found without a search
 }a1fs_block_iterator;
 
 /**
@@ -121,17 +329,84 @@ void block_iterator_init(a1fs_inode *inode, a1fs_block_iterator *b_iter, fs_ctx
 void *block_iterator_next_blk(a1fs_block_iterator *b_iter, fs_ctx *fs);
 
 /**
- * Copy between a buffer and data blocks on the disk
+ * Copy between a buffer and data blocks on the disk (or the inode, for inline data). Holes and
+ * unwritten extents read as zeros, and are skipped when zeroing.
  * 
  * @param inode   a pointer to the inode whos data blocks are being accessed
- * @param buf     a buffer in the user space, which is either being read from or written to
+ * @param buf     a buffer in the user space, which is either being read from or written to.
+ *                When writing, NULL writes zeros instead. The blocks written must be allocated,
+ *                see write_data_blocks()
  * @param size    buffer size (number of bytes requested).
  * @param offset  offset from the beginning of the file to write to.
  * @param to_fs   true if we are writing to the file system from buf, false if reading from the file system into buf
+ * @param hint    the extent hint of the file handle; may be NULL
+ * @param fs      a pointer to the context
+ * @return        number of bytes copied. A read stops at the end of the file, and a write at the
+ *                first block which isn't allocated
+*/
+int copy_between_buf_and_fs(a1fs_inode *inode, char *buf, size_t size, off_t offset, bool to_fs,
+                            a1fs_extent_hint *hint, fs_ctx *fs);
+
+/**
+ * Write to a file with delayed allocation. The part of the write after the end of the inode's data is
+ * kept in the inode's buffer, so no blocks are allocated until it is flushed.
+ * If the write can't be buffered, the buffer is flushed so the write can be done immediately instead.
+ *
+ * Errors:
+ *   ENOMEM  not enough memory for the buffer.
+ *   ENOSPC  not enough free space to reserve for the buffer.
+ *
+ * @param ino     the inode number of the file
+ * @param buf     the data to write
+ * @param size    the number of bytes to write
+ * @param offset  offset from the beginning of the file to write to.
+ * @param hint    the extent hint of the file handle; may be NULL
+ * @param fs      a pointer to the context
+ * @return        number of bytes written on success; -errno on error
+*/
+int buffered_write(a1fs_ino_t ino, const char *buf, size_t size, off_t offset, a1fs_extent_hint *hint, fs_ctx *fs);
+
+/**
+ * Read from a file, including the data in its delayed allocation buffer
+ *
+ * @return        number of bytes read
+*/
+int buffered_read(a1fs_ino_t ino, char *buf, size_t size, off_t offset, a1fs_extent_hint *hint, fs_ctx *fs);
+
+/**
+ * Allocate the blocks for the delayed allocation buffer of an inode in one request, and write the
+ * buffer to them. The buffer is removed, even if the allocation fails.
+ *
+ * @param ino     the inode number
+ * @param fs      a pointer to the context
+ * @return        0 on success (or if there is no buffer); -errno on error
+*/
+int flush_inode(a1fs_ino_t ino, fs_ctx *fs);
+
+/**
+ * Flush the delayed allocation buffers of all the inodes. The inodes which are locked (including one
+ * locked by the caller) are skipped.
+ *
+ * @return        0 on success; the first error otherwise
+*/
+int flush_all_inodes(fs_ctx *fs);
+
+/**
+ * Start the reclaimer, the thread which frees the orphans (the unlinked files whose data blocks
+ * haven't been freed, see remove_dir_entry()), including any left by the last mount. Must be called
+ * after FUSE has started (it may fork), and before any operation.
+ *
+ * @param fs      a pointer to the context
+ * @return        0 on success; -errno on error
+*/
+int start_reclaimer(fs_ctx *fs);
+
+/**
+ * Stop the reclaimer, once it has freed all the orphans. Does nothing if it wasn't started.
+ *
  * @param fs      a pointer to the context
- * @return        number of bytes written
 */
-int copy_between_buf_and_fs(a1fs_inode *inode, char *buf, size_t size, off_t offset, bool to_fs, fs_ctx *fs);
+void stop_reclaimer(fs_ctx *fs);
 
 /**
  * Print out the data block bitmap
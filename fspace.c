@@ -0,0 +1,296 @@
+#include <stdlib.h>
+
+#include "bitmap.h"
+#include "fspace.h"
+
+/**
+ * Compare two free extents by the key of a tree. Keys are unique, since no two free extents start at
+ *  the same block.
+*/
+static int extent_cmp(const fspace_extent *a, const fspace_extent *b, int t)
+{
+    if(FSPACE_BY_LEN == t && a->count != b->count) return a->count < b->count ? -1 : 1;
+    if(a->start != b->start) return a->start < b->start ? -1 : 1;
+    return 0;
+}
+
+static int height(const fspace_extent *e, int t)
+{
+    return NULL == e ? 0 : e->link[t].height;
+}
+
+static void update_height(fspace_extent *e, int t)
+{
+    int l = height(e->link[t].child[0], t), r = height(e->link[t].child[1], t);
+    e->link[t].height = 1 + (l > r ? l : r);
+}
+
+/**
+ * Rotate a subtree, moving the root down to side dir and its other child up
+*/
+static fspace_extent *rotate(fspace_extent *e, int t, int dir)
+{
+    fspace_extent *up = e->link[t].child[!dir];
+    e->link[t].child[!dir] = up->link[t].child[dir];
+    up->link[t].child[dir] = e;
+    update_height(e, t);
+    update_height(up, t);
+    return up;
+}
+
+/**
+ * Restore the AVL property at the root of a subtree whose children differ in height by at most 2
+*/
+static fspace_extent *rebalance(fspace_extent *e, int t)
+{
+    update_height(e, t);
+    int balance = height(e->link[t].child[0], t) - height(e->link[t].child[1], t);
+    if(balance > 1)
+    { // Left heavy
+        fspace_extent *l = e->link[t].child[0];
+        if(height(l->link[t].child[1], t) > height(l->link[t].child[0], t))
+            e->link[t].child[0] = rotate(l, t, 0);
+        return rotate(e, t, 1);
+    }
+    if(balance < -1)
+    { // Right heavy
+        fspace_extent *r = e->link[t].child[1];
+        if(height(r->link[t].child[0], t) > height(r->link[t].child[1], t))
+            e->link[t].child[1] = rotate(r, t, 1);
+        return rotate(e, t, 0);
+    }
+    return e;
+}
+
+static fspace_extent *tree_insert(fspace_extent *root, fspace_extent *e, int t)
+{
+    if(NULL == root)
+    {
+        e->link[t].child[0] = e->link[t].child[1] = NULL;
+        e->link[t].height = 1;
+        return e;
+    }
+    int dir = extent_cmp(e, root, t) > 0;
+    root->link[t].child[dir] = tree_insert(root->link[t].child[dir], e, t);
+    return rebalance(root, t);
+}
+
+/**
+ * Unlink the smallest extent of a subtree
+*/
+static fspace_extent *tree_remove_min(fspace_extent *root, int t, fspace_extent **min)
+{
+    if(NULL == root->link[t].child[0])
+    {
+        *min = root;
+        return root->link[t].child[1];
+    }
+    root->link[t].child[0] = tree_remove_min(root->link[t].child[0], t, min);
+    return rebalance(root, t);
+}
+
+static fspace_extent *tree_remove(fspace_extent *root, fspace_extent *e, int t)
+{
+    if(NULL == root) return NULL;
+    if(root == e)
+    {
+        fspace_extent *l = e->link[t].child[0], *r = e->link[t].child[1];
+        if(NULL == l) return r;
+        if(NULL == r) return l;
+        // Replace the extent with its successor
+        fspace_extent *succ;
+        r = tree_remove_min(r, t, &succ);
+        succ->link[t].child[0] = l;
+        succ->link[t].child[1] = r;
+        return rebalance(succ, t);
+    }
+    int dir = extent_cmp(e, root, t) > 0;
+    root->link[t].child[dir] = tree_remove(root->link[t].child[dir], e, t);
+    return rebalance(root, t);
+}
+
+static void link_extent(fspace *fsp, fspace_extent *e, int t)
+{
+    fsp->root[t] = tree_insert(fsp->root[t], e, t);
+}
+
+static void unlink_extent(fspace *fsp, fspace_extent *e, int t)
+{
+    fsp->root[t] = tree_remove(fsp->root[t], e, t);
+}
+
+/**
+ * Find the free extent with the largest start which is not after block b
+*/
+static fspace_extent *find_floor(fspace *fsp, a1fs_blk_t b)
+{
+    fspace_extent *floor = NULL;
+    for(fspace_extent *e = fsp->root[FSPACE_BY_START]; NULL != e;)
+    {
+        if(e->start <= b)
+        {
+            floor = e;
+            e = e->link[FSPACE_BY_START].child[1];
+        }else
+        {
+            e = e->link[FSPACE_BY_START].child[0];
+        }
+    }
+    return floor;
+}
+
+/**
+ * Add a new free extent to both trees
+*/
+static bool add_extent(fspace *fsp, a1fs_blk_t start, uint32_t count)
+{
+    fspace_extent *e = malloc(sizeof(fspace_extent));
+    if(NULL == e) return false;
+    e->start = start;
+    e->count = count;
+    link_extent(fsp, e, FSPACE_BY_START);
+    link_extent(fsp, e, FSPACE_BY_LEN);
+    fsp->num_extents++;
+    return true;
+}
+
+bool fspace_init(fspace *fsp, const char *bitmap, uint32_t num_blocks)
+{
+    fsp->root[FSPACE_BY_START] = fsp->root[FSPACE_BY_LEN] = NULL;
+    fsp->num_extents = 0;
+    fsp->stale = false;
+
+    // Add each run of clear bits
+    for(uint32_t b = bitmap_find_next_zero(bitmap, num_blocks, 0); b < num_blocks;)
+    {
+        uint32_t end = bitmap_find_next_set(bitmap, num_blocks, b);
+        if(!add_extent(fsp, b, end - b))
+        {
+            fspace_destroy(fsp);
+            return false;
+        }
+        b = bitmap_find_next_zero(bitmap, num_blocks, end);
+    }
+    return true;
+}
+
+static void free_tree(fspace_extent *e)
+{
+    if(NULL == e) return;
+    free_tree(e->link[FSPACE_BY_START].child[0]);
+    free_tree(e->link[FSPACE_BY_START].child[1]);
+    free(e);
+}
+
+void fspace_destroy(fspace *fsp)
+{
+    free_tree(fsp->root[FSPACE_BY_START]);
+    fsp->root[FSPACE_BY_START] = fsp->root[FSPACE_BY_LEN] = NULL;
+    fsp->num_extents = 0;
+}
+
+uint32_t fspace_run_length(fspace *fsp, a1fs_blk_t start)
+{
+    fspace_extent *e = find_floor(fsp, start);
+    if(NULL == e || e->start + e->count <= start) return 0;
+    return e->start + e->count - start;
+}
+
+bool fspace_find(fspace *fsp, uint32_t needed, a1fs_blk_t *start, uint32_t *count)
+{
+    fspace_extent *fit = NULL, *longest = NULL;
+    for(fspace_extent *e = fsp->root[FSPACE_BY_LEN]; NULL != e;)
+    {
+        longest = e;
+        if(e->count >= needed)
+        { // Long enough, but there may be a shorter one which is too
+            fit = e;
+            e = e->link[FSPACE_BY_LEN].child[0];
+        }else
+        {
+            e = e->link[FSPACE_BY_LEN].child[1];
+        }
+    }
+    if(NULL == fit)
+    { // Nothing is long enough, so the search went right all the way down to the longest extent
+        if(NULL == longest) return false;
+        fit = longest;
+    }
+    *start = fit->start;
+    *count = fit->count;
+    return true;
+}
+
+void fspace_alloc(fspace *fsp, a1fs_blk_t start, uint32_t count)
+{
+    if(fsp->stale) return;
+    fspace_extent *e = find_floor(fsp, start);
+    if(NULL == e || e->start + e->count < start + count)
+    { // The range isn't free
+        fsp->stale = true;
+        return;
+    }
+    a1fs_blk_t end = e->start + e->count;
+
+    unlink_extent(fsp, e, FSPACE_BY_LEN);
+    if(start == e->start)
+    {
+        if(start + count == end)
+        { // The whole extent is used
+            unlink_extent(fsp, e, FSPACE_BY_START);
+            fsp->num_extents--;
+            free(e);
+            return;
+        }
+        // Take the front of the extent. No other extent starts before its new start, so it keeps its
+        // place in the by start tree
+        e->start = start + count;
+        e->count = end - e->start;
+        link_extent(fsp, e, FSPACE_BY_LEN);
+        return;
+    }
+
+    // Keep the part before the range, and split off the part after it
+    e->count = start - e->start;
+    link_extent(fsp, e, FSPACE_BY_LEN);
+    if(start + count < end && !add_extent(fsp, start + count, end - (start + count))) fsp->stale = true;
+}
+
+void fspace_free(fspace *fsp, a1fs_blk_t start, uint32_t count)
+{
+    if(fsp->stale) return;
+    fspace_extent *prev = find_floor(fsp, start);
+    fspace_extent *next = find_floor(fsp, start + count);
+    fspace_extent *last = find_floor(fsp, start + count - 1);
+    if((NULL != prev && prev->start + prev->count > start) || (NULL != last && last->start > start))
+    { // Some of the range is already free
+        fsp->stale = true;
+        return;
+    }
+    if(NULL != prev && prev->start + prev->count != start) prev = NULL;
+    if(NULL != next && next->start != start + count) next = NULL;
+
+    if(NULL != prev)
+    { // Grow the previous extent, absorbing the next one
+        unlink_extent(fsp, prev, FSPACE_BY_LEN);
+        prev->count += count;
+        if(NULL != next)
+        {
+            unlink_extent(fsp, next, FSPACE_BY_LEN);
+            unlink_extent(fsp, next, FSPACE_BY_START);
+            prev->count += next->count;
+            fsp->num_extents--;
+            free(next);
+        }
+        link_extent(fsp, prev, FSPACE_BY_LEN);
+    }else if(NULL != next)
+    { // Grow the next extent backwards, it keeps its place in the by start tree
+        unlink_extent(fsp, next, FSPACE_BY_LEN);
+        next->start = start;
+        next->count += count;
+        link_extent(fsp, next, FSPACE_BY_LEN);
+    }else if(!add_extent(fsp, start, count))
+    {
+        fsp->stale = true;
+    }
+}
@@ -0,0 +1,98 @@
+/**
+ * CSC369 Assignment 1 - Free space index header file.
+ *  An in-memory index of the free extents (runs of free data blocks), built from the data bitmap at
+ *  mount time. Every free extent is linked into two AVL trees: one sorted by the first block, used to
+ *  find the free space right after an extent and to merge neighbours on free, and one sorted by the
+ *  length, used to find the best fit for an allocation. Both lookups are O(log n) in the number of
+ *  free extents, instead of a scan over the whole bitmap.
+ *  The index must be kept in sync with the bitmap: every allocation and free goes through it.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "a1fs.h"
+
+/** The trees each free extent is linked into. */
+#define FSPACE_BY_START 0
+#define FSPACE_BY_LEN   1
+
+/**
+ * A run of free data blocks
+*/
+typedef struct fspace_extent {
+    a1fs_blk_t start; // The first free block
+    uint32_t   count; // The number of free blocks
+    struct {
+        struct fspace_extent *child[2]; // The left and right subtrees
+        int                   height;   // The height of the subtree rooted at this extent
+    } link[2];                          // Indexed by FSPACE_BY_START and FSPACE_BY_LEN
+} fspace_extent;
+
+/**
+ * The free space index
+*/
+typedef struct fspace {
+    fspace_extent *root[2];     // Indexed by FSPACE_BY_START and FSPACE_BY_LEN
+    uint32_t       num_extents; // The number of free extents
+    bool           stale;       // Set if an update failed, after which the index can't be used
+} fspace;
+
+/**
+ * Build the index from a data bitmap
+ *
+ * @param  fsp         a pointer to the index
+ * @param  bitmap      the data bitmap, a set bit marks an allocated block
+ * @param  num_blocks  the number of data blocks
+ * @return             true on success; false on failure (e.g. a malloc() call failed).
+*/
+bool fspace_init(fspace *fsp, const char *bitmap, uint32_t num_blocks);
+
+/**
+ * Free all the extents of the index
+ *
+ * @param  fsp  a pointer to the index
+*/
+void fspace_destroy(fspace *fsp);
+
+/**
+ * Compute the number of consecutive free blocks starting at a block
+ *
+ * @param  fsp    a pointer to the index
+ * @param  start  the first block
+ * @return        the number of free blocks, 0 if start is allocated
+*/
+uint32_t fspace_run_length(fspace *fsp, a1fs_blk_t start);
+
+/**
+ * Find the smallest free extent which can hold the needed number of blocks, and if there are none
+ *  long enough the longest free extent.
+ *
+ * @param  fsp     a pointer to the index
+ * @param  needed  the number of blocks needed
+ * @param  start   set to the first block of the extent
+ * @param  count   set to the number of blocks in the extent
+ * @return         true if an extent was found; false if there are no free blocks
+*/
+bool fspace_find(fspace *fsp, uint32_t needed, a1fs_blk_t *start, uint32_t *count);
+
+/**
+ * Remove a range of blocks from the index. The range must be free.
+ *
+ * @param  fsp    a pointer to the index
+ * @param  start  the first block of the range
+ * @param  count  the number of blocks in the range
+*/
+void fspace_alloc(fspace *fsp, a1fs_blk_t start, uint32_t count);
+
+/**
+ * Add a range of blocks to the index, merging it with the free extents on either side.
+ *  The range must be allocated.
+ *
+ * @param  fsp    a pointer to the index
+ * @param  start  the first block of the range
+ * @param  count  the number of blocks in the range
+*/
+void fspace_free(fspace *fsp, a1fs_blk_t start, uint32_t count);
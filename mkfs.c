@@ -27,6 +27,7 @@
 #include "a1fs.h"
 #include "map.h"
 #include "fs_utils.h"
+#include "dir.h"
 #include "util.h"
 
 /** Command line options. */
@@ -35,6 +36,8 @@ typedef struct mkfs_opts {
 	const char *img_path;
 	/** Number of inodes. */
 	size_t n_inodes;
+	/** Number of data blocks per allocation group. */
+	size_t group_dblocks;
 
 	/** Print help and exit. */
 	bool help;
@@ -42,6 +45,12 @@ typedef struct mkfs_opts {
 	bool force;
 	/** Zero out image contents. */
 	bool zero;
+	/** Use hash-indexed directories. */
+	bool htree;
+	/** Use variable length directory entries. */
+	bool var_dentry;
+	/** Store small files and directories in their inodes. */
+	bool inline_data;
 
 } mkfs_opts;
 
@@ -53,27 +62,36 @@ its size must be a multiple of a1fs block size - %zu bytes.\n\
 \n\
 Options:\n\
     -i num  number of inodes; required argument\n\
+    -g num  number of data blocks per allocation group, a multiple of 64\n\
+            (default %u, larger if the image needs more than %u groups)\n\
     -h      print help and exit\n\
     -f      force format - overwrite existing a1fs file system\n\
     -z      zero out image contents\n\
+    -d      index large directories with a hash tree\n\
+    -c      compact directories with variable length entries\n\
+    -n      store small files and directories inline in their inodes\n\
 ";
 
 static void print_help(FILE *f, const char *progname)
 {
-	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE);
+	fprintf(f, help_str, progname, A1FS_BLOCK_SIZE, A1FS_DEFAULT_GROUP_DBLOCKS, A1FS_MAX_GROUPS);
 }
 
 
 static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 {
 	char o;
-	while ((o = getopt(argc, argv, "i:hfvz")) != -1) {
+	while ((o = getopt(argc, argv, "i:g:hfvzdcn")) != -1) {
 		switch (o) {
 			case 'i': opts->n_inodes = strtoul(optarg, NULL, 10); break;
+			case 'g': opts->group_dblocks = strtoul(optarg, NULL, 10); break;
 
 			case 'h': opts->help  = true; return true;// skip other arguments
 			case 'f': opts->force = true; break;
 			case 'z': opts->zero  = true; break;
+			case 'd': opts->htree = true; break;
+			case 'c': opts->var_dentry = true; break;
+			case 'n': opts->inline_data = true; break;
 
 			case '?': return false;
 			default : assert(false);
@@ -90,6 +108,11 @@ static bool parse_args(int argc, char *argv[], mkfs_opts *opts)
 		fprintf(stderr, "Missing or invalid number of inodes\n");
 		return false;
 	}
+	if (opts->group_dblocks % 64 != 0 || opts->group_dblocks > UINT32_MAX) {
+		fprintf(stderr, "Invalid number of data blocks per group\n");
+		return false;
+	}
+	if (opts->group_dblocks == 0) opts->group_dblocks = A1FS_DEFAULT_GROUP_DBLOCKS;
 	return true;
 }
 
@@ -106,12 +129,15 @@ static bool a1fs_is_present(void *image)
 	// Checks that the pointers to the different blocks are correct
 	uint32_t num_total_blocks = superblock->size / A1FS_BLOCK_SIZE;
 	uint32_t num_inode_blocks = Ceil((superblock->num_inodes * sizeof(a1fs_inode)), (A1FS_BLOCK_SIZE));
-	uint32_t num_data_blocks = num_total_blocks - num_inode_blocks - 2;
+	uint32_t num_inode_bitmap_blocks = Ceil(superblock->num_inodes, 8*A1FS_BLOCK_SIZE);
+	uint32_t num_data_blocks = num_total_blocks - num_inode_blocks - num_inode_bitmap_blocks - 2;
 	uint32_t num_data_bitmap_blocks = Ceil(num_data_blocks, 8*A1FS_BLOCK_SIZE);
 
 	if(2 != superblock->data_bitmap) return false;
-	if(2+num_data_bitmap_blocks != superblock->inode_table) return false;
-	if(2+num_data_bitmap_blocks+num_inode_blocks != superblock->data_blk) return false;
+	if(2+num_data_bitmap_blocks != superblock->inode_bitmap) return false;
+	if(2+num_data_bitmap_blocks+num_inode_bitmap_blocks != superblock->inode_table) return false;
+	if(2+num_data_bitmap_blocks+num_inode_bitmap_blocks+num_inode_blocks != superblock->data_blk) return false;
+	if(0 == superblock->num_groups || A1FS_MAX_GROUPS < superblock->num_groups) return false;
 	if((2+num_data_bitmap_blocks+num_inode_blocks != superblock->data_blk+num_data_blocks)
 		*A1FS_BLOCK_SIZE != superblock->size) return false;
 	return true;
@@ -136,13 +162,16 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	// The number of inode blocks, return false if they are leq 0
 	uint32_t num_inode_blocks = Ceil((opts->n_inodes * sizeof(a1fs_inode)), (A1FS_BLOCK_SIZE));
 	if (num_inode_blocks <= 0) return false;
+	// The number of blocks needed to hold the bitmap for the inodes
+	uint32_t num_inode_bitmap_blocks = Ceil(opts->n_inodes, 8*A1FS_BLOCK_SIZE);
+	if (num_total_blocks < num_inode_blocks+num_inode_bitmap_blocks + 2) return false;
 	
 	// The number of blocks needed to hold the bitmap for the data blocks
-	uint32_t num_data_blocks        = num_total_blocks - num_inode_blocks - 2;
+	uint32_t num_data_blocks        = num_total_blocks - num_inode_blocks - num_inode_bitmap_blocks - 2;
 	uint32_t num_data_bitmap_blocks = Ceil(num_data_blocks, 8*A1FS_BLOCK_SIZE); // Since there are 8 bits to the byte
 
 	// Make sure the disk is big enough of this many inodes and the metadata blocks before it (and the reserved block 0)
-	if (num_total_blocks < num_inode_blocks+num_data_bitmap_blocks + 2) return false;
+	if (num_total_blocks < num_inode_blocks+num_inode_bitmap_blocks+num_data_bitmap_blocks + 2) return false;
 	
 
 	// Initialize block 0 as the super block
@@ -154,8 +183,34 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 	superblock->num_tot_dblocks   = num_data_blocks - num_data_bitmap_blocks;
 	superblock->num_free_dblocks  = num_data_blocks - num_data_bitmap_blocks;
 	superblock->data_bitmap       = 2;
-	superblock->inode_table       = 2+num_data_bitmap_blocks;
-	superblock->data_blk          = 2+num_data_bitmap_blocks+num_inode_blocks;
+	superblock->inode_bitmap      = 2+num_data_bitmap_blocks;
+	superblock->inode_table       = 2+num_data_bitmap_blocks+num_inode_bitmap_blocks;
+	superblock->data_blk          = 2+num_data_bitmap_blocks+num_inode_bitmap_blocks+num_inode_blocks;
+	superblock->features          = 0;
+	if (opts->htree)      superblock->features |= A1FS_FEATURE_HTREE;
+	if (opts->var_dentry) superblock->features |= A1FS_FEATURE_VAR_DENTRY;
+	if (opts->inline_data) superblock->features |= A1FS_FEATURE_INLINE_DATA;
+
+	// Divide the data blocks and inodes into groups. The groups are made larger if there would be
+	// too many of them, and start on 64 bit boundaries of the bitmaps
+	uint32_t dblocks_per_group = Max(opts->group_dblocks, Ceil(Ceil(superblock->num_tot_dblocks, A1FS_MAX_GROUPS), 64) * 64);
+	uint32_t num_groups = Max(1, Ceil(superblock->num_tot_dblocks, dblocks_per_group));
+	uint32_t inodes_per_group = Ceil(Ceil(opts->n_inodes, num_groups), 64) * 64;
+	superblock->num_groups        = num_groups;
+	superblock->dblocks_per_group = dblocks_per_group;
+	superblock->inodes_per_group  = inodes_per_group;
+	superblock->orphan_head       = 0;
+	memset(superblock->groups, 0, sizeof(superblock->groups));
+	for(uint32_t g = 0; g < num_groups; g++){
+		a1fs_group_desc *group = &superblock->groups[g];
+		group->first_dblock     = g * dblocks_per_group;
+		group->num_dblocks      = Min(dblocks_per_group, superblock->num_tot_dblocks - group->first_dblock);
+		group->num_free_dblocks = group->num_dblocks;
+		// The inodes run out before the data blocks do, so the last groups may have none
+		group->first_inode      = Min(g * inodes_per_group, opts->n_inodes);
+		group->num_inodes       = Min(inodes_per_group, opts->n_inodes - group->first_inode);
+		group->num_free_inodes  = group->num_inodes;
+	}
 	
 	// Initialize the inode table to be empty
 	for(uint32_t blk = 0; blk < num_inode_blocks; blk++){
@@ -165,16 +220,21 @@ static bool mkfs(void *image, size_t size, mkfs_opts *opts)
 			// IMPORTANT: Since all allocated inodes must have at least 1 link (parent or
 			//  in the case of root, 1 it itself) having 0 links means an inode is not allocated
 			inode->links = 0;
+			inode->generation = 0;
 		}
 	}
 
 	// Initialize the data bitmap
 	memset(image+(superblock->data_bitmap * A1FS_BLOCK_SIZE), 0, num_data_bitmap_blocks * A1FS_BLOCK_SIZE);
+	// Initialize the inode bitmap, init_inode() marks the root directory's inode
+	memset(image+(superblock->inode_bitmap * A1FS_BLOCK_SIZE), 0, num_inode_bitmap_blocks * A1FS_BLOCK_SIZE);
     
     // Initialize the root directory with index 0 and 2 links. The size and number of extents start at 0.
 	// The superblock is updated accordingly
     // NOTE: the mode of the root directory inode should be set to S_IFDIR | 0777
-	return init_inode(0, S_IFDIR | 0777, 2, image);
+	if (!init_inode(0, S_IFDIR | 0777, 2, image)) return false;
+	if (opts->inline_data) dir_make_inline((a1fs_inode *)(image + superblock->inode_table * A1FS_BLOCK_SIZE));
+	return true;
 }
 
 
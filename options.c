@@ -31,6 +31,7 @@
 static const struct fuse_opt opt_spec[] = {
 	A1FS_OPT("-h"    , help),
 	A1FS_OPT("--help", help),
+	A1FS_OPT("delalloc", delalloc),
 	FUSE_OPT_END
 };
 
@@ -38,12 +39,17 @@ static const char *help_str = "\
 Usage: %s image mountpoint [options]\n\
 \n\
 Mount a1fs image file under mount point directory. Use fusermount(1) to \n\
-unmount. Only single-threaded mount is supported; -s FUSE option is implied.\n\
+unmount. Requests are handled on multiple threads; use the -s FUSE option\n\
+for a single-threaded mount.\n\
 \n\
 general options:\n\
     -o opt,[opt...]        mount options\n\
     -h   --help            print help\n\
 \n\
+a1fs options:\n\
+    -o delalloc            allocate the blocks of writes when the file is\n\
+                           closed or synced, instead of on every write\n\
+\n\
 ";
 
 // Callback for fuse_opt_parse()
@@ -74,8 +80,10 @@ bool a1fs_opt_parse(struct fuse_args *args, a1fs_opts *opts)
 		return false;
 	}
 
-	// Only single-threaded mount is supported
-	fuse_opt_add_arg(args, "-s");
+	// Let the kernel cache failed lookups (e.g. the getattr() before every create), a1fs also caches
+	// them in its dcache. Inserted before the other arguments so it can be overridden with -o
+	fuse_opt_insert_arg(args, 1, "-onegative_timeout=1");
+
 	// Limit the size of reads and writes to 4K
 	fuse_opt_add_arg(args, "-o");
 	fuse_opt_add_arg(args, "max_read=4096");
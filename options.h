@@ -29,6 +29,8 @@ typedef struct a1fs_opts {
 	const char *img_path;
 	/** Print help and exit. FUSE option. */
 	int help;
+	/** Delay allocating the blocks of writes until the file is flushed. */
+	int delalloc;
 
 } a1fs_opts;
 
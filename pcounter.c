@@ -0,0 +1,110 @@
+#define _GNU_SOURCE // sched_getcpu()
+#include <sched.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pcounter.h"
+#include "util.h"
+
+/**
+ * The most the count can be off by. A delta can pass the batch size while it is being folded, by the
+ *  changes of the other threads on the CPU.
+*/
+static uint64_t max_error(pcounter *pc)
+{
+    return (uint64_t)pc->num_slots * PCOUNTER_BATCH * 2;
+}
+
+/**
+ * Get the delta of the CPU the thread is running on
+*/
+static pcounter_slot *cpu_slot(pcounter *pc)
+{
+    int cpu = sched_getcpu();
+    return &pc->slots[cpu < 0 ? 0 : (uint32_t)cpu & (pc->num_slots-1)];
+}
+
+/**
+ * Move a delta to the count, with the lock held. Changes made to the delta in the meantime stay in it.
+*/
+static void fold_slot(pcounter *pc, pcounter_slot *slot)
+{
+    int32_t delta = AtomicExchange(&slot->delta, 0);
+    AtomicAdd(pc->count, (uint32_t)delta);
+}
+
+bool pcounter_init(pcounter *pc, uint32_t *count)
+{
+    // A delta for each CPU (rounded up to a power of 2)
+    long num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+    uint32_t num_slots = 1;
+    while((long)num_slots < num_cpus && num_slots < PCOUNTER_MAX_SLOTS) num_slots <<= 1;
+
+    pc->slots = aligned_alloc(sizeof(pcounter_slot), num_slots * sizeof(pcounter_slot));
+    if(NULL == pc->slots) return false;
+    for(uint32_t s = 0; s < num_slots; s++) pc->slots[s].delta = 0;
+    pc->num_slots = num_slots;
+    pc->count = count;
+    pthread_mutex_init(&pc->lock, NULL);
+    return true;
+}
+
+void pcounter_destroy(pcounter *pc)
+{
+    if(NULL == pc->slots) return;
+    free(pc->slots);
+    pc->slots = NULL;
+    pthread_mutex_destroy(&pc->lock);
+}
+
+void pcounter_add(pcounter *pc, int32_t val)
+{
+    if(val >= PCOUNTER_BATCH || val <= -PCOUNTER_BATCH)
+    { // A large change would be folded right away
+        AtomicAdd(pc->count, (uint32_t)val);
+        return;
+    }
+    pcounter_slot *slot = cpu_slot(pc);
+    int32_t delta = AtomicAdd(&slot->delta, val);
+    if(delta >= PCOUNTER_BATCH || delta <= -PCOUNTER_BATCH)
+    {
+        pthread_mutex_lock(&pc->lock);
+        fold_slot(pc, slot);
+        pthread_mutex_unlock(&pc->lock);
+    }
+}
+
+uint32_t pcounter_read(pcounter *pc)
+{
+    // The count goes below 0 (wrapping around) if the deltas add up to more than the value
+    uint32_t count = AtomicLoad(pc->count);
+    return count > UINT32_MAX - max_error(pc) ? pcounter_sum(pc) : count;
+}
+
+uint32_t pcounter_sum(pcounter *pc)
+{
+    pthread_mutex_lock(&pc->lock);
+    // The count wraps around like any uint32_t, so adding the deltas gives the right value
+    uint32_t sum = AtomicLoad(pc->count);
+    for(uint32_t s = 0; s < pc->num_slots; s++) sum += (uint32_t)AtomicLoad(&pc->slots[s].delta);
+    pthread_mutex_unlock(&pc->lock);
+    return sum;
+}
+
+bool pcounter_at_least(pcounter *pc, uint64_t val)
+{
+    uint64_t count = AtomicLoad(pc->count), error = max_error(pc);
+    if(count <= UINT32_MAX - error)
+    {
+        if(count >= val + error) return true;
+        if(count + error < val) return false;
+    }
+    return pcounter_sum(pc) >= val;
+}
+
+void pcounter_fold(pcounter *pc)
+{
+    pthread_mutex_lock(&pc->lock);
+    for(uint32_t s = 0; s < pc->num_slots; s++) fold_slot(pc, &pc->slots[s]);
+    pthread_mutex_unlock(&pc->lock);
+}
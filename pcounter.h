@@ -0,0 +1,80 @@
+/**
+ * CSC369 Assignment 1 - Per-CPU counter header file.
+ *  A count which many threads change at once (e.g. the number of free blocks in the superblock). Each
+ *  change goes to the delta of the CPU the thread is running on, which has a cache line of its own,
+ *  and a delta is only folded into the count once it reaches the batch size. So the threads don't all
+ *  write the same cache line, and the count is off by less than about a batch per CPU.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/** The size a delta grows to before it is folded into the count. */
+#define PCOUNTER_BATCH 64
+
+/** The maximum number of deltas, CPUs share them by their number modulo the number of deltas. */
+#define PCOUNTER_MAX_SLOTS 64
+
+/**
+ * The delta of a CPU, in a cache line of its own
+*/
+typedef struct pcounter_slot {
+    int32_t delta;
+    char    pad[60];
+} __attribute__((aligned(64))) pcounter_slot;
+
+/**
+ * A per-CPU counter
+*/
+typedef struct pcounter {
+    uint32_t        *count;     // The folded count (e.g. a field of the superblock), updated atomically
+    pcounter_slot   *slots;
+    uint32_t         num_slots; // Always a power of 2
+    pthread_mutex_t  lock;      // Held while a delta is folded or all of them are summed
+} pcounter;
+
+/**
+ * Initialize a counter with no deltas
+ *
+ * @param  pc     a pointer to the counter
+ * @param  count  a pointer to the count, which holds the value of the counter until it changes
+ * @return        true on success; false on failure (e.g. a malloc() call failed).
+*/
+bool pcounter_init(pcounter *pc, uint32_t *count);
+
+/**
+ * Free the deltas. They are not folded, since the count may not be mapped anymore, see pcounter_fold().
+*/
+void pcounter_destroy(pcounter *pc);
+
+/**
+ * Add to the counter (subtract, if val is negative)
+*/
+void pcounter_add(pcounter *pc, int32_t val);
+
+/**
+ * Get the value of the counter quickly, without the deltas
+ *
+ * @return  the count, which is off by less than about PCOUNTER_BATCH per CPU
+*/
+uint32_t pcounter_read(pcounter *pc);
+
+/**
+ * Get the exact value of the counter, the count plus all the deltas
+*/
+uint32_t pcounter_sum(pcounter *pc);
+
+/**
+ * Check if the value of the counter is at least val. The deltas are only summed if the count is too
+ * close to val to tell without them.
+*/
+bool pcounter_at_least(pcounter *pc, uint64_t val);
+
+/**
+ * Fold all the deltas into the count, so it holds the exact value (e.g. before the superblock is
+ * written out)
+*/
+void pcounter_fold(pcounter *pc);
@@ -21,9 +21,23 @@
 #include <assert.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define Ceil(numer, denom) (((numer) + (denom) -1) / (denom))
 #define Min(a, b) ((a) < (b) ? (a) : (b))
+#define Max(a, b) ((a) > (b) ? (a) : (b))
+
+// Counters which are read without holding the lock they are updated under (or have no lock) must
+// be accessed atomically. The accesses are sequentially consistent, since some counters are checked
+// against each other (e.g. the free and reserved blocks)
+#define AtomicLoad(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define AtomicAdd(ptr, val) __atomic_add_fetch((ptr), (val), __ATOMIC_SEQ_CST)
+#define AtomicSub(ptr, val) __atomic_sub_fetch((ptr), (val), __ATOMIC_SEQ_CST)
+// Set *ptr to val, returning its old value
+#define AtomicExchange(ptr, val) __atomic_exchange_n((ptr), (val), __ATOMIC_SEQ_CST)
+// Set *ptr to desired if it is *expected; otherwise set *expected to *ptr. True if *ptr was set
+#define AtomicCompareExchange(ptr, expected, desired) \
+	__atomic_compare_exchange_n((ptr), (expected), (desired), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
 
 /** Check if x is a power of 2. */
 static inline bool is_powerof2(size_t x)
@@ -44,3 +58,14 @@ static inline size_t align_up(size_t x, size_t alignment)
 	assert(is_powerof2(alignment));
 	return (x + alignment - 1) & (~alignment + 1);
 }
+
+/** 32-bit FNV-1a hash of a null-terminated string. */
+static inline uint32_t str_hash(const char *str)
+{
+	uint32_t hash = 2166136261u;
+	for (; *str != '\0'; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 16777619u;
+	}
+	return hash;
+}